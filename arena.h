@@ -0,0 +1,77 @@
+//
+// A bump allocator for small, long-lived objects such as interned keys
+// Memory is carved out of large chunks and only given back when the arena is
+// destroyed (or reset), so allocation is a pointer bump and there is no per-object
+// header.  Allocation is thread-safe; it is expected to be rare relative to lookups.
+// An arena may be given a NUMA node, which its chunks are then bound to.
+//
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "numa.h"           // For bind_memory
+
+namespace kjp {
+
+    class arena {
+        #ifdef ARENA_CHUNK_SIZE
+        static constexpr size_t CHUNK_SIZE=ARENA_CHUNK_SIZE;
+        #else
+        static constexpr size_t CHUNK_SIZE=1 << 20;      // Bytes per chunk
+        #endif
+
+        std::mutex mtx;
+        std::vector<char*> chunks;
+        char* cur;                  // Next free byte in the current chunk
+        char* end;                  // End of the current chunk
+        size_t used;                // Bytes handed out so far
+        size_t reserved;            // Bytes in all chunks
+        int home;                   // The node chunks are bound to, or -1
+
+    public:
+        arena() : cur(nullptr), end(nullptr), used(0), reserved(0), home(-1) {}
+        arena( const arena& ) = delete;
+        arena& operator=( const arena& ) = delete;
+        ~arena() { reset(); }
+
+        // Returns n bytes aligned to align (a power of two)
+        void* allocate( size_t n, size_t align=alignof(std::max_align_t) ) {
+            std::lock_guard<std::mutex> lg( mtx );
+            uintptr_t p = ( reinterpret_cast<uintptr_t>( cur ) + align - 1 ) & ~( uintptr_t( align ) - 1 );
+            if ( cur == nullptr || p + n > reinterpret_cast<uintptr_t>( end ) ) {
+                size_t sz = n + align > CHUNK_SIZE ? n + align : CHUNK_SIZE;
+                char* c = new char[sz];
+                if ( home >= 0 ) bind_memory( c, sz, home );    // Best effort, before first touch
+                chunks.push_back( c );
+                reserved += sz;
+                cur = c;
+                end = c + sz;
+                p = ( reinterpret_cast<uintptr_t>( cur ) + align - 1 ) & ~( uintptr_t( align ) - 1 );
+            }
+            cur = reinterpret_cast<char*>( p + n );
+            used += n;
+            return reinterpret_cast<void*>( p );
+        }
+
+        // Bind the chunks allocated from now on to node (a sysfs node number)
+        void set_home_node( int node ) { home = node; }
+
+        // Bytes handed out, and bytes reserved from the system
+        size_t bytes_used() const { return used; }
+        size_t bytes_reserved() const { return reserved; }
+
+        // Free everything.  Nobody may be using memory from the arena.
+        void reset() {
+            for( auto c : chunks ) delete[] c;
+            chunks.clear();
+            cur = end = nullptr;
+            used = reserved = 0;
+        }
+    };
+}
+
+#endif
@@ -3,6 +3,12 @@
 // Based upon one by Scherer, Lea, and Scott
 //    "Scalable Synchronous Queues" in PPoPP '06
 //
+// And a bounded lock-free MPMC ring, after Dmitry Vyukov's bounded MPMC queue: every
+// cell carries a sequence number saying whether it is ready to be written or read on
+// the current lap, so producers and consumers only contend on their own index.  A
+// producer that finds it full backs off (spinning, then yielding, then napping) until
+// a consumer makes room, which is what throttles a producer that gets ahead.
+//
 // Implemented by Kenneth Platz @kjplatz
 //
 #ifndef __LFQUEUE__
@@ -13,8 +19,13 @@
 #endif
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <thread>
 
 namespace kjp {
 
@@ -93,6 +104,124 @@ namespace kjp {
             return result;
         }
     };
+
+    namespace detail {
+        // Wait a little longer each time round a retry loop
+        inline void backoff( unsigned attempt ) {
+            if ( attempt < 16 ) return;
+            if ( attempt < 256 ) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for( std::chrono::microseconds( 50 ) );
+            }
+        }
+    }
+
+    template <typename T>
+    class boundedQueue {
+        struct cell {
+            std::atomic<size_t> seq;        // pos: free for the enqueuer at pos; pos+1: full
+            T value;
+        };
+
+        std::unique_ptr<cell[]> cells;
+        size_t mask;
+        char pad0[64];
+        std::atomic<size_t> head;           // Next position to enqueue at
+        char pad1[64];                      // Keep producers and consumers off each other's line
+        std::atomic<size_t> tail;           // Next position to dequeue from
+        char pad2[64];
+
+    public:
+        // The capacity is rounded up to a power of two
+        explicit boundedQueue( size_t capacity ) : head(0), tail(0) {
+            size_t n = 2;
+            while( n < capacity ) n *= 2;
+            cells.reset( new cell[n] );
+            mask = n - 1;
+            for( size_t i=0; i<n; ++i ) cells[i].seq.store( i, std::memory_order_relaxed );
+        }
+        boundedQueue( const boundedQueue& ) = delete;
+        boundedQueue& operator=( const boundedQueue& ) = delete;
+
+        size_t capacity() const { return mask + 1; }
+
+        // Approximate, unless nobody else is using the queue
+        size_t size() const {
+            size_t t = tail.load( std::memory_order_relaxed );
+            size_t h = head.load( std::memory_order_relaxed );
+            return h > t ? h - t : 0;
+        }
+        bool empty() const { return size() == 0; }
+
+        // Returns false if the queue is full
+        bool try_enq( const T& item ) {
+            size_t pos = head.load( std::memory_order_relaxed );
+            cell* c;
+            while( true ) {
+                c = &cells[pos & mask];
+                size_t seq = c->seq.load( std::memory_order_acquire );
+                intptr_t dif = intptr_t( seq ) - intptr_t( pos );
+                if ( dif == 0 ) {
+                    if ( head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) break;
+                } else if ( dif < 0 ) {
+                    return false;           // The cell still holds last lap's item
+                } else {
+                    pos = head.load( std::memory_order_relaxed );
+                }
+            }
+            c->value = item;
+            c->seq.store( pos + 1, std::memory_order_release );
+            return true;
+        }
+
+        // Enqueue an item, waiting for room if the queue is full
+        void enq( const T& item ) {
+            for( unsigned attempt=0; !try_enq( item ); ++attempt ) detail::backoff( attempt );
+        }
+
+        // Returns false if the queue is empty
+        bool try_deq( T& out ) {
+            return deq_batch( &out, 1 ) == 1;
+        }
+
+        // Dequeue an entry, waiting for one if the queue is empty
+        T deq() {
+            T result;
+            for( unsigned attempt=0; !try_deq( result ); ++attempt ) detail::backoff( attempt );
+            return result;
+        }
+
+        // Dequeue up to n entries into out, with a single compare-and-swap for the lot.
+        // Returns how many were taken, 0 if the queue is empty.
+        size_t deq_batch( T* out, size_t n ) {
+            if ( n > mask + 1 ) n = mask + 1;
+            size_t pos = tail.load( std::memory_order_relaxed );
+            size_t k;
+            while( true ) {
+                // How many consecutive cells from pos are full on this lap?
+                for( k=0; k<n; ++k ) {
+                    size_t seq = cells[( pos + k ) & mask].seq.load( std::memory_order_acquire );
+                    if ( intptr_t( seq ) - intptr_t( pos + k + 1 ) != 0 ) break;
+                }
+                if ( k == 0 ) {
+                    size_t seq = cells[pos & mask].seq.load( std::memory_order_acquire );
+                    if ( intptr_t( seq ) - intptr_t( pos + 1 ) < 0 ) return 0;   // Empty
+                    pos = tail.load( std::memory_order_relaxed );              // Someone beat us to it
+                    continue;
+                }
+                // Only consumers move tail, so once we own [pos, pos+k) nobody else will
+                // touch those cells until we hand them back
+                if ( tail.compare_exchange_weak( pos, pos + k, std::memory_order_relaxed ) ) break;
+            }
+            for( size_t i=0; i<k; ++i ) {
+                cell& c = cells[( pos + i ) & mask];
+                out[i] = std::move( c.value );
+                c.seq.store( pos + i + mask + 1, std::memory_order_release );
+            }
+            return k;
+        }
+    };
 }
 
 #endif
@@ -0,0 +1,142 @@
+//
+// gencorpus - write a synthetic corpus with Zipf-distributed word frequencies
+//
+// Usage: gencorpus [options] <dir>
+//     -s <size>   : Total bytes to write, with an optional k, m or g suffix (default: 64m)
+//     -f <num>    : Number of files (default: 256)
+//     -D <num>    : Spread the files over this many subdirectories (default: 16)
+//     -v <num>    : Vocabulary size (default: 100000)
+//     -z <exp>    : Zipf exponent (default: 1.0)
+//     -S <seed>   : Random seed (default: 1)
+//
+// The files are named <dir>/d<k>/f<i>.txt.  A summary of what was written, including
+// the exact number of words, is printed to stdout as JSON.
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static bool parse_size( const char* s, unsigned long long& out ) {
+    char* end;
+    unsigned long long v = strtoull( s, &end, 10 );
+    if ( end == s ) return false;
+    switch( *end ) {
+    case 'k': case 'K': v <<= 10; ++end; break;
+    case 'm': case 'M': v <<= 20; ++end; break;
+    case 'g': case 'G': v <<= 30; ++end; break;
+    }
+    if ( *end != '\0' ) return false;
+    out = v;
+    return true;
+}
+
+static void usage( const char* name ) {
+    cerr << "Usage: " << name << " [-s size] [-f files] [-D dirs] [-v vocabulary] [-z exponent] [-S seed] <dir>" << endl;
+}
+
+int main( int argc, char** argv ) {
+    unsigned long long size = 64ULL << 20;
+    long nfiles = 256, ndirs = 16, vocab = 100000;
+    double zexp = 1.0;
+    unsigned long seed = 1;
+
+    int c;
+    while( ( c = getopt( argc, argv, "s:f:D:v:z:S:h" ) ) >= 0 ) {
+        switch( c ) {
+        case 's' :
+            if ( !parse_size( optarg, size ) ) {
+                cerr << "Error: Invalid size: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case 'f' : nfiles = atol( optarg ); break;
+        case 'D' : ndirs = atol( optarg ); break;
+        case 'v' : vocab = atol( optarg ); break;
+        case 'z' : zexp = atof( optarg ); break;
+        case 'S' : seed = strtoul( optarg, nullptr, 10 ); break;
+        default  : usage( argv[0] ); return c == 'h' ? 0 : 1;
+        }
+    }
+    if ( optind != argc - 1 || nfiles < 1 || ndirs < 1 || vocab < 1 || zexp <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    string root = argv[optind];
+
+    mt19937_64 g( seed );
+
+    // The vocabulary: random words of 1-12 letters and digits, some capitalized, shorter
+    // words tending to be the more frequent ones as in real text.  A few may repeat; the
+    // word count reported is exact regardless.
+    static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    vector<string> words;
+    words.reserve( vocab );
+    for( long r=0; r<vocab; ++r ) {
+        size_t maxlen = min<size_t>( 12, 2 + log2( r + 2 ) );
+        size_t len = uniform_int_distribution<size_t>( 1, maxlen )( g );
+        string w( len, ' ' );
+        for( auto& ch : w ) ch = g() % 8 == 0 ? alnum[26 + g() % 10] : alnum[g() % 26];
+        if ( g() % 16 == 0 ) w[0] = toupper( w[0] );
+        words.push_back( w );
+    }
+
+    // Cumulative Zipf probabilities, for sampling a rank by binary search
+    vector<double> cdf( vocab );
+    double total = 0;
+    for( long r=0; r<vocab; ++r ) {
+        total += 1.0 / pow( r + 1, zexp );
+        cdf[r] = total;
+    }
+    uniform_real_distribution<double> u( 0, total );
+
+    static const char* seps[] = { " ", " ", " ", " ", " ", ", ", ". ", "\n", " - " };
+    unsigned long long written = 0, nwords = 0;
+    unsigned long long perfile = size / nfiles + 1;
+
+    mkdir( root.c_str(), 0755 );
+    for( long d=0; d<ndirs && d<nfiles; ++d ) {
+        string dir = root + "/d" + to_string( d );
+        if ( mkdir( dir.c_str(), 0755 ) < 0 && errno != EEXIST ) {
+            cerr << "Error: Cannot create " << dir << ": " << strerror( errno ) << endl;
+            return 1;
+        }
+    }
+
+    string buf;
+    for( long f=0; f<nfiles; ++f ) {
+        string name = root + "/d" + to_string( f % ndirs ) + "/f" + to_string( f ) + ".txt";
+        ofstream out( name, ios::binary | ios::trunc );
+        if ( !out ) {
+            cerr << "Error: Cannot create " << name << ": " << strerror( errno ) << endl;
+            return 1;
+        }
+        buf.clear();
+        while( buf.size() < perfile && written + buf.size() < size ) {
+            long r = lower_bound( cdf.begin(), cdf.end(), u( g ) ) - cdf.begin();
+            if ( r >= vocab ) r = vocab - 1;
+            buf += words[r];
+            buf += seps[g() % ( sizeof(seps) / sizeof(seps[0]) )];
+            ++nwords;
+        }
+        out << buf;
+        written += buf.size();
+    }
+
+    cout << "{ \"dir\": \"" << root << "\", \"bytes\": " << written << ", \"words\": " << nwords
+         << ", \"files\": " << nfiles << ", \"vocabulary\": " << vocab << ", \"zipf\": " << zexp
+         << ", \"seed\": " << seed << " }" << endl;
+    return 0;
+}
@@ -0,0 +1,151 @@
+//
+// hashbench - compare the string hash functions used by stripedhashcounter
+//
+// For a set of distinct keys (the words of the given files, or random words) this
+// reports, for the original polynomial hash and for the default 64-bit hash:
+//     - hashing speed
+//     - collisions when the keys are placed in a table of a given size, and how many
+//       keys would have needed more than maxcollisions probes (i.e. forced a resize)
+//     - insert throughput and number of resizes in a real stripedhashcounter
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../hash.h"
+#include "../stripedhash.h"
+#include "../tokenizer.h"
+
+using namespace std;
+
+int debug = false;
+
+static double seconds_since( chrono::steady_clock::time_point start ) {
+    return chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+}
+
+static vector<string> load_words( int argc, char** argv, size_t nrandom ) {
+    unordered_set<string> seen;
+    vector<string> keys;
+    if ( argc > 1 ) {
+        kjp::tokenizer tok;
+        auto emit = [&]( const char* p, size_t len ) {
+            string w( p, len );
+            if ( seen.insert( w ).second ) keys.push_back( w );
+        };
+        for( int i=1; i<argc; ++i ) {
+            ifstream in( argv[i] );
+            stringstream ss;
+            ss << in.rdbuf();
+            string s = ss.str();
+            tok.scan( s.data(), s.size(), emit );
+            tok.finish( emit );
+        }
+        return keys;
+    }
+    mt19937_64 g( 42 );
+    uniform_int_distribution<int> len( 1, 12 ), ch( 'a', 'z' );
+    while( keys.size() < nrandom ) {
+        string w( len( g ), ' ' );
+        for( auto& c : w ) c = ch( g );
+        if ( seen.insert( w ).second ) keys.push_back( w );
+    }
+    return keys;
+}
+
+struct placement {
+    long home_collisions;   // Keys whose first probe was taken
+    long overflows;         // Keys needing more than maxcollisions probes
+    long max_probes;
+};
+
+// Place keys into nslots slots given a slot function slot( key, i )
+template <typename F>
+static placement place( const vector<string>& keys, size_t nslots, int mc, F slot ) {
+    vector<bool> used( nslots, false );
+    placement p{ 0, 0, 0 };
+    for( const auto& k : keys ) {
+        size_t i = 0;
+        while( used[slot( k, i )] ) ++i;
+        used[slot( k, i )] = true;
+        if ( i > 0 ) ++p.home_collisions;
+        if ( (int)i >= mc ) ++p.overflows;
+        if ( (long)i + 1 > p.max_probes ) p.max_probes = i + 1;
+    }
+    return p;
+}
+
+template <typename H>
+static void throughput( const char* name, const vector<string>& keys, int nthreads, int reps ) {
+    stripedhashcounter<string, H> t;
+    auto start = chrono::steady_clock::now();
+    vector<thread> ts;
+    for( int n=0; n<nthreads; ++n ) {
+        ts.emplace_back( [&t, &keys, reps, n, nthreads]() {
+            for( int r=0; r<reps; ++r ) {
+                for( size_t i=n; i<keys.size(); i+=nthreads ) t.insert( keys[i] );
+            }
+        } );
+    }
+    for( auto& it : ts ) it.join();
+    double secs = seconds_since( start );
+    cout << "  " << name << ": " << ( keys.size() * reps / secs / 1e6 ) << " M inserts/s, "
+         << t.get_resize_stats().resizes << " resizes" << endl;
+}
+
+int main( int argc, char** argv ) {
+    const int mc = 8;
+    vector<string> keys = load_words( argc, argv, 200000 );
+    size_t nslots = 8;
+    while( nslots < keys.size() * 4 ) nslots *= 2;      // Load factor between 1/8 and 1/4
+
+    cout << keys.size() << " distinct keys, " << nslots << " slots" << endl;
+
+    mt19937_64 g( 1 );
+    uint64_t seed = g();
+    kjp::polyhash poly;
+    kjp::hash<string> fast;
+
+    cout << "Hashing speed:" << endl;
+    for( int which=0; which<2; ++which ) {
+        uint64_t sink = 0;
+        auto start = chrono::steady_clock::now();
+        for( int r=0; r<10; ++r ) {
+            for( const auto& k : keys ) sink += which ? fast( k, seed ) : poly( k, seed );
+        }
+        double ns = seconds_since( start ) * 1e9 / ( keys.size() * 10 );
+        cout << "  " << ( which ? "wyhash  " : "polyhash" ) << ": " << ns << " ns/key"
+             << ( sink == 42 ? " " : "" ) << endl;
+    }
+
+    // The table as it used to be: ha in [1,sz), mod 2*sz+1, quadratic probing mod sz
+    uniform_int_distribution<long long> dist( 1, nslots - 1 );
+    long long ha = dist( g ), hp = 2 * nslots + 1;
+    placement old = place( keys, nslots, mc, [&]( const string& k, size_t i ) {
+        long long h = 0;
+        for( const unsigned char c : k ) h = ( h * ha + c ) % hp;
+        return size_t( ( h + i * i ) % nslots );
+    } );
+    placement cur = place( keys, nslots, mc, [&]( const string& k, size_t i ) {
+        return size_t( ( fast( k, seed ) + i * ( i + 1 ) / 2 ) & ( nslots - 1 ) );
+    } );
+    cout << "Collisions (home slot taken / over " << mc << " probes / longest probe):" << endl;
+    cout << "  original: " << old.home_collisions << " / " << old.overflows << " / " << old.max_probes << endl;
+    cout << "  wyhash  : " << cur.home_collisions << " / " << cur.overflows << " / " << cur.max_probes << endl;
+
+    int nthreads = thread::hardware_concurrency();
+    if ( nthreads < 1 ) nthreads = 1;
+    cout << "stripedhashcounter inserts (" << nthreads << " threads):" << endl;
+    throughput<kjp::polyhash>( "polyhash", keys, nthreads, 5 );
+    throughput<kjp::hash<string>>( "wyhash  ", keys, nthreads, 5 );
+    return 0;
+}
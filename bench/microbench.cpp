@@ -0,0 +1,211 @@
+//
+// microbench - throughput of the pieces ssfi is built from, as JSON
+//
+// Usage: microbench [-n <ops>] [-t <threads>]
+//     -n <ops>     : Operations per benchmark (default: 2000000)
+//     -t <threads> : Threads for the concurrent benchmarks (default: all cores)
+//
+// Reports:
+//     - stripedhashcounter::insert of Zipf-distributed words, on 1 thread ("single") and <threads> ("threaded")
+//     - unboundedQueue enq/deq, one producer and one consumer, and <threads> of each
+//     - workstealing_pool submit/next/done, for comparison with the queue
+//     - each tokenizer engine over an in-memory text, in MB/s and words/s
+//     - the same in UTF-8 mode, over that text and over one a third Greek and a third
+//       Cyrillic
+//
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../bdqueue.h"
+#include "../stripedhash.h"
+#include "../tokenizer.h"
+#include "../wsqueue.h"
+
+using namespace std;
+
+int debug = false;
+
+static double seconds_since( chrono::steady_clock::time_point start ) {
+    return chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+}
+
+// n words drawn from a Zipf(1) distribution over a vocabulary of vocab random words
+static vector<string> zipf_words( size_t n, size_t vocab ) {
+    mt19937_64 g( 7 );
+    vector<string> words;
+    uniform_int_distribution<int> len( 1, 10 ), ch( 'a', 'z' );
+    for( size_t i=0; i<vocab; ++i ) {
+        string w( len( g ), ' ' );
+        for( auto& c : w ) c = ch( g );
+        words.push_back( w );
+    }
+    vector<double> cdf( vocab );
+    double total = 0;
+    for( size_t r=0; r<vocab; ++r ) cdf[r] = total += 1.0 / ( r + 1 );
+    uniform_real_distribution<double> u( 0, total );
+
+    vector<string> out;
+    out.reserve( n );
+    for( size_t i=0; i<n; ++i ) {
+        size_t r = lower_bound( cdf.begin(), cdf.end(), u( g ) ) - cdf.begin();
+        out.push_back( words[min( r, vocab - 1 )] );
+    }
+    return out;
+}
+
+// Inserts per second into a fresh table from nthreads threads
+static double bench_insert( const vector<string>& keys, int nthreads ) {
+    stripedhashcounter<string> t;
+    auto start = chrono::steady_clock::now();
+    vector<thread> ts;
+    for( int n=0; n<nthreads; ++n ) {
+        ts.emplace_back( [&t, &keys, n, nthreads]() {
+            for( size_t i=n; i<keys.size(); i+=nthreads ) t.insert( keys[i] );
+        } );
+    }
+    for( auto& it : ts ) it.join();
+    return keys.size() / seconds_since( start );
+}
+
+// Items per second through an unboundedQueue with nthreads producers and as many consumers
+static double bench_queue( long n, int nthreads ) {
+    kjp::unboundedQueue<string> q;
+    long per = n / nthreads;
+    auto start = chrono::steady_clock::now();
+    vector<thread> ts;
+    for( int p=0; p<nthreads; ++p ) {
+        ts.emplace_back( [&q, per]() {
+            for( long i=0; i<per; ++i ) q.enq( "/some/path/to/a/file.txt" );
+        } );
+        ts.emplace_back( [&q, per]() {
+            for( long i=0; i<per; ++i ) q.deq();
+        } );
+    }
+    for( auto& it : ts ) it.join();
+    return per * nthreads / seconds_since( start );
+}
+
+// Tasks per second through a workstealing_pool: one seed task per worker, each of
+// which submits the rest of its share to its own deque, as a directory listing does
+static double bench_pool( long n, int nthreads ) {
+    struct item { long left; };
+    kjp::workstealing_pool<item> pool( nthreads );
+    atomic<long> done( 0 );
+    long per = n / nthreads;
+    vector<thread> ts;
+    auto start = chrono::steady_clock::now();
+    for( int w=0; w<nthreads; ++w ) {
+        ts.emplace_back( [&pool, &done, w]() {
+            item* it;
+            while( pool.next( w, it ) ) {
+                if ( it->left > 0 ) pool.submit( new item{ it->left - 1 }, w );
+                delete it;
+                done.fetch_add( 1, memory_order_relaxed );
+                pool.done();
+            }
+        } );
+    }
+    for( int w=0; w<nthreads; ++w ) pool.submit( new item{ per - 1 } );
+    pool.wait();
+    double secs = seconds_since( start );
+    pool.shutdown();
+    for( auto& it : ts ) it.join();
+    return done.load() / secs;
+}
+
+int main( int argc, char** argv ) {
+    long nops = 2000000;
+    int nthreads = thread::hardware_concurrency();
+
+    int c;
+    while( ( c = getopt( argc, argv, "n:t:" ) ) >= 0 ) {
+        switch( c ) {
+        case 'n' : nops = atol( optarg ); break;
+        case 't' : nthreads = atoi( optarg ); break;
+        default  : cerr << "Usage: " << argv[0] << " [-n ops] [-t threads]" << endl; return 1;
+        }
+    }
+    if ( nthreads < 1 ) nthreads = 1;
+    if ( nops < nthreads ) nops = nthreads;
+
+    vector<string> keys = zipf_words( nops, 100000 );
+
+    ostringstream js;
+    js << "{ \"threads\": " << nthreads << ", \"ops\": " << nops << "," << endl;
+    js << "  \"insert_per_s\": { \"single\": " << bench_insert( keys, 1 )
+       << ", \"threaded\": " << bench_insert( keys, nthreads ) << " }," << endl;
+    js << "  \"queue_per_s\": { \"single\": " << bench_queue( nops, 1 )
+       << ", \"threaded\": " << bench_queue( nops, nthreads ) << " }," << endl;
+    js << "  \"pool_per_s\": { \"single\": " << bench_pool( nops, 1 )
+       << ", \"threaded\": " << bench_pool( nops, nthreads ) << " }," << endl;
+
+    // The same words as text, for the tokenizers
+    string text;
+    for( size_t i=0; i<keys.size(); ++i ) {
+        text += keys[i];
+        text += ( i % 13 == 12 ) ? "\n" : ( i % 7 == 6 ) ? ", " : " ";
+    }
+    // And again with two thirds of the words in two-byte scripts
+    static const char* const greek[] = { "α", "β", "Γ", "δ", "ε", "ζ", "Η", "θ", "ι", "κ", "λ", "Μ", "ν",
+                                         "ξ", "ο", "π", "Ρ", "σ", "τ", "υ", "Φ", "χ", "ψ", "ω", "ά", "έ" };
+    static const char* const cyrillic[] = { "а", "б", "в", "Г", "д", "е", "ж", "з", "И", "й", "к", "л", "м",
+                                            "Н", "о", "п", "р", "с", "Т", "у", "ф", "х", "ц", "Ч", "ш", "я" };
+    string mixed;
+    for( size_t i=0; i<keys.size(); ++i ) {
+        for( char c : keys[i] ) {
+            if ( c < 'a' || c > 'z' || i % 3 == 0 ) {
+                mixed += c;
+            } else {
+                mixed += ( i % 3 == 1 ? greek : cyrillic )[c - 'a'];
+            }
+        }
+        mixed += ( i % 13 == 12 ) ? "\n" : ( i % 7 == 6 ) ? ", " : " ";
+    }
+
+    auto bench_tokenizer = []( kjp::tokenizer_engine e, bool utf8, const string& text ) {
+        kjp::tokenizer tok( e, utf8 );
+        long words = 0;
+        auto emit = [&words]( const char*, size_t ) { ++words; };
+        auto start = chrono::steady_clock::now();
+        tok.scan( text.data(), text.size(), emit );
+        tok.finish( emit );
+        double secs = seconds_since( start );
+        ostringstream os;
+        os << "{ \"mb_per_s\": " << text.size() / secs / 1e6 << ", \"words_per_s\": " << words / secs << " }";
+        return os.str();
+    };
+
+    const kjp::tokenizer_engine engines[] = { kjp::tokenizer_engine::scalar, kjp::tokenizer_engine::sse2,
+                                              kjp::tokenizer_engine::avx2 };
+    for( int utf8=0; utf8<2; ++utf8 ) {
+        if ( utf8 ) js << "," << endl;
+        js << ( utf8 ? "  \"tokenizer_utf8\": {" : "  \"tokenizer\": {" );
+        bool first = true;
+        for( auto e : engines ) {
+            if ( kjp::resolve_tokenizer_engine( e ) != e ) continue;   // Not on this CPU
+            js << ( first ? "" : "," ) << endl << "    \"" << kjp::tokenizer_engine_name( e ) << "\": ";
+            if ( utf8 ) {
+                js << "{ \"ascii\": " << bench_tokenizer( e, true, text )
+                   << ", \"multilingual\": " << bench_tokenizer( e, true, mixed ) << " }";
+            } else {
+                js << bench_tokenizer( e, false, text );
+            }
+            first = false;
+        }
+        js << endl << "  }";
+    }
+    js << endl << "}" << endl;
+    cout << js.str();
+    return 0;
+}
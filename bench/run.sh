@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# run.sh - the benchmark suite behind "make bench"
+#
+# Generates a Zipf corpus (unless one is already there), runs the microbenchmarks,
+# then times ssfi over the corpus with -N 1 up to the number of cores.  Everything is
+# reported as one JSON object on stdout.
+#
+# Settings, from the environment (make passes its variables of the same names):
+#     BENCH_DIR     Where the corpus lives (default: /tmp/ssfi-bench)
+#     BENCH_SIZE    Corpus size, with a k, m or g suffix (default: 64m)
+#     BENCH_FILES   Number of files (default: 256)
+#     BENCH_VOCAB   Vocabulary size (default: 100000)
+#     BENCH_ZIPF    Zipf exponent (default: 1.0)
+#     BENCH_OPS     Operations per microbenchmark (default: 2000000)
+#     BENCH_ARGS    Extra ssfi options for the end-to-end runs
+#
+# A corpus is regenerated whenever the settings it was made with change.
+#
+
+set -e
+
+BIN=$(dirname "$0")
+BENCH_DIR=${BENCH_DIR:-/tmp/ssfi-bench}
+BENCH_SIZE=${BENCH_SIZE:-64m}
+BENCH_FILES=${BENCH_FILES:-256}
+BENCH_VOCAB=${BENCH_VOCAB:-100000}
+BENCH_ZIPF=${BENCH_ZIPF:-1.0}
+BENCH_OPS=${BENCH_OPS:-2000000}
+CORES=$(nproc 2>/dev/null || echo 1)
+
+settings="$BENCH_SIZE $BENCH_FILES $BENCH_VOCAB $BENCH_ZIPF"
+if [ ! -f "$BENCH_DIR.json" ] || [ "$(cat "$BENCH_DIR.settings" 2>/dev/null)" != "$settings" ]; then
+    rm -rf "$BENCH_DIR"
+    "$BIN/gencorpus" -s "$BENCH_SIZE" -f "$BENCH_FILES" -v "$BENCH_VOCAB" -z "$BENCH_ZIPF" \
+        "$BENCH_DIR" > "$BENCH_DIR.json"
+    echo "$settings" > "$BENCH_DIR.settings"
+fi
+corpus=$(cat "$BENCH_DIR.json")
+bytes=$(echo "$corpus" | sed 's/.*"bytes": \([0-9]*\).*/\1/')
+words=$(echo "$corpus" | sed 's/.*"words": \([0-9]*\).*/\1/')
+
+micro=$("$BIN/microbench" -n "$BENCH_OPS" -t "$CORES")
+
+# One warm-up run so that every timed run reads the corpus from the page cache
+"$BIN/ssfi" -N "$CORES" $BENCH_ARGS "$BENCH_DIR" > /dev/null
+
+runs=""
+n=1
+while [ "$n" -le "$CORES" ]; do
+    start=$(date +%s.%N)
+    "$BIN/ssfi" -N "$n" $BENCH_ARGS "$BENCH_DIR" > /dev/null
+    end=$(date +%s.%N)
+    run=$(awk -v n="$n" -v s="$start" -v e="$end" -v b="$bytes" -v w="$words" 'BEGIN {
+        t = e - s; if ( t <= 0 ) t = 1e-9
+        printf "{ \"threads\": %d, \"seconds\": %.3f, \"mb_per_s\": %.1f, \"words_per_s\": %.0f }", n, t, b / t / 1e6, w / t
+    }')
+    runs="$runs${runs:+,
+    }$run"
+    n=$((n + 1))
+done
+
+cat <<EOF
+{ "corpus": $corpus,
+  "micro": $micro,
+  "end_to_end": [
+    $runs
+  ]
+}
+EOF
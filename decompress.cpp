@@ -0,0 +1,229 @@
+//
+// Compressed input
+//
+
+#include "decompress.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace kjp {
+
+namespace {
+    #ifdef DECOMPRESS_MIN_SPACE
+    constexpr size_t MIN_SPACE=DECOMPRESS_MIN_SPACE;
+    #else
+    constexpr size_t MIN_SPACE=256*1024;        // Room made for output per step
+    #endif
+
+    bool has_suffix( const char* name, size_t len, const char* suffix ) {
+        size_t n = strlen( suffix );
+        return len > n && strncasecmp( name + len - n, suffix, n ) == 0;
+    }
+
+    // Make room for more output after the first used bytes of out: want bytes in all if
+    // we know that's how much is coming, otherwise at least MIN_SPACE more
+    void make_room( std::vector<char>& out, size_t used, size_t want ) {
+        if ( want > used ) {
+            if ( out.size() < want ) out.resize( want );
+        } else if ( out.size() - used < MIN_SPACE ) {
+            out.resize( used + MIN_SPACE );
+        }
+    }
+
+    // Hand on the used bytes of out once there are enough of them
+    void hand_on( std::vector<char>& out, size_t& used, size_t block, const block_fn& emit, bool last ) {
+        if ( !last && used < block ) return;
+        out.resize( used );
+        emit( out, last );
+        used = out.size();
+    }
+
+#ifdef HAVE_ZLIB
+    bool gunzip( const char* data, size_t len, size_t block, const block_fn& emit, std::string& err ) {
+        z_stream zs;
+        memset( &zs, 0, sizeof( zs ) );
+        if ( inflateInit2( &zs, 15 + 32 ) != Z_OK ) {       // +32: gzip or zlib header
+            err = "cannot initialize zlib";
+            return false;
+        }
+
+        // The trailer gives the size of the last member, modulo 4G; if that's the whole
+        // file it can be inflated in one go
+        size_t want = 0;
+        if ( len >= 18 && len <= block ) {
+            const unsigned char* t = reinterpret_cast<const unsigned char*>( data + len - 4 );
+            want = ( size_t( t[0] ) | size_t( t[1] ) << 8 | size_t( t[2] ) << 16 | size_t( t[3] ) << 24 ) + 1;
+            if ( want > block ) want = 0;
+        }
+
+        std::vector<char> out;
+        size_t used = 0;
+        size_t fed = 0;
+        bool ok = true;
+        while( true ) {
+            if ( zs.avail_in == 0 ) {
+                size_t n = std::min<size_t>( len - fed, UINT_MAX );
+                zs.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data + fed ) );
+                zs.avail_in = n;
+                fed += n;
+            }
+            make_room( out, used, want );
+            size_t space = std::min<size_t>( out.size() - used, UINT_MAX );
+            zs.next_out = reinterpret_cast<Bytef*>( out.data() + used );
+            zs.avail_out = space;
+
+            int rc = inflate( &zs, Z_NO_FLUSH );
+            used += space - zs.avail_out;
+            if ( rc == Z_STREAM_END ) {
+                // Concatenated members make one stream; anything else after is ignored,
+                // as gzip does
+                size_t rest = zs.avail_in + ( len - fed );
+                const unsigned char* next = reinterpret_cast<const unsigned char*>( data + len - rest );
+                if ( rest < 2 || next[0] != 0x1f || next[1] != 0x8b || inflateReset( &zs ) != Z_OK ) break;
+                want = 0;
+            } else if ( rc == Z_BUF_ERROR && zs.avail_in == 0 && fed == len ) {
+                err = "unexpected end of file";
+                ok = false;
+                break;
+            } else if ( rc != Z_OK && rc != Z_BUF_ERROR ) {
+                err = zs.msg ? zs.msg : "corrupt input";
+                ok = false;
+                break;
+            }
+            hand_on( out, used, block, emit, false );
+        }
+        inflateEnd( &zs );
+        if ( ok ) hand_on( out, used, block, emit, true );
+        return ok;
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    bool unzstd( const char* data, size_t len, size_t block, const block_fn& emit, std::string& err ) {
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        if ( !dctx ) {
+            err = "cannot initialize zstd";
+            return false;
+        }
+
+        // A single frame that records its size can be decompressed in one go
+        size_t want = 0;
+        if ( len <= block && ZSTD_findFrameCompressedSize( data, len ) == len ) {
+            unsigned long long n = ZSTD_getFrameContentSize( data, len );
+            if ( n != ZSTD_CONTENTSIZE_UNKNOWN && n != ZSTD_CONTENTSIZE_ERROR && n < block ) want = n + 1;
+        }
+
+        std::vector<char> out;
+        size_t used = 0;
+        ZSTD_inBuffer in = { data, len, 0 };
+        size_t rc = 0;
+        bool ok = true;
+        while( in.pos < in.size || rc != 0 ) {
+            make_room( out, used, want );
+            ZSTD_outBuffer ob = { out.data() + used, out.size() - used, 0 };
+            size_t before = in.pos;
+            rc = ZSTD_decompressStream( dctx, &ob, &in );
+            used += ob.pos;
+            if ( ZSTD_isError( rc ) ) {
+                err = ZSTD_getErrorName( rc );
+                ok = false;
+                break;
+            }
+            if ( rc != 0 && in.pos == in.size && in.pos == before && ob.pos < ob.size ) {
+                err = "unexpected end of file";     // Wants more input than there is
+                ok = false;
+                break;
+            }
+            hand_on( out, used, block, emit, false );
+        }
+        ZSTD_freeDCtx( dctx );
+        if ( ok ) hand_on( out, used, block, emit, true );
+        return ok;
+    }
+#endif
+}
+
+compression compression_of( const char* name, size_t len, size_t* stem ) {
+    compression c = compression::none;
+    size_t n = len;
+    if ( has_suffix( name, len, ".gz" ) ) {
+        c = compression::gzip;
+        n = len - 3;
+    } else if ( has_suffix( name, len, ".zst" ) ) {
+        c = compression::zstd;
+        n = len - 4;
+    }
+    if ( stem ) *stem = n;
+    return c;
+}
+
+const char* compression_name( compression c ) {
+    return c == compression::gzip ? "gzip" : c == compression::zstd ? "zstd" : "none";
+}
+
+bool compression_supported( compression c ) {
+    switch( c ) {
+    case compression::none: return true;
+    #ifdef HAVE_ZLIB
+    case compression::gzip: return true;
+    #endif
+    #ifdef HAVE_ZSTD
+    case compression::zstd: return true;
+    #endif
+    default: return false;
+    }
+}
+
+bool decompress( compression c, const char* data, size_t len, size_t block,
+                 const block_fn& emit, std::string& err ) {
+    if ( block == 0 ) block = 1;
+    switch( c ) {
+    #ifdef HAVE_ZLIB
+    case compression::gzip: return gunzip( data, len, block, emit, err );
+    #endif
+    #ifdef HAVE_ZSTD
+    case compression::zstd: return unzstd( data, len, block, emit, err );
+    #endif
+    default:
+        err = std::string( "no " ) + compression_name( c ) + " support in this build";
+        return false;
+    }
+}
+
+bool zstd_frames( const char* data, size_t len, std::vector<std::pair<size_t,size_t>>& frames,
+                  std::string& err ) {
+    frames.clear();
+#ifdef HAVE_ZSTD
+    for( size_t pos=0; pos<len; ) {
+        size_t n = ZSTD_findFrameCompressedSize( data + pos, len - pos );
+        if ( ZSTD_isError( n ) ) {
+            err = ZSTD_getErrorName( n );
+            return false;
+        }
+        // Skippable frames have magic numbers 0x184d2a50 through 0x184d2a5f
+        const unsigned char* m = reinterpret_cast<const unsigned char*>( data + pos );
+        bool skippable = ( m[0] & 0xf0 ) == 0x50 && m[1] == 0x2a && m[2] == 0x4d && m[3] == 0x18;
+        if ( !skippable ) frames.emplace_back( pos, n );
+        pos += n;
+    }
+    return true;
+#else
+    (void)data;
+    (void)len;
+    err = "no zstd support in this build";
+    return false;
+#endif
+}
+
+}
@@ -0,0 +1,50 @@
+//
+// Compressed input
+// .gz files are inflated with zlib and .zst files decompressed with libzstd.  The
+// output comes back in blocks as it is produced, so the caller can start counting the
+// beginning of a file while the rest of it is still being decompressed.  A zstd file
+// made of several frames (pzstd writes them, and so does concatenating .zst files)
+// can also be taken apart, so that its frames can be decompressed in parallel.
+//
+// Either library is optional: HAVE_ZLIB and HAVE_ZSTD say which this build has,
+// and the Makefile sets them for whichever headers it finds.
+//
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility> // For std::pair
+#include <vector>
+
+namespace kjp {
+
+    enum class compression { none, gzip, zstd };
+
+    // By the name's suffix, .gz or .zst.  If stem isn't null it is set to the length
+    // of name without the suffix, for matching against the extension filter.
+    compression compression_of( const char* name, size_t len, size_t* stem=nullptr );
+    const char* compression_name( compression c );
+    // Whether this build can read c
+    bool compression_supported( compression c );
+
+    // Called with at least block bytes of output, and once more with last set at the
+    // end.  Whatever the callee leaves in out is kept, and the next output is
+    // appended after it; on the last call it should take everything.
+    typedef std::function<void( std::vector<char>& out, bool last )> block_fn;
+
+    // Decompress all of [data, data+len).  Small inputs whose size is recorded up
+    // front are decompressed into one buffer of exactly that size in a single call.
+    // Returns false with a description in err if the input is corrupt or truncated,
+    // or if this build can't read it.
+    bool decompress( compression c, const char* data, size_t len, size_t block,
+                     const block_fn& emit, std::string& err );
+
+    // The offset and length of each frame of a zstd file, leaving out skippable
+    // frames.  Each frame can be passed to decompress() on its own.
+    bool zstd_frames( const char* data, size_t len, std::vector<std::pair<size_t,size_t>>& frames,
+                      std::string& err );
+}
+
+#endif
@@ -0,0 +1,485 @@
+//
+// Counting across several machines: the wire format, the nodes and the coordinator
+//
+
+#include "distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "hash.h"        // For partition::owns
+#include "index.h"       // For the varints
+#include "runs.h"        // For the word lists
+#include "topk.h"        // For the final ranking
+
+namespace kjp {
+
+namespace {
+    #ifdef DISTRIBUTED_CONNECT_WAIT
+    constexpr int CONNECT_WAIT=DISTRIBUTED_CONNECT_WAIT;
+    #else
+    constexpr int CONNECT_WAIT=60;      // Seconds a node keeps trying to reach the coordinator
+    #endif
+
+    constexpr uint64_t PARTITION_SEED=0x9e3779b97f4a7c15ULL;   // The same on every node
+    constexpr char MAGIC[4] = { 'S', 'S', 'F', 'I' };
+    constexpr uint64_t VERSION=1;
+    constexpr uint64_t MAX_MESSAGE=uint64_t( 1 ) << 40;
+
+    enum message : unsigned char {
+        HELLO = 1,      // Node: magic, version, partition index and count
+        ASK_TOP,        // Coordinator: how many words it wants
+        THRESHOLD,      // Coordinator: T, for the second phase
+        CANDIDATES,     // Coordinator: a run of the words still in doubt, with zero counts
+        RUN             // Node: a run of words and counts
+    };
+
+    typedef std::pair<std::string,int> word_count;
+
+    // One end of a TCP connection, closed when it goes
+    struct connection {
+        int fd;
+
+        explicit connection( int f=-1 ) : fd(f) {}
+        ~connection() { if ( fd >= 0 ) ::close( fd ); }
+        connection( const connection& ) = delete;
+        connection& operator=( const connection& ) = delete;
+
+        bool send_all( const char* p, size_t n, std::string& err ) {
+            while( n > 0 ) {
+                ssize_t r = ::send( fd, p, n, MSG_NOSIGNAL );
+                if ( r < 0 ) {
+                    if ( errno == EINTR ) continue;
+                    err = strerror( errno );
+                    return false;
+                }
+                p += r;
+                n -= r;
+            }
+            return true;
+        }
+
+        bool recv_all( char* p, size_t n, std::string& err ) {
+            while( n > 0 ) {
+                ssize_t r = ::recv( fd, p, n, 0 );
+                if ( r < 0 && errno == EINTR ) continue;
+                if ( r <= 0 ) {
+                    err = r < 0 ? strerror( errno ) : "connection closed";
+                    return false;
+                }
+                p += r;
+                n -= r;
+            }
+            return true;
+        }
+
+        bool send( message type, const std::string& payload, std::string& err ) {
+            char hdr[9];
+            hdr[0] = type;
+            for( int i=0; i<8; ++i ) hdr[1+i] = char( uint64_t( payload.size() ) >> ( 8 * i ) );
+            return send_all( hdr, sizeof( hdr ), err ) && send_all( payload.data(), payload.size(), err );
+        }
+
+        // Fails unless the next message is of the given type
+        bool recv( message type, std::string& payload, std::string& err ) {
+            unsigned char hdr[9];
+            if ( !recv_all( reinterpret_cast<char*>( hdr ), sizeof( hdr ), err ) ) return false;
+            uint64_t len = 0;
+            for( int i=0; i<8; ++i ) len |= uint64_t( hdr[1+i] ) << ( 8 * i );
+            if ( hdr[0] != type || len > MAX_MESSAGE ) {
+                err = "unexpected message";
+                return false;
+            }
+            payload.resize( len );
+            return recv_all( &payload[0], len, err );
+        }
+    };
+
+    // The entries (with a positive count) of [begin, end) as a run
+    std::string sorted_run( std::vector<word_count>::const_iterator begin,
+                            std::vector<word_count>::const_iterator end ) {
+        std::vector<const word_count*> sorted;
+        sorted.reserve( end - begin );
+        for( auto it=begin; it!=end; ++it ) {
+            if ( it->second > 0 ) sorted.push_back( &*it );
+        }
+        std::sort( sorted.begin(), sorted.end(),
+                   []( const word_count* a, const word_count* b ) { return a->first < b->first; } );
+        run_writer w;
+        for( const word_count* e : sorted ) w.add( e->first, e->second );
+        return std::move( w.out );
+    }
+
+    // "host:port", "[v6 address]:port", or with need_host false just "port"
+    bool split_address( const char* s, bool need_host, std::string& host, std::string& port ) {
+        const char* colon = strrchr( s, ':' );
+        if ( colon ) {
+            host.assign( s, colon - s );
+            port = colon + 1;
+        } else {
+            host.clear();
+            port = s;
+        }
+        if ( host.size() >= 2 && host.front() == '[' && host.back() == ']' ) host = host.substr( 1, host.size() - 2 );
+        return !port.empty() && ( !need_host || !host.empty() );
+    }
+
+    void set_nodelay( int fd ) {
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    }
+
+    bool connect_to( const char* address, connection& c, std::string& err ) {
+        std::string host, port;
+        if ( !split_address( address, true, host, port ) ) {
+            err = "expected host:port";
+            return false;
+        }
+        addrinfo hints;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res;
+        int rc = getaddrinfo( host.c_str(), port.c_str(), &hints, &res );
+        if ( rc != 0 ) {
+            err = gai_strerror( rc );
+            return false;
+        }
+
+        // The coordinator may not be listening yet
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds( CONNECT_WAIT );
+        int lasterr = 0;
+        while( c.fd < 0 ) {
+            for( addrinfo* ai=res; ai && c.fd < 0; ai=ai->ai_next ) {
+                int fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+                if ( fd < 0 ) {
+                    lasterr = errno;
+                } else if ( connect( fd, ai->ai_addr, ai->ai_addrlen ) < 0 ) {
+                    lasterr = errno;
+                    ::close( fd );
+                } else {
+                    c.fd = fd;
+                }
+            }
+            if ( c.fd >= 0 || std::chrono::steady_clock::now() >= deadline ) break;
+            std::this_thread::sleep_for( std::chrono::milliseconds( 500 ) );
+        }
+        freeaddrinfo( res );
+        if ( c.fd < 0 ) {
+            err = strerror( lasterr );
+            return false;
+        }
+        set_nodelay( c.fd );
+        return true;
+    }
+
+    bool listen_on( const char* address, connection& c, std::string& err ) {
+        std::string host, port;
+        if ( !split_address( address, false, host, port ) ) {
+            err = "expected [host:]port";
+            return false;
+        }
+        addrinfo hints;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* res;
+        int rc = getaddrinfo( host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res );
+        if ( rc != 0 ) {
+            err = gai_strerror( rc );
+            return false;
+        }
+        int lasterr = 0;
+        for( addrinfo* ai=res; ai && c.fd < 0; ai=ai->ai_next ) {
+            int fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+            int one = 1;
+            if ( fd >= 0 && setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) ) == 0 &&
+                 bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0 && listen( fd, 64 ) == 0 ) {
+                c.fd = fd;
+            } else {
+                lasterr = errno;
+                if ( fd >= 0 ) ::close( fd );
+            }
+        }
+        freeaddrinfo( res );
+        if ( c.fd < 0 ) {
+            err = strerror( lasterr );
+            return false;
+        }
+        return true;
+    }
+
+    // Wait for every partition to check in; nodes[i] is partition i's connection
+    bool accept_nodes( connection& server, std::vector<std::unique_ptr<connection>>& nodes, std::string& err ) {
+        size_t joined = 0;
+        while( nodes.empty() || joined < nodes.size() ) {
+            int fd = accept( server.fd, nullptr, nullptr );
+            if ( fd < 0 ) {
+                if ( errno == EINTR ) continue;
+                err = strerror( errno );
+                return false;
+            }
+            std::unique_ptr<connection> c( new connection( fd ) );
+            set_nodelay( fd );
+
+            std::string hello;
+            if ( !c->recv( HELLO, hello, err ) ) return false;
+            const unsigned char* p = reinterpret_cast<const unsigned char*>( hello.data() );
+            const unsigned char* end = p + hello.size();
+            uint64_t version, index, count;
+            if ( hello.size() < sizeof( MAGIC ) || memcmp( p, MAGIC, sizeof( MAGIC ) ) != 0 ) {
+                err = "not an ssfi node";
+                return false;
+            }
+            p += sizeof( MAGIC );
+            if ( !detail::get_varint( p, end, version ) || version != VERSION ||
+                 !detail::get_varint( p, end, index ) || !detail::get_varint( p, end, count ) ||
+                 count == 0 || count > UINT32_MAX || index >= count ) {
+                err = "a node speaks a different protocol";
+                return false;
+            }
+            std::string name = std::to_string( index ) + "/" + std::to_string( count );
+            if ( nodes.empty() ) {
+                nodes.resize( count );
+            } else if ( count != nodes.size() ) {
+                err = "node " + name + " doesn't belong to a partition into " + std::to_string( nodes.size() );
+                return false;
+            }
+            if ( nodes[index] ) {
+                err = "two nodes claim partition " + name;
+                return false;
+            }
+            nodes[index].swap( c );
+            ++joined;
+        }
+        return true;
+    }
+
+    bool broadcast( std::vector<std::unique_ptr<connection>>& nodes, message type, const std::string& payload,
+                    std::string& err ) {
+        for( auto& c : nodes ) {
+            if ( !c->send( type, payload, err ) ) return false;
+        }
+        return true;
+    }
+
+    // One run from every node, read in parallel
+    bool gather_runs( std::vector<std::unique_ptr<connection>>& nodes, std::vector<std::string>& runs,
+                      size_t& bytes, std::string& err ) {
+        std::vector<std::string> errs( nodes.size() );
+        std::vector<char> ok( nodes.size() );
+        runs.assign( nodes.size(), std::string() );
+        detail::run_parallel( nodes.size(), [&]( int i ) {
+            ok[i] = nodes[i]->recv( RUN, runs[i], errs[i] );
+        } );
+        bytes = 0;
+        for( size_t i=0; i<nodes.size(); ++i ) {
+            if ( !ok[i] ) {
+                err = "node " + std::to_string( i ) + ": " + errs[i];
+                return false;
+            }
+            bytes += runs[i].size();
+        }
+        return true;
+    }
+
+    // A word as far as the coordinator knows it: the sum of the counts it has been
+    // sent, and how many nodes sent them
+    struct partial {
+        std::string word;
+        int64_t sum;
+        uint32_t seen;
+    };
+
+    // The k-th highest sum, or 0 if there are fewer than k
+    int64_t kth_highest( const std::vector<partial>& words, size_t k ) {
+        if ( k == 0 || words.size() < k ) return 0;
+        std::vector<int64_t> sums;
+        sums.reserve( words.size() );
+        for( const partial& w : words ) sums.push_back( w.sum );
+        std::nth_element( sums.begin(), sums.begin() + ( k - 1 ), sums.end(), std::greater<int64_t>() );
+        return sums[k - 1];
+    }
+}
+
+bool partition::parse( const char* s ) {
+    char* end;
+    unsigned long i = strtoul( s, &end, 10 );
+    if ( end == s || *end != '/' ) return false;
+    const char* n = end + 1;
+    unsigned long c = strtoul( n, &end, 10 );
+    if ( end == n || *end != '\0' || c == 0 || c > UINT32_MAX || i >= c ) return false;
+    index = i;
+    count = c;
+    return true;
+}
+
+bool partition::owns( const char* path, size_t len ) const {
+    return count <= 1 || hash_bytes( path, len, PARTITION_SEED ) % count == index;
+}
+
+bool serve_counts( const char* coordinator, const partition& part,
+                   const std::vector<std::pair<std::string,int>>& entries, std::string& err ) {
+    connection c;
+    if ( !connect_to( coordinator, c, err ) ) return false;
+
+    std::string msg( MAGIC, sizeof( MAGIC ) );
+    detail::put_varint( msg, VERSION );
+    detail::put_varint( msg, part.index );
+    detail::put_varint( msg, part.count );
+    if ( !c.send( HELLO, msg, err ) || !c.recv( ASK_TOP, msg, err ) ) return false;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>( msg.data() );
+    uint64_t want;
+    if ( !detail::get_varint( p, p + msg.size(), want ) ) {
+        err = "unexpected message";
+        return false;
+    }
+
+    // Phase 1: our top k, or everything
+    size_t k = want == 0 ? entries.size() : std::min<uint64_t>( want, entries.size() );
+    if ( !c.send( RUN, sorted_run( entries.begin(), entries.begin() + k ), err ) ) return false;
+    if ( want == 0 ) return true;
+
+    // Phase 2: the rest of the words with at least T
+    if ( !c.recv( THRESHOLD, msg, err ) ) return false;
+    p = reinterpret_cast<const unsigned char*>( msg.data() );
+    uint64_t threshold;
+    if ( !detail::get_varint( p, p + msg.size(), threshold ) ) {
+        err = "unexpected message";
+        return false;
+    }
+    size_t j = k;
+    while( j < entries.size() && uint64_t( std::max( entries[j].second, 0 ) ) >= threshold ) ++j;
+    if ( !c.send( RUN, sorted_run( entries.begin() + k, entries.begin() + j ), err ) ) return false;
+
+    // Phase 3: our counts for the candidates, both in word order
+    if ( !c.recv( CANDIDATES, msg, err ) ) return false;
+    std::vector<const word_count*> byword;
+    byword.reserve( entries.size() );
+    for( const word_count& e : entries ) byword.push_back( &e );
+    std::sort( byword.begin(), byword.end(),
+               []( const word_count* a, const word_count* b ) { return a->first < b->first; } );
+    run_reader cand( msg );
+    run_writer out;
+    auto it = byword.begin();
+    while( cand.next() ) {
+        while( it != byword.end() && ( *it )->first < cand.word ) ++it;
+        if ( it != byword.end() && ( *it )->first == cand.word && ( *it )->second > 0 ) {
+            out.add( cand.word, ( *it )->second );
+        }
+    }
+    if ( cand.bad ) {
+        err = "damaged candidate list";
+        return false;
+    }
+    return c.send( RUN, out.out, err );
+}
+
+bool gather_top( const char* address, size_t count, std::vector<std::pair<std::string,int64_t>>& top,
+                 tput_summary& summary, std::string& err ) {
+    connection server;
+    if ( !listen_on( address, server, err ) ) return false;
+    std::vector<std::unique_ptr<connection>> nodes;
+    if ( !accept_nodes( server, nodes, err ) ) return false;
+    uint32_t n = nodes.size();
+    summary.nodes = n;
+
+    topk_heap<std::pair<std::string,int64_t>> best( count );
+    std::vector<std::string> runs;
+    std::vector<run_reader> readers;
+    auto read_runs = [&]( int phase ) {
+        if ( !gather_runs( nodes, runs, summary.bytes[phase], err ) ) return false;
+        readers.clear();
+        for( const std::string& r : runs ) readers.emplace_back( r );
+        return true;
+    };
+    auto damaged = [&err]() {
+        err = "a node sent a damaged run";
+        return false;
+    };
+
+    // Phase 1
+    std::string msg;
+    detail::put_varint( msg, count );
+    if ( !broadcast( nodes, ASK_TOP, msg, err ) || !read_runs( 0 ) ) return false;
+    std::vector<partial> known;
+    bool ok = merge_runs( readers, [&]( const std::string& w, int64_t sum, uint32_t seen ) {
+        summary.words[0] += seen;
+        if ( count == 0 ) {
+            best.offer( std::make_pair( w, sum ) );
+        } else {
+            known.push_back( partial{ w, sum, seen } );
+        }
+    } );
+    if ( !ok ) return damaged();
+    if ( count == 0 ) {
+        top = best.take();
+        return true;
+    }
+
+    // Phase 2
+    int64_t threshold = kth_highest( known, count ) / n;
+    summary.threshold = threshold;
+    msg.clear();
+    detail::put_varint( msg, threshold );
+    if ( !broadcast( nodes, THRESHOLD, msg, err ) || !read_runs( 1 ) ) return false;
+    std::vector<partial> merged;
+    size_t i = 0;
+    ok = merge_runs( readers, [&]( const std::string& w, int64_t sum, uint32_t seen ) {
+        summary.words[1] += seen;
+        while( i < known.size() && known[i].word < w ) merged.push_back( std::move( known[i++] ) );
+        if ( i < known.size() && known[i].word == w ) {
+            known[i].sum += sum;
+            known[i].seen += seen;
+            merged.push_back( std::move( known[i++] ) );
+        } else {
+            merged.push_back( partial{ w, sum, seen } );
+        }
+    } );
+    if ( !ok ) return damaged();
+    while( i < known.size() ) merged.push_back( std::move( known[i++] ) );
+    known.swap( merged );
+
+    // Whatever a node didn't send is below T; drop the words that can't reach the bound,
+    // and keep the ones every node has sent as they are
+    int64_t bound = kth_highest( known, count );
+    int64_t slack = threshold > 0 ? threshold - 1 : 0;
+    summary.bound = bound;
+    run_writer doubtful;
+    for( const partial& w : known ) {
+        if ( w.sum + int64_t( n - w.seen ) * slack < bound ) continue;
+        summary.candidates++;
+        if ( w.seen == n ) {
+            summary.exact++;
+            best.offer( std::make_pair( w.word, w.sum ) );
+        } else {
+            doubtful.add( w.word, 0 );
+        }
+    }
+    known.clear();
+
+    // Phase 3
+    if ( !broadcast( nodes, CANDIDATES, doubtful.out, err ) || !read_runs( 2 ) ) return false;
+    ok = merge_runs( readers, [&]( const std::string& w, int64_t sum, uint32_t seen ) {
+        summary.words[2] += seen;
+        best.offer( std::make_pair( w, sum ) );
+    } );
+    if ( !ok ) return damaged();
+    top = best.take();
+    return true;
+}
+
+}
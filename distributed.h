@@ -0,0 +1,72 @@
+//
+// Counting across several machines
+// Every node is given the same paths and walks the same tree, but only counts the
+// files its partition owns, chosen by a hash of the path.  Once it is done it connects
+// to the coordinator, which works out the overall top words without every node having
+// to send its whole vocabulary, following the three phases of TPUT (Cao and Wang,
+//    "Efficient Top-K Query Calculation in Distributed Networks" in PODC '04):
+//
+//   1. Each node sends its own top k.  The k-th highest of the partial sums is a lower
+//      bound tau on the k-th highest total, so any word that might make the cut has a
+//      count of at least T = tau / nodes on some node.
+//   2. Each node sends the rest of its words with a count of at least T.  A word's
+//      total is now known to be between its partial sum and that plus T-1 for every
+//      node that didn't send it; the k-th highest partial sum is a better bound, and
+//      words that can't reach it are dropped.
+//   3. Each node sends its exact counts for the words still in doubt.
+//
+// Asking for every word (a count of 0) leaves only the first phase, with everything.
+//
+// Words always travel as sorted, front coded runs (runs.h).  The coordinator reads
+// the nodes' runs for a phase in parallel and merges them in a single pass.
+//
+// Messages are a type byte and a little-endian 64-bit payload length, then the
+// payload.
+//
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility> // For std::pair
+#include <vector>
+
+namespace kjp {
+
+    // This node's share of the files: those whose path hashes to index, of count
+    struct partition {
+        uint32_t index = 0;
+        uint32_t count = 1;
+
+        // "I/N", with I < N
+        bool parse( const char* s );
+        bool owns( const char* path, size_t len ) const;
+    };
+
+    // What the coordinator saw, for -d
+    struct tput_summary {
+        uint32_t nodes = 0;
+        size_t words[3] = { 0, 0, 0 };     // Received in each phase, from all the nodes
+        size_t bytes[3] = { 0, 0, 0 };
+        int64_t threshold = 0;              // T
+        int64_t bound = 0;                  // The k-th highest partial sum after phase 2
+        size_t candidates = 0;              // Words left after phase 2
+        size_t exact = 0;                   // ... of which every node had already sent
+    };
+
+    // On a node, once its share is counted: connect to coordinator ("host:port"),
+    // waiting a while for it to come up, and answer its questions from entries, which
+    // holds every word counted here, most frequent first.  Returns false with a
+    // description in err if the connection fails.
+    bool serve_counts( const char* coordinator, const partition& part,
+                       const std::vector<std::pair<std::string,int>>& entries, std::string& err );
+
+    // On the coordinator: listen on address ("[host:]port") until every node of the
+    // partition has connected, and put the count most frequent words overall (every
+    // word if count is 0) in top, most frequent first.
+    bool gather_top( const char* address, size_t count, std::vector<std::pair<std::string,int64_t>>& top,
+                     tput_summary& summary, std::string& err );
+}
+
+#endif
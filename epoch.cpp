@@ -0,0 +1,106 @@
+//
+// Epoch-based reclamation: the thread records and the retired list
+//
+
+#include "epoch.h"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace kjp {
+namespace epoch {
+
+    std::atomic<uint64_t> global( 1 );      // 0 is for not pinned
+    std::atomic<size_t> pending( 0 );
+    thread_local record* current = nullptr;
+
+namespace {
+
+    std::mutex registry_mtx;
+    // Records are never given back; a thread that has gone is just never pinned
+    std::vector<std::unique_ptr<record>> registry;
+
+    struct retired {
+        uint64_t epoch;
+        void* p;
+        void (*release)( void* );
+    };
+
+    std::mutex limbo_mtx;
+    std::vector<retired> limbo;
+
+    // The oldest epoch anyone is pinned at, or past every stamp if nobody is
+    uint64_t oldest_pinned() {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        uint64_t oldest = UINT64_MAX;
+        std::lock_guard<std::mutex> lg( registry_mtx );
+        for( const auto& r : registry ) {
+            uint64_t e = r->pinned.load( std::memory_order_acquire );
+            if ( e != 0 && e < oldest ) oldest = e;
+        }
+        return oldest;
+    }
+
+    // Take whatever is safe off the list, which must be locked
+    std::vector<retired> take_safe() {
+        uint64_t oldest = oldest_pinned();
+        std::vector<retired> safe;
+        auto keep = std::partition( limbo.begin(), limbo.end(),
+                                    [oldest]( const retired& r ) { return r.epoch >= oldest; } );
+        safe.assign( keep, limbo.end() );
+        limbo.erase( keep, limbo.end() );
+        pending.store( limbo.size(), std::memory_order_relaxed );
+        return safe;
+    }
+
+    // Outside the lock, since a release may retire something itself
+    void release_all( const std::vector<retired>& safe ) {
+        for( const retired& r : safe ) r.release( r.p );
+    }
+}
+
+    record& enroll() {
+        std::unique_ptr<record> r( new record );
+        r->pinned.store( 0, std::memory_order_relaxed );
+        r->depth = 0;
+        r->exits = 0;
+        current = r.get();
+        std::lock_guard<std::mutex> lg( registry_mtx );
+        registry.push_back( std::move( r ) );
+        return *current;
+    }
+
+    void collect() {
+        std::vector<retired> safe;
+        {
+            std::lock_guard<std::mutex> lg( limbo_mtx );
+            safe = take_safe();
+        }
+        release_all( safe );
+    }
+
+    void poll() {
+        std::vector<retired> safe;
+        {
+            std::unique_lock<std::mutex> lg( limbo_mtx, std::try_to_lock );
+            if ( !lg.owns_lock() ) return;
+            safe = take_safe();
+        }
+        release_all( safe );
+    }
+
+    void retire( void* p, void (*release)( void* ) ) {
+        uint64_t e = global.fetch_add( 1 );
+        std::vector<retired> safe;
+        {
+            std::lock_guard<std::mutex> lg( limbo_mtx );
+            limbo.push_back( retired{ e, p, release } );
+            pending.store( limbo.size(), std::memory_order_relaxed );
+            if ( limbo.size() >= RECLAIM_BATCH ) safe = take_safe();
+        }
+        release_all( safe );
+    }
+}
+}
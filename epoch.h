@@ -0,0 +1,88 @@
+//
+// Epoch-based reclamation for the concurrent tables
+// A thread pins the current epoch, with a guard, for as long as it holds pointers it
+// loaded out of a table.  Pinning is a store to the thread's own cache line and a
+// fence; nothing shared is written, unlike a shared_ptr's reference count.
+//
+// A writer that unlinks something (a config that has been replaced, a removed entry)
+// retires it, which stamps it with the epoch and then advances the epoch.  It is freed
+// once no thread is pinned at that stamp or earlier: anyone pinned later loaded the
+// pointers after it was unlinked, so cannot have it.
+//
+// Retired objects wait on one list under a mutex, since retiring is rare (a resize, a
+// remove), and are freed in batches: once RECLAIM_BATCH are waiting, on collect(), and
+// now and then as threads leave their guards, so that an old table does not linger.
+// A thread shouldn't block for long in a guard; nothing retired since it entered can
+// be freed until it leaves.  Guards nest, so one table operation may call another.
+//
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace kjp {
+namespace epoch {
+
+    #ifdef EPOCH_RECLAIM_BATCH
+    constexpr size_t RECLAIM_BATCH=EPOCH_RECLAIM_BATCH;
+    #else
+    constexpr size_t RECLAIM_BATCH=64;      // Retired objects that make the retirer collect
+    #endif
+    constexpr unsigned POLL_EVERY=1024;     // Guards a thread leaves between looks at the list
+
+    // One per thread, on a line of its own
+    struct alignas(64) record {
+        std::atomic<uint64_t> pinned;       // The epoch it entered its guard in, 0 outside one
+        unsigned depth;                     // Nested guards; only the owner touches these
+        unsigned exits;
+    };
+
+    extern std::atomic<uint64_t> global;
+    extern std::atomic<size_t> pending;     // Retired and not yet freed
+    extern thread_local record* current;
+
+    record& enroll();
+
+    // This thread's record
+    inline record& mine() { return current ? *current : enroll(); }
+
+    // Free whatever is safe to free.  poll() gives up rather than wait for the list.
+    void collect();
+    void poll();
+
+    // Free p with release( p ) once no guard can still hold it.  p must already be
+    // unreachable for anyone entering a guard from now on.
+    void retire( void* p, void (*release)( void* ) );
+
+    template <typename T>
+    void retire( T* p ) {
+        retire( p, []( void* q ) { delete static_cast<T*>( q ); } );
+    }
+
+    class guard {
+        record& r;
+
+    public:
+        guard() : r( mine() ) {
+            if ( r.depth++ > 0 ) return;
+            // The acquire pairs with retire()'s increment: having seen a later epoch,
+            // we see whatever was unlinked before it.  The fence keeps the loads that
+            // follow from being done before collect() can see we are pinned.
+            r.pinned.store( global.load( std::memory_order_acquire ), std::memory_order_release );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+        }
+        ~guard() {
+            if ( --r.depth > 0 ) return;
+            r.pinned.store( 0, std::memory_order_release );
+            if ( ++r.exits % POLL_EVERY == 0 && pending.load( std::memory_order_relaxed ) > 0 ) poll();
+        }
+
+        guard( const guard& ) = delete;
+        guard& operator=( const guard& ) = delete;
+    };
+}
+}
+
+#endif
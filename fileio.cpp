@@ -0,0 +1,92 @@
+//
+// Zero-copy file ingestion
+//
+
+#include "fileio.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kjp {
+
+bool parse_io_mode( const char* name, io_mode& mode ) {
+    if ( strcmp( name, "stream" ) == 0 ) {
+        mode = io_mode::stream;
+    } else if ( strcmp( name, "mmap" ) == 0 ) {
+        mode = io_mode::mmap;
+    } else if ( strcmp( name, "uring" ) == 0 ) {
+        mode = io_mode::uring;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* io_mode_name( io_mode mode ) {
+    return mode == io_mode::mmap ? "mmap" : mode == io_mode::uring ? "uring" : "stream";
+}
+
+bool file_view::open( const char* name, std::vector<char>& buf ) {
+    close();
+
+    int fd = ::open( name, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) return false;
+
+    struct stat st;
+    if ( fstat( fd, &st ) < 0 ) {
+        int e = errno;
+        ::close( fd );
+        errno = e;
+        return false;
+    }
+    size_t sz = st.st_size;
+
+    if ( sz >= MMAP_THRESHOLD ) {
+        void* p = mmap( nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if ( p != MAP_FAILED ) {
+            madvise( p, sz, MADV_SEQUENTIAL );
+            ::close( fd );
+            bytes = static_cast<const char*>( p );
+            len = sz;
+            mapped = true;
+            return true;
+        }
+        // Fall through and read it the old-fashioned way
+    }
+
+    if ( buf.size() < sz ) buf.resize( sz );
+    size_t got = 0;
+    while( got < sz ) {
+        ssize_t r = pread( fd, buf.data() + got, sz - got, got );
+        if ( r < 0 ) {
+            if ( errno == EINTR ) continue;
+            int e = errno;
+            ::close( fd );
+            errno = e;
+            return false;
+        }
+        if ( r == 0 ) break;   // File shrank underneath us
+        got += r;
+    }
+    ::close( fd );
+    bytes = buf.data();
+    len = got;
+    mapped = false;
+    return true;
+}
+
+void file_view::close() {
+    if ( mapped ) {
+        munmap( const_cast<char*>( bytes ), len );
+    }
+    bytes = nullptr;
+    len = 0;
+    mapped = false;
+}
+
+}
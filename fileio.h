@@ -0,0 +1,49 @@
+//
+// Zero-copy file ingestion
+// A file_view exposes the whole contents of a file as one contiguous range of bytes.
+// Large files are memory-mapped; small ones are read with a single pread() into a
+// caller-supplied buffer, which is reused from file to file.
+//
+#ifndef __FILEIO_H__
+#define __FILEIO_H__
+
+#include <cstddef>
+#include <vector>
+
+namespace kjp {
+
+    enum class io_mode { stream, mmap, uring };    // uring reads through a prefetcher (prefetch.h)
+
+    bool parse_io_mode( const char* name, io_mode& mode );
+    const char* io_mode_name( io_mode mode );
+
+    class file_view {
+        #ifdef SSFI_MMAP_THRESHOLD
+        static constexpr size_t MMAP_THRESHOLD=SSFI_MMAP_THRESHOLD;
+        #else
+        static constexpr size_t MMAP_THRESHOLD=64*1024;  // Files smaller than this are pread()
+        #endif
+
+        const char* bytes;
+        size_t len;
+        bool mapped;
+
+    public:
+        file_view() : bytes(nullptr), len(0), mapped(false) {}
+        file_view( const file_view& ) = delete;
+        file_view& operator=( const file_view& ) = delete;
+        ~file_view() { close(); }
+
+        // Open name and make its contents available through data()/size().
+        // buf is only used for small files, and must outlive the view.
+        // Returns false with errno set on failure.
+        bool open( const char* name, std::vector<char>& buf );
+        void close();
+
+        const char* data() const { return bytes; }
+        size_t size() const { return len; }
+        bool is_mapped() const { return mapped; }
+    };
+}
+
+#endif
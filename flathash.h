@@ -0,0 +1,350 @@
+//
+// A concurrent word counter with a flat, cache-friendly slot layout
+// Each slot holds a 32-bit hash fingerprint, the count and a pointer to the key: 16 bytes,
+// so four slots share a cache line and a probe can nearly always reject a slot without
+// leaving the slot array.  Keys are interned once, together with their full hash, in a
+// per-table bump arena, so there is no per-word allocation and no deleted list, and a
+// resize never has to rehash the key bytes.
+//
+// Linear probing.  Lookups and increments are lock-free; claiming an empty slot takes
+// its stripe lock.  The table doubles (stop-the-world) past a 3/4 load factor; the
+// old slot array is retired (epoch.h) and freed once nobody is probing it any more.
+//
+// Given a home node, the slot arrays and the arena are bound to it, which covers all
+// of the table's memory.
+//
+
+#ifndef __FLAT_HASH_H__
+#define __FLAT_HASH_H__
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility> // For std::pair
+#include <vector>
+
+#include "arena.h"
+#include "epoch.h"
+#include "hash.h"
+#include "numa.h"
+#include "stats.h"
+#include "topk.h"
+
+class flathashcounter {
+public:
+    typedef std::pair<std::string,int> element;
+
+    struct resize_stats {
+        long resizes;       // Number of times the table grew
+        long pauses;        // Operations that had to resize
+        long total_ns;      // Time those operations spent on it
+        long max_ns;        // The longest single pause
+    };
+
+private:
+    #ifdef FLATHASH_DEFAULT_SIZE
+    static constexpr size_t DEFAULT_SIZE=FLATHASH_DEFAULT_SIZE;
+    #else
+    static constexpr size_t DEFAULT_SIZE=1024;      // Initial number of slots
+    #endif
+
+    // A resize swaps every count for FROZEN, so anyone who increments a slot after it
+    // has been copied gets back something hopelessly negative and knows to retry.
+    // Anything else (a negative delta, a remove) would move a frozen count back into
+    // range, so it has to see that the slot isn't frozen before it changes it.
+    static constexpr int FROZEN = INT_MIN;
+    static constexpr int FROZEN_LIMIT = INT_MIN / 2;
+
+    // Set count to f( the old count ) unless it's frozen; returns the old count
+    template <typename F>
+    static int update_unfrozen( std::atomic<int>& count, F f ) {
+        int old = count.load();
+        while( old >= FROZEN_LIMIT && !count.compare_exchange_weak( old, f( old ) ) ) {}
+        return old;
+    }
+
+    // An interned key; the bytes follow the header
+    struct keyrec {
+        uint64_t hash;
+        uint32_t len;
+
+        const char* bytes() const { return reinterpret_cast<const char*>( this + 1 ); }
+    };
+
+    struct slot {
+        std::atomic<uint32_t> fp;           // Fingerprint, 0 while the slot is empty
+        std::atomic<int> count;
+        std::atomic<const keyrec*> key;     // Set before fp is published
+    };
+
+    class config {
+    public:
+        std::unique_ptr<slot[]> slots;
+        size_t mask;
+        std::vector<std::mutex> locks;
+        std::atomic<bool> resizing;         // Set once this config has been replaced
+        std::atomic<size_t> nused;
+
+        // Slots on node home, unless it is -1
+        config( size_t sz, int home ) : slots( new slot[sz] ), mask( sz - 1 ), locks( sqrt(sz) + 1 ),
+                                        resizing(false), nused(0) {
+            // Before the slots are first touched, so nothing has to be moved
+            if ( home >= 0 ) kjp::bind_memory( slots.get(), sz * sizeof( slot ), home );
+            for( size_t i=0; i<sz; ++i ) {
+                slots[i].fp.store( 0, std::memory_order_relaxed );
+                slots[i].count.store( 0, std::memory_order_relaxed );
+                slots[i].key.store( nullptr, std::memory_order_relaxed );
+            }
+        }
+
+        size_t size() const { return mask + 1; }
+        std::mutex& lock_for( size_t i ) { return locks[i % locks.size()]; }
+    };
+
+    std::atomic<config*> cfg;
+    kjp::arena keys;
+    uint64_t seed;
+    int home;                               // The node to keep the memory on, or -1
+
+    std::atomic<long> nresizes, npauses, pause_total_ns, pause_max_ns;
+
+    uint64_t hash_func( const char* p, size_t len ) const {
+        return kjp::hash_bytes( p, len, seed );
+    }
+
+    static uint32_t fingerprint( uint64_t h ) {
+        uint32_t fp = h >> 32;
+        return fp ? fp : 1;
+    }
+
+    static bool matches( const keyrec* k, const char* p, size_t len ) {
+        return k->len == len && memcmp( k->bytes(), p, len ) == 0;
+    }
+
+    const keyrec* intern( const char* p, size_t len, uint64_t h ) {
+        keyrec* k = static_cast<keyrec*>( keys.allocate( sizeof(keyrec) + len, alignof(keyrec) ) );
+        k->hash = h;
+        k->len = len;
+        memcpy( const_cast<char*>( k->bytes() ), p, len );
+        return k;
+    }
+
+    // A slot was frozen under us; wait for the resizer to publish the new table
+    void wait_for_resize( const config* current ) const {
+        while( cfg.load( std::memory_order_acquire ) == current ) {
+            std::this_thread::yield();
+        }
+    }
+
+    void record_pause( std::chrono::steady_clock::time_point start ) {
+        long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start ).count();
+        npauses.fetch_add( 1, std::memory_order_relaxed );
+        pause_total_ns.fetch_add( ns, std::memory_order_relaxed );
+        long m = pause_max_ns.load( std::memory_order_relaxed );
+        while( ns > m && !pause_max_ns.compare_exchange_weak( m, ns ) ) {}
+    }
+
+    void resize( config* old ) {
+        if ( old->resizing ) return;
+        kjp::epoch::poll();
+
+        std::vector<std::unique_lock<std::mutex>> lgs;
+        for( unsigned i=0; i<old->locks.size(); ++i ) {
+            lgs.emplace_back( old->locks[i] );
+        }
+        if ( old->resizing ) return;
+        // From here on nobody can claim a slot in old
+        old->resizing = true;
+
+        config* newcfg = new config( old->size() * 2, home );
+        size_t n = 0;
+        for( size_t i=0; i<old->size(); ++i ) {
+            slot& s = old->slots[i];
+            uint32_t fp = s.fp.load( std::memory_order_relaxed );
+            if ( fp == 0 ) continue;
+
+            const keyrec* k = s.key.load( std::memory_order_relaxed );
+            size_t j = k->hash & newcfg->mask;
+            while( newcfg->slots[j].fp.load( std::memory_order_relaxed ) != 0 ) {
+                j = ( j + 1 ) & newcfg->mask;
+            }
+            newcfg->slots[j].key.store( k, std::memory_order_relaxed );
+            newcfg->slots[j].count.store( s.count.exchange( FROZEN ), std::memory_order_relaxed );
+            newcfg->slots[j].fp.store( fp, std::memory_order_relaxed );
+            ++n;
+        }
+        newcfg->nused = n;
+        nresizes.fetch_add( 1 );
+        cfg.store( newcfg, std::memory_order_release );
+        kjp::epoch::retire( old );
+    }
+
+public:
+    flathashcounter( size_t size=DEFAULT_SIZE ) :
+        home(-1), nresizes(0), npauses(0), pause_total_ns(0), pause_max_ns(0) {
+        std::mt19937_64 generator( std::chrono::system_clock::now().time_since_epoch().count() );
+        seed = generator();
+        size_t sz = 16;
+        while( sz < size ) sz *= 2;
+        cfg.store( new config( sz, home ) );
+    }
+
+    ~flathashcounter() {
+        delete cfg.load();
+        kjp::epoch::collect();
+    }
+    flathashcounter( const flathashcounter& ) = delete;
+    flathashcounter& operator=( const flathashcounter& ) = delete;
+
+    // Keep the table's memory on node (a sysfs node number) from now on, and move what
+    // it has already.  Meant to be called before the table is shared.  Returns false
+    // with errno set if the slots couldn't be moved.
+    bool set_home_node( int node ) {
+        home = node;
+        keys.set_home_node( node );
+        config* c = cfg.load();
+        return kjp::bind_memory( c->slots.get(), c->size() * sizeof( slot ), node );
+    }
+
+    // Returns the count of key's occurrences, or 0 if it isn't present
+    int contains( std::string_view key ) const {
+        uint64_t h = hash_func( key.data(), key.size() );
+        uint32_t fp = fingerprint( h );
+        kjp::epoch::guard g;
+        while( true ) {
+            const config* current = cfg.load( std::memory_order_acquire );
+            for( size_t i = h & current->mask; ; i = ( i + 1 ) & current->mask ) {
+                slot& s = current->slots[i];
+                uint32_t f = s.fp.load( std::memory_order_acquire );
+                if ( f == 0 ) return 0;
+                if ( f == fp && matches( s.key.load( std::memory_order_relaxed ), key.data(), key.size() ) ) {
+                    int c = s.count.load();
+                    if ( c >= FROZEN_LIMIT ) return c;
+                    break;
+                }
+            }
+            wait_for_resize( current );
+        }
+    }
+
+    int insert( std::string_view key ) { return insert_n( key, 1 ); }
+
+    // Add delta occurrences of key, returning the new count
+    int insert_n( std::string_view key, int delta ) {
+        uint64_t h = hash_func( key.data(), key.size() );
+        uint32_t fp = fingerprint( h );
+
+        kjp::epoch::guard g;
+        retry:
+        while( true ) {
+            config* current = cfg.load( std::memory_order_acquire );
+            size_t i = h & current->mask;
+            size_t probes = 0;
+            while( true ) {
+                slot& s = current->slots[i];
+                uint32_t f = s.fp.load( std::memory_order_acquire );
+                ++probes;
+
+                if ( f == 0 ) {
+                    // Looks free; claim it under the lock if it still is
+                    size_t n;
+                    {
+                        kjp::stats::stripe_guard lg( current->lock_for( i ), i % current->locks.size() );
+                        if ( current->resizing ) goto retry;
+                        if ( s.fp.load( std::memory_order_relaxed ) != 0 ) continue;   // Lost the race, look again
+
+                        s.key.store( intern( key.data(), key.size(), h ), std::memory_order_relaxed );
+                        s.count.store( delta, std::memory_order_relaxed );
+                        s.fp.store( fp, std::memory_order_release );
+                        n = current->nused.fetch_add( 1 ) + 1;
+                    }
+                    kjp::stats::probe( probes );
+                    if ( n * 4 > current->size() * 3 ) {
+                        auto start = std::chrono::steady_clock::now();
+                        resize( current );
+                        record_pause( start );
+                    }
+                    return delta;
+                }
+
+                if ( f == fp && matches( s.key.load( std::memory_order_relaxed ), key.data(), key.size() ) ) {
+                    int old = delta > 0 ? s.count.fetch_add( delta )
+                                        : update_unfrozen( s.count, [delta]( int c ) { return c + delta; } );
+                    if ( old >= FROZEN_LIMIT ) {
+                        kjp::stats::probe( probes );
+                        return old + delta;
+                    }
+                    // The resizer already copied this slot; try again in the new table
+                    wait_for_resize( current );
+                    goto retry;
+                }
+
+                i = ( i + 1 ) & current->mask;
+            }
+        }
+    }
+
+    int increment( std::string_view key ) { return insert(key); }
+
+    // Keys are never unlinked (the arena owns them); removing one just zeroes its count
+    int remove( std::string_view key ) {
+        uint64_t h = hash_func( key.data(), key.size() );
+        uint32_t fp = fingerprint( h );
+        kjp::epoch::guard g;
+        while( true ) {
+            const config* current = cfg.load( std::memory_order_acquire );
+            for( size_t i = h & current->mask; ; i = ( i + 1 ) & current->mask ) {
+                slot& s = current->slots[i];
+                uint32_t f = s.fp.load( std::memory_order_acquire );
+                if ( f == 0 ) return 0;
+                if ( f == fp && matches( s.key.load( std::memory_order_relaxed ), key.data(), key.size() ) ) {
+                    int c = update_unfrozen( s.count, []( int ) { return 0; } );
+                    if ( c >= FROZEN_LIMIT ) return c;
+                    break;
+                }
+            }
+            wait_for_resize( current );
+        }
+    }
+
+    size_t size() const {
+        kjp::epoch::guard g;
+        return cfg.load( std::memory_order_acquire )->nused.load();
+    }
+
+    resize_stats get_resize_stats() const {
+        return resize_stats{ nresizes.load(), npauses.load(), pause_total_ns.load(), pause_max_ns.load() };
+    }
+
+    // The count most frequent words (all of them if count is 0), most frequent first
+    // (ties in alphabetical order), scanning with up to nthreads threads.
+    // Meant to be called once the inserters are done.
+    std::vector<element> extract_top( int count, int nthreads=1 ) {
+        kjp::epoch::guard g;
+        const config* c = cfg.load( std::memory_order_acquire );
+
+        return kjp::parallel_top<element>( c->size(), count, nthreads,
+            [c]( size_t lo, size_t hi, kjp::topk_heap<element>& heap ) {
+                for( size_t i=lo; i<hi; ++i ) {
+                    slot& s = c->slots[i];
+                    if ( s.fp.load( std::memory_order_acquire ) == 0 ) continue;
+                    int n = s.count.load();
+                    if ( n <= 0 || heap.rejects( n ) ) continue;
+                    const keyrec* k = s.key.load( std::memory_order_relaxed );
+                    heap.offer( element( std::string( k->bytes(), k->len ), n ) );
+                }
+            } );
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+//
+// Seeded 64-bit hash functions for the counting tables
+// The default string hash follows wyhash: 8 (or 16, or 48) bytes per step, each step a
+// single 64x64->128 bit multiply.  Every table draws its own random seed.
+//
+#ifndef __KJP_HASH_H__
+#define __KJP_HASH_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace kjp {
+
+    namespace detail {
+        constexpr uint64_t S0 = 0xa0761d6478bd642fULL;
+        constexpr uint64_t S1 = 0xe7037ed1a0b428dbULL;
+        constexpr uint64_t S2 = 0x8ebc6af09c88c6e3ULL;
+        constexpr uint64_t S3 = 0x589965cc75374cc3ULL;
+
+        inline uint64_t mix( uint64_t a, uint64_t b ) {
+            __uint128_t r = __uint128_t( a ) * b;
+            return uint64_t( r ) ^ uint64_t( r >> 64 );
+        }
+        inline uint64_t read8( const unsigned char* p ) { uint64_t v; memcpy( &v, p, 8 ); return v; }
+        inline uint64_t read4( const unsigned char* p ) { uint32_t v; memcpy( &v, p, 4 ); return v; }
+        inline uint64_t read3( const unsigned char* p, size_t k ) {
+            return ( uint64_t( p[0] ) << 16 ) | ( uint64_t( p[k >> 1] ) << 8 ) | p[k - 1];
+        }
+    }
+
+    inline uint64_t hash_bytes( const void* key, size_t len, uint64_t seed ) {
+        using namespace detail;
+        const unsigned char* p = static_cast<const unsigned char*>( key );
+        uint64_t a, b;
+
+        seed ^= mix( seed ^ S0, S1 );
+        if ( len <= 16 ) {
+            if ( len >= 4 ) {
+                a = ( read4( p ) << 32 ) | read4( p + ( ( len >> 3 ) << 2 ) );
+                b = ( read4( p + len - 4 ) << 32 ) | read4( p + len - 4 - ( ( len >> 3 ) << 2 ) );
+            } else if ( len > 0 ) {
+                a = read3( p, len );
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            if ( i > 48 ) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = mix( read8( p ) ^ S1, read8( p + 8 ) ^ seed );
+                    see1 = mix( read8( p + 16 ) ^ S2, read8( p + 24 ) ^ see1 );
+                    see2 = mix( read8( p + 32 ) ^ S3, read8( p + 40 ) ^ see2 );
+                    p += 48;
+                    i -= 48;
+                } while( i > 48 );
+                seed ^= see1 ^ see2;
+            }
+            while( i > 16 ) {
+                seed = mix( read8( p ) ^ S1, read8( p + 8 ) ^ seed );
+                i -= 16;
+                p += 16;
+            }
+            a = read8( p + i - 16 );
+            b = read8( p + i - 8 );
+        }
+
+        __uint128_t r = __uint128_t( a ^ S1 ) * ( b ^ seed );
+        return mix( uint64_t( r ) ^ S0 ^ len, uint64_t( r >> 64 ) ^ S1 );
+    }
+
+    inline uint64_t hash_u64( uint64_t x, uint64_t seed ) {
+        return detail::mix( x ^ detail::S0, seed ^ detail::S1 );
+    }
+
+    // The default hasher for the tables: h( key, seed ) -> 64 bits
+    template <typename K> struct hash;
+
+    // Takes a string_view, so strings and views of the same bytes hash alike
+    template <>
+    struct hash<std::string> {
+        uint64_t operator()( std::string_view s, uint64_t seed ) const {
+            return hash_bytes( s.data(), s.size(), seed );
+        }
+    };
+
+    template <>
+    struct hash<int> {
+        uint64_t operator()( int i, uint64_t seed ) const { return hash_u64( uint64_t( i ), seed ); }
+    };
+
+    // The hash stripedhashcounter used to have: a polynomial in a random multiplier,
+    // one multiply and modulo per byte.  Kept only so it can be benchmarked.
+    struct polyhash {
+        static constexpr uint64_t P = 2147483647ULL;      // 2^31 - 1
+
+        uint64_t operator()( std::string_view s, uint64_t seed ) const {
+            uint64_t ha = seed % ( P - 1 ) + 1;
+            uint64_t ret = 0;
+            for( const unsigned char c : s ) {
+                ret = ( ret * ha + c ) % P;
+            }
+            return ret;
+        }
+    };
+}
+
+#endif
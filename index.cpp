@@ -0,0 +1,449 @@
+//
+// The persistent index
+//
+
+#include "index.h"
+#include "hash.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kjp {
+
+namespace {
+    const char MAGIC[8] = { 'S', 'S', 'F', 'I', 'I', 'D', 'X', 0 };
+    constexpr uint32_t VERSION = 3;
+
+    size_t align8( size_t n ) { return ( n + 7 ) & ~size_t( 7 ); }
+
+    int compare( const char* a, size_t alen, const char* b, size_t blen ) {
+        int c = memcmp( a, b, std::min( alen, blen ) );
+        if ( c != 0 ) return c;
+        return alen < blen ? -1 : alen > blen ? 1 : 0;
+    }
+
+    // Index of p in the sorted words, or -1
+    long lookup( const std::vector<std::pair<std::string,int>>& words, const char* p, size_t n ) {
+        size_t lo = 0, hi = words.size();
+        while( lo < hi ) {
+            size_t mid = lo + ( hi - lo ) / 2;
+            int c = compare( words[mid].first.data(), words[mid].first.size(), p, n );
+            if ( c == 0 ) return mid;
+            if ( c < 0 ) lo = mid + 1;
+            else hi = mid;
+        }
+        return -1;
+    }
+
+    bool write_all( int fd, const void* p, size_t n ) {
+        const char* c = static_cast<const char*>( p );
+        while( n > 0 ) {
+            ssize_t r = ::write( fd, c, n );
+            if ( r < 0 ) {
+                if ( errno == EINTR ) continue;
+                return false;
+            }
+            c += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    // Write n bytes at p, starting at offset off, padding from at
+    bool write_at( int fd, size_t& at, size_t off, const void* p, size_t n ) {
+        static const char zeros[8] = { 0 };
+        if ( off > at && !write_all( fd, zeros, off - at ) ) return false;
+        if ( !write_all( fd, p, n ) ) return false;
+        at = off + n;
+        return true;
+    }
+
+    size_t varint_len( uint64_t v ) {
+        size_t n = 1;
+        while( v >= 0x80 ) {
+            v >>= 7;
+            ++n;
+        }
+        return n;
+    }
+
+    typedef std::pair<uint32_t,uint32_t> id_count;
+
+    // Code a run of (id, count) pairs, sorted by id and with no repeats
+    void encode_run( std::string& out, const std::vector<id_count>& run ) {
+        uint32_t prev = 0;
+        for( const auto& p : run ) {
+            detail::put_varint( out, p.first - prev );
+            detail::put_varint( out, p.second );
+            prev = p.first;
+        }
+    }
+
+    // Sort by id and add up repeated ids
+    void combine( std::vector<id_count>& run ) {
+        std::sort( run.begin(), run.end() );
+        size_t n = 0;
+        for( size_t i=0; i<run.size(); ++i ) {
+            if ( n > 0 && run[n-1].first == run[i].first ) {
+                run[n-1].second += run[i].second;
+            } else {
+                run[n++] = run[i];
+            }
+        }
+        run.resize( n );
+    }
+}
+
+file_stamp file_stamp::of( const struct stat& st ) {
+    return file_stamp{ uint64_t( st.st_mtim.tv_sec ) * 1000000000ULL + st.st_mtim.tv_nsec,
+                       uint64_t( st.st_size ), uint64_t( st.st_ino ), uint64_t( st.st_dev ) };
+}
+
+bool index_reader::open( const char* name ) {
+    close();
+
+    int fd = ::open( name, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) return false;
+    struct stat st;
+    if ( fstat( fd, &st ) < 0 ) {
+        int e = errno;
+        ::close( fd );
+        errno = e;
+        return false;
+    }
+    if ( size_t( st.st_size ) < sizeof(index_header) ) {
+        ::close( fd );
+        errno = EINVAL;
+        return false;
+    }
+    void* p = mmap( nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    int e = errno;
+    ::close( fd );
+    if ( p == MAP_FAILED ) {
+        errno = e;
+        return false;
+    }
+
+    base = static_cast<const char*>( p );
+    len = st.st_size;
+    hdr = reinterpret_cast<const index_header*>( base );
+    if ( !check_header() ) {
+        close();
+        errno = EINVAL;
+        return false;
+    }
+    words = reinterpret_cast<const index_word*>( base + hdr->words_off );
+    top = reinterpret_cast<const uint32_t*>( base + hdr->top_off );
+    files = reinterpret_cast<const index_file*>( base + hdr->files_off );
+    counts = reinterpret_cast<const unsigned char*>( base + hdr->counts_off );
+    postings = reinterpret_cast<const unsigned char*>( base + hdr->postings_off );
+    strings = base + hdr->strings_off;
+    return true;
+}
+
+// Check that every section is inside the file
+bool index_reader::check_header() const {
+    if ( memcmp( hdr->magic, MAGIC, sizeof(MAGIC) ) != 0 || hdr->version != VERSION ) return false;
+
+    auto fits = [this]( uint64_t off, uint64_t n, size_t size ) {
+        return off % 8 == 0 && off <= len && n <= ( len - off ) / size;
+    };
+    return fits( hdr->words_off, hdr->nwords, sizeof(index_word) ) &&
+           fits( hdr->top_off, hdr->nwords, sizeof(uint32_t) ) &&
+           fits( hdr->files_off, hdr->nfiles, sizeof(index_file) ) &&
+           fits( hdr->counts_off, hdr->counts_size, 1 ) &&
+           fits( hdr->postings_off, hdr->postings_size, 1 ) &&
+           fits( hdr->strings_off, hdr->strings_size, 1 );
+}
+
+// Check that everything the records point at is inside the file, and that every
+// counts and postings run decodes
+bool index_reader::verify() const {
+    if ( !hdr ) return false;
+    auto ignore = []( uint32_t, uint32_t ) {};
+    for( uint64_t i=0; i<hdr->nwords; ++i ) {
+        if ( !word_ok( i ) || top[i] >= hdr->nwords ) return false;
+        if ( i > 0 && words[i].postings < words[i-1].postings ) return false;
+        if ( !for_each_posting( i, ignore ) ) return false;
+    }
+    for( uint64_t i=0; i<hdr->nfiles; ++i ) {
+        const index_file& f = files[i];
+        if ( f.path > hdr->strings_size || f.len > hdr->strings_size - f.path ) return false;
+        if ( i > 0 && f.counts < files[i-1].counts ) return false;
+        if ( !for_each_count( i, ignore ) ) return false;
+    }
+    return true;
+}
+
+void index_reader::close() {
+    if ( base ) munmap( const_cast<char*>( base ), len );
+    base = nullptr;
+    len = 0;
+    hdr = nullptr;
+    words = nullptr;
+    top = nullptr;
+    files = nullptr;
+    counts = nullptr;
+    postings = nullptr;
+    strings = nullptr;
+}
+
+long index_reader::find_word( const char* p, size_t n ) const {
+    size_t lo = 0, hi = nwords();
+    while( lo < hi ) {
+        size_t mid = lo + ( hi - lo ) / 2;
+        if ( !word_ok( mid ) ) return -1;
+        int c = compare( word( mid ), word_len( mid ), p, n );
+        if ( c == 0 ) return mid;
+        if ( c < 0 ) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+long index_reader::find_file( const std::string& p ) const {
+    size_t lo = 0, hi = nfiles();
+    while( lo < hi ) {
+        size_t mid = lo + ( hi - lo ) / 2;
+        int c = compare( strings + files[mid].path, files[mid].len, p.data(), p.size() );
+        if ( c == 0 ) return mid;
+        if ( c < 0 ) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+index_writer::index_writer( const index_reader* o, uint32_t s ) : old(o), settings(s), dict( new dict_shard[NSHARDS] ) {}
+
+// A provisional id for word: its index within its shard, times NSHARDS, plus the shard
+uint32_t index_writer::provisional_id( const std::string& word, uint64_t h ) {
+    uint32_t s = h % NSHARDS;
+    dict_shard& d = dict[s];
+    std::lock_guard<std::mutex> lg( d.mtx );
+    auto r = d.ids.emplace( word, uint32_t( d.names.size() ) );
+    if ( r.second ) d.names.push_back( &r.first->first );
+    return r.first->second * NSHARDS + s;
+}
+
+void index_writer::set_file( const std::string& path, const file_stamp& st ) {
+    std::lock_guard<std::mutex> lg( mtx );
+    entry& e = entries[path];
+    e.stamp = st;
+    e.counted = false;
+    e.carried = -1;
+    e.runs.clear();
+}
+
+void index_writer::add_counts( const std::string& path, const std::vector<std::pair<std::string,int>>& counts ) {
+    std::vector<id_count> run;
+    run.reserve( counts.size() );
+    for( const auto& wc : counts ) {
+        if ( wc.second <= 0 ) continue;
+        uint64_t h = hash_bytes( wc.first.data(), wc.first.size(), 0 );
+        run.push_back( id_count( provisional_id( wc.first, h ), wc.second ) );
+    }
+    combine( run );
+    std::string coded;
+    detail::put_varint( coded, run.size() );
+    encode_run( coded, run );
+
+    std::lock_guard<std::mutex> lg( mtx );
+    entry& e = entries[path];
+    e.counted = true;
+    e.runs += coded;
+}
+
+void index_writer::carry( const std::string& path, size_t oldfile ) {
+    std::lock_guard<std::mutex> lg( mtx );
+    entry& e = entries[path];
+    e.stamp = old->stamp( oldfile );
+    e.counted = true;
+    e.carried = oldfile;
+    e.runs.clear();
+}
+
+bool index_writer::write( const char* name, std::vector<std::pair<std::string,int>> words ) {
+    std::lock_guard<std::mutex> lg( mtx );
+    const uint32_t NONE = UINT32_MAX;
+
+    std::sort( words.begin(), words.end(),
+               []( const std::pair<std::string,int>& a, const std::pair<std::string,int>& b ) {
+                   return a.first < b.first;
+               } );
+
+    // Provisional and old word ids to final ones
+    std::vector<uint32_t> remap;
+    for( uint32_t s=0; s<NSHARDS; ++s ) {
+        const dict_shard& d = dict[s];
+        for( size_t i=0; i<d.names.size(); ++i ) {
+            size_t id = i * NSHARDS + s;
+            if ( remap.size() <= id ) remap.resize( id + 1, NONE );
+            long w = lookup( words, d.names[i]->data(), d.names[i]->size() );
+            remap[id] = w >= 0 ? uint32_t( w ) : NONE;
+        }
+    }
+    std::vector<uint32_t> oldremap( old ? old->nwords() : 0 );
+    for( size_t i=0; i<oldremap.size(); ++i ) {
+        long w = lookup( words, old->word( i ), old->word_len( i ) );
+        oldremap[i] = w >= 0 ? uint32_t( w ) : NONE;
+    }
+
+    std::vector<const std::pair<const std::string, entry>*> order;
+    for( const auto& it : entries ) {
+        if ( it.second.counted ) order.push_back( &it );
+    }
+    std::sort( order.begin(), order.end(),
+               []( const std::pair<const std::string, entry>* a, const std::pair<const std::string, entry>* b ) {
+                   return a->first < b->first;
+               } );
+
+    std::string pool;
+    std::vector<index_word> wrecs( words.size() );
+    for( size_t i=0; i<words.size(); ++i ) {
+        wrecs[i] = index_word{ pool.size(), uint32_t( words[i].first.size() ), 0, uint64_t( words[i].second ), 0 };
+        pool += words[i].first;
+    }
+
+    std::vector<uint32_t> top( words.size() );
+    for( size_t i=0; i<top.size(); ++i ) top[i] = i;
+    std::stable_sort( top.begin(), top.end(), [&words]( uint32_t a, uint32_t b ) {
+        return words[a].second > words[b].second;
+    } );
+
+    // Each file's counts, in final word ids
+    std::vector<index_file> frecs;
+    std::string fwd;
+    std::vector<id_count> run;
+    uint64_t npostings = 0;
+    frecs.reserve( order.size() );
+    for( auto it : order ) {
+        const entry& e = it->second;
+        run.clear();
+        auto keep = [&run]( uint32_t w, uint32_t c ) {
+            if ( w != NONE ) run.push_back( id_count( w, c ) );
+        };
+        if ( e.carried >= 0 ) {
+            old->for_each_count( e.carried, [&]( uint32_t w, uint32_t c ) { keep( oldremap[w], c ); } );
+        } else {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>( e.runs.data() );
+            const unsigned char* end = p + e.runs.size();
+            uint64_t n;
+            while( p < end && detail::get_varint( p, end, n ) ) {
+                // We coded these ourselves, so they don't need checking
+                uint64_t id = 0, gap, c;
+                for( uint64_t k=0; k<n; ++k ) {
+                    detail::get_varint( p, end, gap );
+                    detail::get_varint( p, end, c );
+                    id += gap;
+                    keep( remap[id], c );
+                }
+            }
+        }
+        // Pieces of chunked or batched files come in separate runs
+        combine( run );
+
+        frecs.push_back( index_file{ pool.size(), uint32_t( it->first.size() ), 0,
+                                     e.stamp.mtime_ns, e.stamp.size, e.stamp.inode, e.stamp.dev,
+                                     fwd.size(), run.size() } );
+        encode_run( fwd, run );
+        npostings += run.size();
+        pool += it->first;
+    }
+
+    // Invert: size every word's posting run, then fill them in file order
+    std::vector<uint64_t> df( words.size(), 0 ), bytes( words.size(), 0 );
+    std::vector<uint32_t> last( words.size(), 0 );
+    auto fwd_begin = reinterpret_cast<const unsigned char*>( fwd.data() );
+    for( size_t f=0; f<frecs.size(); ++f ) {
+        const unsigned char* end = fwd_begin + ( f + 1 < frecs.size() ? frecs[f+1].counts : fwd.size() );
+        detail::decode_run( fwd_begin + frecs[f].counts, end, frecs[f].ncounts, words.size(),
+                            [&]( uint32_t w, uint32_t c ) {
+                                bytes[w] += varint_len( f - ( df[w] ? last[w] : 0 ) ) + varint_len( c );
+                                last[w] = f;
+                                ++df[w];
+                            } );
+    }
+    uint64_t off = 0;
+    for( size_t w=0; w<words.size(); ++w ) {
+        wrecs[w].postings = off;
+        off += varint_len( df[w] ) + bytes[w];
+    }
+    std::string post( off, '\0' );
+    std::vector<uint64_t> at( words.size() );
+    for( size_t w=0; w<words.size(); ++w ) {
+        std::string n;
+        detail::put_varint( n, df[w] );
+        memcpy( &post[wrecs[w].postings], n.data(), n.size() );
+        at[w] = wrecs[w].postings + n.size();
+        df[w] = 0;
+    }
+    std::string piece;
+    for( size_t f=0; f<frecs.size(); ++f ) {
+        const unsigned char* end = fwd_begin + ( f + 1 < frecs.size() ? frecs[f+1].counts : fwd.size() );
+        detail::decode_run( fwd_begin + frecs[f].counts, end, frecs[f].ncounts, words.size(),
+                            [&]( uint32_t w, uint32_t c ) {
+                                piece.clear();
+                                detail::put_varint( piece, f - ( df[w] ? last[w] : 0 ) );
+                                detail::put_varint( piece, c );
+                                memcpy( &post[at[w]], piece.data(), piece.size() );
+                                at[w] += piece.size();
+                                last[w] = f;
+                                ++df[w];
+                            } );
+    }
+
+    index_header hdr;
+    memset( &hdr, 0, sizeof(hdr) );
+    memcpy( hdr.magic, MAGIC, sizeof(MAGIC) );
+    hdr.version = VERSION;
+    hdr.settings = settings;
+    hdr.nwords = wrecs.size();
+    hdr.nfiles = frecs.size();
+    hdr.npostings = npostings;
+    hdr.words_off = align8( sizeof(hdr) );
+    hdr.top_off = align8( hdr.words_off + wrecs.size() * sizeof(index_word) );
+    hdr.files_off = align8( hdr.top_off + top.size() * sizeof(uint32_t) );
+    hdr.counts_off = align8( hdr.files_off + frecs.size() * sizeof(index_file) );
+    hdr.counts_size = fwd.size();
+    hdr.postings_off = align8( hdr.counts_off + fwd.size() );
+    hdr.postings_size = post.size();
+    hdr.strings_off = align8( hdr.postings_off + post.size() );
+    hdr.strings_size = pool.size();
+
+    std::string tmp = std::string( name ) + ".tmp";
+    int fd = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd < 0 ) return false;
+
+    size_t pos = 0;
+    bool ok = write_at( fd, pos, 0, &hdr, sizeof(hdr) ) &&
+              write_at( fd, pos, hdr.words_off, wrecs.data(), wrecs.size() * sizeof(index_word) ) &&
+              write_at( fd, pos, hdr.top_off, top.data(), top.size() * sizeof(uint32_t) ) &&
+              write_at( fd, pos, hdr.files_off, frecs.data(), frecs.size() * sizeof(index_file) ) &&
+              write_at( fd, pos, hdr.counts_off, fwd.data(), fwd.size() ) &&
+              write_at( fd, pos, hdr.postings_off, post.data(), post.size() ) &&
+              write_at( fd, pos, hdr.strings_off, pool.data(), pool.size() );
+
+    int e = errno;
+    if ( ::close( fd ) < 0 && ok ) {
+        e = errno;
+        ok = false;
+    }
+    if ( ok && rename( tmp.c_str(), name ) < 0 ) {
+        e = errno;
+        ok = false;
+    }
+    if ( !ok ) {
+        unlink( tmp.c_str() );
+        errno = e;
+    }
+    return ok;
+}
+
+}
@@ -0,0 +1,264 @@
+//
+// The persistent index
+// One binary file holds the global word counts, for every indexed file its identity
+// (mtime, size, inode, device) and its own word counts, so that the next run only has
+// to read the files that changed, and for every word the files it occurs in.  Every
+// section is a sorted run, and the whole file is meant to be used through mmap():
+//
+//     header
+//     words     index_word[nwords], sorted by word bytes
+//     top       uint32_t[nwords], word ids, most frequent first (ties by word)
+//     files     index_file[nfiles], sorted by path bytes; a file's id is its position
+//     counts    per file, (word id, count) pairs in word id order
+//     postings  per word, (file id, count) pairs in file id order
+//     strings   the word and path bytes the records above point into
+//
+// The counts and postings runs are delta + varint coded: each pair is the gap from the
+// previous id (the first id itself) and the count, as LEB128 varints.  On a typical
+// tree both usually fit in a byte each.  A posting run starts with its length.
+//
+// The header also keeps the settings the words were found with: whether the text was
+// read as UTF-8, so that queries can fold their words the same way, and a hash of what
+// was filtered out.  The counts of an index made with other settings can't be reused,
+// so it is rebuilt instead.
+//
+// All integers are in host byte order; the index isn't meant to move between machines.
+//
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility> // For std::pair
+#include <vector>
+
+struct stat;
+
+namespace kjp {
+
+    struct index_header {
+        char magic[8];              // "SSFIIDX" and a NUL
+        uint32_t version;
+        uint32_t settings;          // What the words depend on besides the files, or 0 for the defaults:
+                                    // SETTINGS_UTF8, and the rest a hash of the filter
+        uint64_t nwords, nfiles, npostings;
+        uint64_t words_off, top_off, files_off;
+        uint64_t counts_off, counts_size;
+        uint64_t postings_off, postings_size;
+        uint64_t strings_off, strings_size;
+    };
+
+    constexpr uint32_t SETTINGS_UTF8 = 1;
+
+    struct index_word {
+        uint64_t str;               // Offset into strings
+        uint32_t len;
+        uint32_t reserved;
+        uint64_t count;
+        uint64_t postings;          // Offset into postings; the run ends where the next starts
+    };
+
+    struct index_file {
+        uint64_t path;              // Offset into strings
+        uint32_t len;
+        uint32_t reserved;
+        uint64_t mtime_ns, size, inode, dev;
+        uint64_t counts;            // Offset into counts; the run ends where the next starts
+        uint64_t ncounts;           // Number of pairs in the run
+    };
+
+    namespace detail {
+        inline void put_varint( std::string& out, uint64_t v ) {
+            while( v >= 0x80 ) {
+                out += char( v | 0x80 );
+                v >>= 7;
+            }
+            out += char( v );
+        }
+
+        inline bool get_varint( const unsigned char*& p, const unsigned char* end, uint64_t& v ) {
+            v = 0;
+            for( int shift=0; shift<64 && p < end; shift+=7 ) {
+                unsigned char b = *p++;
+                v |= uint64_t( b & 0x7f ) << shift;
+                if ( !( b & 0x80 ) ) return true;
+            }
+            return false;
+        }
+
+        // Decode n (gap, count) pairs from [p, end), calling f( id, count ), with every
+        // id below limit.  Returns false if the run is damaged.
+        template <typename F>
+        bool decode_run( const unsigned char* p, const unsigned char* end, uint64_t n,
+                         uint64_t limit, F f ) {
+            uint64_t id = 0, gap, count;
+            for( uint64_t k=0; k<n; ++k ) {
+                if ( !get_varint( p, end, gap ) || !get_varint( p, end, count ) ) return false;
+                if ( ( k > 0 && gap == 0 ) || gap >= limit - id || count > UINT32_MAX ) return false;
+                id += gap;
+                f( uint32_t( id ), uint32_t( count ) );
+            }
+            return true;
+        }
+    }
+
+    // What we compare to decide whether a file has to be read again
+    struct file_stamp {
+        uint64_t mtime_ns, size, inode, dev;
+
+        static file_stamp of( const struct stat& st );
+        bool operator==( const file_stamp& o ) const {
+            return mtime_ns == o.mtime_ns && size == o.size && inode == o.inode && dev == o.dev;
+        }
+        bool operator!=( const file_stamp& o ) const { return !( *this == o ); }
+    };
+
+    // A read-only, memory-mapped index
+    class index_reader {
+        const char* base;
+        size_t len;
+        const index_header* hdr;
+        const index_word* words;
+        const uint32_t* top;
+        const index_file* files;
+        const unsigned char* counts;
+        const unsigned char* postings;
+        const char* strings;
+
+        bool check_header() const;
+        bool word_ok( size_t i ) const {
+            return words[i].str <= hdr->strings_size && words[i].len <= hdr->strings_size - words[i].str;
+        }
+
+        // Where a run starting at off ends: at the next record's run, or the section's end
+        template <typename R>
+        const unsigned char* run_end( const unsigned char* sect, uint64_t size, const R* recs,
+                                      size_t n, size_t i, uint64_t R::*field ) const {
+            uint64_t e = i + 1 < n ? recs[i+1].*field : size;
+            return sect + ( e < size ? e : size );
+        }
+
+    public:
+        index_reader() : base(nullptr), len(0), hdr(nullptr), words(nullptr), top(nullptr), files(nullptr),
+                         counts(nullptr), postings(nullptr), strings(nullptr) {}
+        index_reader( const index_reader& ) = delete;
+        index_reader& operator=( const index_reader& ) = delete;
+        ~index_reader() { close(); }
+
+        // Returns false with errno set if name can't be mapped, or EINVAL if it isn't
+        // an index we understand.  Only the header is looked at, so this is cheap however
+        // big the index is; find_word(), top_word() and the run decoders check each
+        // record they touch.
+        bool open( const char* name );
+        void close();
+
+        // Check every record.  Required before using the unchecked accessors below.
+        bool verify() const;
+
+        size_t nwords() const { return hdr ? hdr->nwords : 0; }
+        size_t nfiles() const { return hdr ? hdr->nfiles : 0; }
+        size_t npostings() const { return hdr ? hdr->npostings : 0; }
+        size_t postings_bytes() const { return hdr ? hdr->postings_size : 0; }
+        uint32_t settings() const { return hdr ? hdr->settings : 0; }
+        bool utf8() const { return settings() & SETTINGS_UTF8; }
+
+        const char* word( size_t i ) const { return strings + words[i].str; }
+        size_t word_len( size_t i ) const { return words[i].len; }
+        uint64_t word_count( size_t i ) const { return words[i].count; }
+
+        // The word's index, or -1 if it isn't there (or the index is damaged)
+        long find_word( const char* p, size_t n ) const;
+
+        // The id of the i'th most frequent word, or -1 if the index is damaged
+        long top_word( size_t i ) const {
+            uint32_t w = top[i];
+            return w < nwords() && word_ok( w ) ? long( w ) : -1;
+        }
+
+        std::string path( size_t i ) const {
+            const index_file& f = files[i];
+            if ( f.path > hdr->strings_size || f.len > hdr->strings_size - f.path ) return std::string();
+            return std::string( strings + f.path, f.len );
+        }
+        file_stamp stamp( size_t i ) const {
+            return file_stamp{ files[i].mtime_ns, files[i].size, files[i].inode, files[i].dev };
+        }
+
+        // The file's index, or -1 if it isn't there
+        long find_file( const std::string& path ) const;
+
+        // Call f( word id, count ) for each word of file i.  Returns false if the run is damaged.
+        template <typename F>
+        bool for_each_count( size_t i, F f ) const {
+            if ( files[i].counts > hdr->counts_size ) return false;
+            return detail::decode_run( counts + files[i].counts,
+                                       run_end( counts, hdr->counts_size, files, nfiles(), i, &index_file::counts ),
+                                       files[i].ncounts, nwords(), f );
+        }
+
+        // Call f( file id, count ) for each file word w occurs in.  Returns false if the run
+        // is damaged.
+        template <typename F>
+        bool for_each_posting( size_t w, F f ) const {
+            if ( words[w].postings > hdr->postings_size ) return false;
+            const unsigned char* p = postings + words[w].postings;
+            const unsigned char* end = run_end( postings, hdr->postings_size, words, nwords(), w,
+                                                &index_word::postings );
+            uint64_t n;
+            return detail::get_varint( p, end, n ) && detail::decode_run( p, end, n, nfiles(), f );
+        }
+    };
+
+    // Collects the files of this run, then writes the new index in one go.  Word counts
+    // are coded as they arrive, against provisional word ids, so buffering a posting
+    // costs a few bytes rather than a string.
+    class index_writer {
+        #ifdef INDEX_DICT_SHARDS
+        static constexpr uint32_t NSHARDS=INDEX_DICT_SHARDS;
+        #else
+        static constexpr uint32_t NSHARDS=64;       // Provisional word id dictionaries
+        #endif
+
+        struct dict_shard {
+            std::mutex mtx;
+            std::unordered_map<std::string, uint32_t> ids;      // Word to its index in names
+            std::vector<const std::string*> names;
+        };
+
+        struct entry {
+            file_stamp stamp;
+            bool counted;           // Read this run, or carried over; never-read files are dropped
+            long carried;           // File index in the old index, or -1
+            std::string runs;       // Each: varint pair count, then coded (provisional id, count) pairs
+        };
+
+        const index_reader* old;
+        uint32_t settings;
+        std::unique_ptr<dict_shard[]> dict;
+        std::mutex mtx;
+        std::unordered_map<std::string, entry> entries;
+
+        uint32_t provisional_id( const std::string& word, uint64_t h );
+
+    public:
+        // Carrying counts over from o, which must have been made with the same settings
+        explicit index_writer( const index_reader* o=nullptr, uint32_t s=0 );
+
+        // path is about to be read
+        void set_file( const std::string& path, const file_stamp& st );
+        // Some of path's word counts; may be called several times per file
+        void add_counts( const std::string& path, const std::vector<std::pair<std::string,int>>& counts );
+        // path is unchanged since the old index, which already has its counts
+        void carry( const std::string& path, size_t oldfile );
+
+        // Write the index to name (through a temporary and a rename), with words as the
+        // global counts.  Returns false with errno set on failure.
+        bool write( const char* name, std::vector<std::pair<std::string,int>> words );
+    };
+}
+
+#endif
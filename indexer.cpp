@@ -0,0 +1,997 @@
+//
+// ssfi as a library: the indexer, its workers and what they do with each task
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+#include "indexer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <regex>
+#include <thread>
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "decompress.h"  // For .gz and .zst input
+#include "flathash.h"    // for flathashcounter
+#include "spacesaving.h" // for spacesavingcounter
+#include "spillcounter.h" // For memlimit
+#include "stats.h"       // For --stats
+#include "stripedhash.h" // for stripedhashcounter
+#include "index.h"       // For the persistent index
+#include "localcounter.h" // For per-thread pre-aggregation
+#include "ngram.h"       // For ngram
+#include "numa.h"        // For numa
+#include "prefetch.h"    // For io_mode::uring
+#include "shardedcounter.h" // For a table per NUMA node
+#include "wsqueue.h"     // For the work-stealing scheduler
+
+using namespace std;
+using kjp::workstealing_pool;
+using kjp::tokenizer;
+using kjp::tokenizer_engine;
+using kjp::io_mode;
+
+int debug = false;
+
+#ifdef SSFI_TEXT_BLOCK
+constexpr size_t TEXT_BLOCK=SSFI_TEXT_BLOCK;
+#else
+constexpr size_t TEXT_BLOCK=4 << 20;        // Decompressed bytes handed on at once, at most
+#endif
+
+#ifdef SSFI_LOCAL_WORD_BYTES
+constexpr size_t LOCAL_WORD_BYTES=SSFI_LOCAL_WORD_BYTES;
+#else
+constexpr size_t LOCAL_WORD_BYTES=128;      // A word in a local counter, roughly, for memlimit
+#endif
+
+namespace {
+
+// Shared by the tasks a compressed file is counted in
+struct compressed_file {
+    string path;
+    vector<char> buf;               // Holds the file if it's too small to map
+    kjp::file_view fv;
+    atomic<int> blocks;             // Decompressed blocks queued but not yet counted
+
+    // A zstd file of several frames is counted frame by frame; the partial words at
+    // either end of each are put together once all of them are done
+    vector<pair<size_t,size_t>> frames;
+    vector<string> heads, tails;
+    vector<char> whole;             // Frame i was all one word, in heads[i]
+    atomic<size_t> frames_left;
+
+    compressed_file( const string& p ) : path(p), blocks(0), frames_left(0) {}
+};
+
+// One parallel_runner::run() on the pool.  The calls are claimed one at a time by the
+// caller and by helper tasks; a helper that only starts once they're all claimed has
+// nothing to do, so the caller never waits for one that hasn't started.
+struct parallel_call {
+    const function<void( int )>* f;     // Only used while calls are left to claim
+    int n;
+    atomic<int> next;
+    atomic<int> busy;                   // Threads that may still be running a call
+    mutex mtx;
+    condition_variable cv;
+
+    parallel_call( const function<void( int )>& fn, int count ) : f(&fn), n(count), next(0), busy(0) {}
+
+    void work() {
+        busy.fetch_add( 1 );
+        for( int i; ( i = next.fetch_add( 1 ) ) < n; ) (*f)( i );
+        if ( busy.fetch_sub( 1 ) == 1 ) {
+            lock_guard<mutex> lg( mtx );
+            cv.notify_all();
+        }
+    }
+
+    // Once the caller's own work() has returned, every call has been claimed
+    void wait() {
+        unique_lock<mutex> lg( mtx );
+        cv.wait( lg, [this]() { return busy.load() == 0; } );
+    }
+};
+
+// A unit of work for the pool.  Directories are listed by the workers, which
+// queue up whatever matching files and subdirectories they find; a subdirectory is
+// opened from its parent, kept open for it, by the name at offset in its path.  A chunk is
+// the words starting in [offset, offset+length) of a file too big for one worker.
+// A buffer is a whole file the prefetcher has already read.  A text task is
+// [offset, offset+length) of a block of a compressed file, already decompressed
+// into text, and a frame is frame number offset of a zstd file.  A call helps with a
+// parallel_call.
+struct task {
+    enum kind_t { file, directory, chunk, buffer, text, frame, call } kind;
+    string path;
+    size_t offset;
+    size_t length;
+    kjp::prefetcher::buffer* buf;
+    shared_ptr<compressed_file> cf;
+    vector<char> data;              // A text task's block
+    shared_ptr<parallel_call> pc;
+    shared_ptr<kjp::directory> parent;
+
+    task( kind_t k, const string& p, size_t off=0, size_t len=0, kjp::prefetcher::buffer* b=nullptr ) :
+        kind(k), path(p), offset(off), length(len), buf(b) {}
+};
+
+struct worker_context;
+
+// The pool worker this thread is (from 1), or 0
+thread_local int worker_tid = 0;
+
+// Make a parallel_runner the calling thread's for as long as this lasts
+struct runner_scope {
+    kjp::parallel_runner* prev;
+    explicit runner_scope( kjp::parallel_runner* r ) : prev( kjp::detail::runner ) { kjp::detail::runner = r; }
+    ~runner_scope() { kjp::detail::runner = prev; }
+};
+
+}
+
+namespace kjp {
+namespace detail {
+
+// Everything an indexer keeps between runs.  The workers are started once and sleep
+// in the pool between calls to index().
+struct indexer_state {
+    indexer_options opts;
+    numa_topology topology;
+    size_t localcap;            // With memlimit, merge a worker's local counts at this many words
+
+    unique_ptr<wordcounter> hc;
+    wordcounter_adapter<spacesavingcounter>* approx;    // hc, as whichever of these it is
+    spillingcounter* spill;
+    unique_ptr<kjp::ngramcounter> ng;           // Instead of hc, with ngram
+
+    unique_ptr<workstealing_pool<task>> pool;
+
+    // Runs the top-K scans (topk.h) on the workers rather than on threads of their own
+    struct pool_runner : kjp::parallel_runner {
+        indexer_state& ix;
+        atomic<int> helpers;            // Call tasks not yet taken by a worker
+        explicit pool_runner( indexer_state& s ) : ix(s), helpers(0) {}
+        void run( int n, const function<void( int )>& f ) override;
+    } runner;
+    unique_ptr<kjp::prefetcher> reader;        // Only with io_mode::uring
+    vector<thread> workers;
+
+    // Only set during a run with an index file
+    unique_ptr<kjp::index_reader> oldindex;     // The index from the last run, if there is one
+    unique_ptr<kjp::index_writer> newindex;
+    unique_ptr<atomic<bool>[]> indexseen;       // Which of oldindex's files this walk found
+
+    explicit indexer_state( const indexer_options& o );
+    ~indexer_state();
+
+    wordcounter* make_table( int node=-1 );
+    wordcounter* build_table();
+    void new_table();
+    bool run( const vector<string>& paths );
+    bool open_index();
+    bool close_index();
+
+    bool wanted( const char* name, size_t len ) const;
+
+    // from is the submitting worker's tid, or 0 from the calling thread
+    void submit( task::kind_t kind, const string& path, int from=0 ) {
+        pool->submit( new task( kind, path ), from - 1 );
+    }
+    void submit_directory( const string& path, size_t name, const shared_ptr<kjp::directory>& parent, int from ) {
+        task* t = new task( task::directory, path, name );
+        t->parent = parent;
+        pool->submit( t, from - 1 );
+    }
+    void submit_chunk( const string& path, size_t offset, size_t length, int from ) {
+        pool->submit( new task( task::chunk, path, offset, length ), from - 1 );
+    }
+
+    void worker( int mytid );
+    void worker_process_file( worker_context& ctx, const string& name );
+    void worker_process_directory( worker_context& ctx, task& t );
+    void worker_process_chunk( worker_context& ctx, const task& t );
+    void worker_process_buffer( worker_context& ctx, const task& t );
+    void worker_process_compressed( worker_context& ctx, const string& name, kjp::compression comp );
+    void worker_process_text( worker_context& ctx, const task& t );
+    void worker_process_frame( worker_context& ctx, const task& t );
+    void regex_process_range( worker_context& ctx, const char* begin, const char* end );
+    void process_range( worker_context& ctx, const char* begin, const char* end );
+    bool split_file( worker_context& ctx, const string& name, size_t size );
+    void report_decompress_error( worker_context& ctx, const string& name, const string& err );
+    void report_open_error( const string& who, const string& path, int err );
+    void report_open_error( worker_context& ctx, const string& path, int err );
+    void subtract_indexed( size_t file );
+    bool index_prepare( worker_context& ctx, const string& name, const struct stat& st );
+};
+
+}
+}
+
+using kjp::detail::indexer_state;
+
+namespace {
+
+// Per-thread state, reused from one file to the next, and from one run to the next
+struct worker_context {
+    indexer_state& ix;
+    int tid;
+    tokenizer tok;
+    vector<char> buf;     // Holds small files in mmap mode
+    vector<char> dirbuf;  // For getdents64
+    kjp::localcounter local;
+    kjp::ngram_window window;             // With ngram, the file's last words
+    kjp::ngram_localcounter grams;        // and the n-grams counted locally
+    long pending;         // Words counted in local since the last flush
+    vector<pair<string,int>> filecounts;  // The current file's words, for the index
+    uint64_t nbytes, nwords;              // Tokenized since the last task, for --stats
+
+    worker_context( indexer_state& s, int mytid ) :
+        ix(s), tid(mytid), tok(s.opts.engine, s.opts.utf8, s.opts.ngram > 1 ? nullptr : &s.opts.words),
+        window(s.opts.ngram), pending(0), nbytes(0), nwords(0) {}
+
+    // Merge the locally counted words into the shared table
+    void flush() {
+        local.flush( [this]( const string& w, int n ) {
+            ix.hc->insert_n( w, n );
+            if ( ix.newindex ) filecounts.emplace_back( w, n );
+        } );
+        grams.flush( [this]( const kjp::ngram_ref& g, int n ) { ix.ng->insert_n( g, n ); } );
+        pending = 0;
+    }
+
+    // Done with (a chunk of) path
+    void finish( const string& path ) {
+        flush();
+        window.clear();
+        if ( ix.newindex ) ix.newindex->add_counts( path, filecounts );
+        filecounts.clear();
+    }
+
+    void count( const char* p, size_t len ) {
+        if ( ix.ng ) {
+            // Filtered here rather than by the tokenizer, so that a word left out ends
+            // the n-grams on either side of it instead of bringing its neighbours together
+            if ( !ix.opts.words.keeps( p, len ) ) {
+                window.clear();
+                return;
+            }
+            ++nwords;
+            count_ngram( p, len );
+            return;
+        }
+        ++nwords;
+        if ( !ix.opts.preaggregate ) {
+            ix.hc->insert( string_view( p, len ) );
+            return;
+        }
+        local.add( p, len );
+        if ( ix.opts.aggbatch > 0 && ++pending >= ix.opts.aggbatch ) {
+            flush();
+        } else if ( ix.localcap && local.distinct() >= ix.localcap ) {
+            flush();
+        }
+    }
+
+    // The n-gram that ends with this word, once there have been enough
+    void count_ngram( const char* p, size_t len ) {
+        kjp::ngram_ref key;
+        if ( !window.push( p, len, key ) ) return;
+        if ( !ix.opts.preaggregate ) {
+            ix.ng->insert_n( key, 1 );
+            return;
+        }
+        grams.add( key );
+        if ( ix.opts.aggbatch > 0 && ++pending >= ix.opts.aggbatch ) flush();
+    }
+};
+
+// For nftw, which has no way to pass it along
+thread_local indexer_state* walking = nullptr;
+
+int ntfw_process_file(const char *name, const struct stat *status, int type, struct FTW *fb) {
+    if ( type != FTW_F ) return 0;
+
+    if ( !walking->wanted( name, strlen(name) ) ) {
+        // debug && cout << name << ": does not match " << extfilter.to_string() << endl;
+        return 0;
+    }
+    debug && cout << "Processing: " << name << endl;
+    walking->submit( task::file, name );
+    
+    return 0;
+}
+
+}
+
+namespace kjp {
+
+indexer::indexer( const indexer_options& opts ) : st( new detail::indexer_state( opts ) ) {}
+
+indexer::~indexer() {}
+
+const indexer_options& indexer::options() const { return st->opts; }
+
+bool indexer::index( const std::vector<std::string>& paths ) {
+    runner_scope rs( &st->runner );     // For writing the index
+    return st->run( paths );
+}
+
+std::vector<indexer::element> indexer::top( int count ) {
+    runner_scope rs( &st->runner );
+    if ( !st->ng ) return st->hc->extract_top( count, st->opts.nthreads );
+    // Copied out of the table's arena, which reset() frees
+    std::vector<element> words;
+    for( auto& e : st->ng->extract_top( count, st->opts.nthreads ) ) {
+        words.emplace_back( std::string( e.first.text ), e.second );
+    }
+    return words;
+}
+
+void indexer::reset() { st->new_table(); }
+
+wordcounter::resize_stats indexer::resize_stats() const {
+    if ( !st->ng ) return st->hc->get_resize_stats();
+    auto rs = st->ng->get_resize_stats();
+    return wordcounter::resize_stats{ rs.resizes, rs.pauses, rs.total_ns, rs.max_ns };
+}
+size_t indexer::spilled_runs() const { return st->spill ? st->spill->nruns() : 0; }
+size_t indexer::spilled_bytes() const { return st->spill ? st->spill->bytes_spilled() : 0; }
+long indexer::approx_words() const { return st->approx ? st->approx->table.total() : 0; }
+long indexer::approx_error() const { return st->approx ? st->approx->table.error_bound() : 0; }
+
+namespace detail {
+
+indexer_state::indexer_state( const indexer_options& o ) :
+    opts(o), localcap(0), approx(nullptr), spill(nullptr), runner( *this ) {
+    opts.nthreads = max( 1, opts.nthreads );
+    if ( opts.engine != tokenizer_engine::regex ) opts.engine = resolve_tokenizer_engine( opts.engine );
+    if ( opts.ext.empty() ) opts.ext.add( ".txt" );
+    // Per-file counts come out of the local counters
+    if ( !opts.indexfile.empty() ) opts.preaggregate = true;
+    if ( opts.spilldir.empty() ) {
+        const char* tmp = getenv( "TMPDIR" );
+        opts.spilldir = tmp && *tmp ? tmp : "/tmp";
+    }
+    opts.ngram = max( 1u, opts.ngram );
+    if ( opts.ngram > 1 ) {
+        // An n-gram can span any of a file's lines, so a file is counted whole, by one
+        // worker, in order; and the approximate, spilling and indexed tables are of words
+        opts.chunksize = 0;
+        opts.approx = 0;
+        opts.memlimit = 0;
+        opts.indexfile.clear();
+    }
+    if ( opts.numa ) {
+        topology = kjp::numa_topology::detect();
+        debug && cout << "NUMA: " << topology.to_string() << endl;
+    }
+    new_table();
+
+    pool.reset( new workstealing_pool<task>( opts.nthreads ) );
+    if ( opts.io == io_mode::uring ) {
+        // Every callback ends the hold taken when the path was handed over
+        size_t chunksize = opts.chunksize;
+        reader.reset( new kjp::prefetcher( opts.inflight, opts.nthreads, chunksize > 0 ? chunksize + 1 : SIZE_MAX,
+            [this]( kjp::prefetcher::buffer* b ) {
+                pool->submit( new task( task::buffer, b->path, 0, b->len, b ) );
+                pool->done();
+            },
+            [this, chunksize]( const string& path, size_t size ) {
+                if ( chunksize == 0 ) {
+                    // Too big to buffer, and not to be split: mapped, as one chunk
+                    submit_chunk( path, 0, size, 0 );
+                }
+                for( size_t off=0; chunksize > 0 && off<size; off+=chunksize ) {
+                    submit_chunk( path, off, min( chunksize, size - off ), 0 );
+                }
+                pool->done();
+            },
+            [this]( const string& path, int err ) {
+                report_open_error( "reader", path, err );
+                pool->done();
+            } ) );
+        reader->start();
+        debug && cout << "Reader: " << reader->backend() << ", " << opts.inflight << " in flight" << endl;
+    }
+    for( int i=0; i<opts.nthreads; ++i ) {
+        workers.emplace_back( &indexer_state::worker, this, (i+1) );
+    }
+}
+
+indexer_state::~indexer_state() {
+    if ( reader ) reader->stop();
+    // A top-K scan can leave helpers queued that it didn't need; they're quickly done
+    while( runner.helpers.load() > 0 ) this_thread::yield();
+    pool->shutdown();
+    for( auto& t : workers ) t.join();
+}
+
+// One of the exact tables, as chosen in the options, with its memory on node (a
+// sysfs node number) if that isn't -1
+wordcounter* indexer_state::make_table( int node ) {
+    bool placed = true;
+    wordcounter* table;
+    if ( opts.flat ) {
+        auto t = new wordcounter_adapter<flathashcounter>;
+        if ( node >= 0 ) placed = t->table.set_home_node( node );
+        table = t;
+    } else {
+        auto t = new wordcounter_adapter<stripedhashcounter<string>>;
+        t->table.set_incremental_resize( opts.incremental );
+        if ( node >= 0 ) placed = t->table.set_home_node( node );
+        table = t;
+    }
+    if ( !placed ) cerr << "Warning: Cannot bind table memory to node " << node << ": " << strerror( errno ) << endl;
+    return table;
+}
+
+// An exact table, sharded with numa
+wordcounter* indexer_state::build_table() {
+    if ( !opts.numa || topology.nodes() <= 1 ) return make_table();
+    // Build each shard from a thread on its node, and bind its memory there, so that it
+    // stays there as the shard grows, whichever worker grows it
+    vector<unique_ptr<wordcounter>> shards( topology.nodes() );
+    for( size_t n=0; n<topology.nodes(); ++n ) {
+        thread( [this, n, &shards]() {
+            if ( !kjp::pin_thread( topology.node_cpus( n ) ) ) {
+                cerr << "Warning: Cannot bind to node " << topology.node_id( n ) << ": " << strerror( errno ) << endl;
+            }
+            shards[n].reset( make_table( topology.node_id( n ) ) );
+        } ).join();
+    }
+    return new shardedcounter( std::move( shards ) );
+}
+
+// Replace the table with an empty one.  Only while the workers are idle.
+void indexer_state::new_table() {
+    hc.reset();
+    ng.reset();
+    approx = nullptr;
+    spill = nullptr;
+    if ( opts.ngram > 1 ) {
+        // Not sharded with numa: a shardedcounter is of words
+        ng.reset( new kjp::ngramcounter );
+        ng->set_incremental_resize( opts.incremental );
+    } else if ( opts.approx ) {
+        // Already one summary per thread; nothing to gain from sharding it again
+        approx = new wordcounter_adapter<spacesavingcounter>( opts.approx, opts.nthreads );
+        hc.reset( approx );
+    } else if ( opts.memlimit ) {
+        spill = new spillingcounter( [this]() { return build_table(); }, opts.memlimit, opts.spilldir, opts.nthreads );
+        hc.reset( spill );
+        // The workers' local counters get a quarter of the budget between them
+        localcap = max<size_t>( 1024, opts.memlimit / 4 / opts.nthreads / LOCAL_WORD_BYTES );
+    } else {
+        hc.reset( build_table() );
+    }
+}
+
+// Whether name matches the extension filter, or would if it weren't compressed
+bool indexer_state::wanted( const char* name, size_t len ) const {
+    if ( opts.ext.match( name, len ) ) return true;
+    size_t stem;
+    kjp::compression comp = kjp::compression_of( name, len, &stem );
+    return comp != kjp::compression::none && kjp::compression_supported( comp ) && opts.ext.match( name, stem );
+}
+
+// Load the index from the last run, and start the new one
+bool indexer_state::open_index() {
+    oldindex.reset( new kjp::index_reader );
+    bool ok = oldindex->open( opts.indexfile.c_str() );
+    if ( ok && !oldindex->verify() ) {
+        ok = false;
+        errno = EINVAL;
+    }
+
+    // The counts also depend on what the tokenizer leaves out and on how it reads the text
+    uint32_t settings = opts.utf8 ? kjp::SETTINGS_UTF8 : 0;
+    if ( !opts.words.empty() ) {
+        uint64_t h = opts.words.hash();
+        settings |= ( uint32_t( h ^ ( h >> 32 ) ) | 2 ) & ~kjp::SETTINGS_UTF8;
+    }
+    if ( ok && oldindex->settings() != settings ) {
+        cerr << "Warning: Rebuilding index " << opts.indexfile
+             << ": it was made with other --stopwords, --min-len or --utf8 settings" << endl;
+        oldindex.reset();
+        ok = false;
+    } else if ( ok ) {
+        debug && cout << "Index: " << oldindex->nfiles() << " files, " << oldindex->nwords() << " words" << endl;
+        // Start from the old totals; changed and vanished files are subtracted as we go
+        for( size_t i=0; i<oldindex->nwords(); ++i ) {
+            hc->insert_n( string_view( oldindex->word( i ), oldindex->word_len( i ) ), oldindex->word_count( i ) );
+        }
+        indexseen.reset( new atomic<bool>[oldindex->nfiles()]() );
+    } else {
+        if ( errno != ENOENT ) {
+            cerr << "Warning: Ignoring index " << opts.indexfile << ": "
+                 << ( errno == EINVAL ? "not a valid index" : strerror( errno ) ) << endl;
+        }
+        oldindex.reset();
+    }
+    newindex.reset( new kjp::index_writer( oldindex.get(), settings ) );
+    return ok;
+}
+
+// Take out the files that have gone, and write the new index
+bool indexer_state::close_index() {
+    for( size_t i=0; oldindex && i<oldindex->nfiles(); ++i ) {
+        if ( !indexseen[i] ) subtract_indexed( i );
+    }
+    bool ok = newindex->write( opts.indexfile.c_str(), hc->extract_top( 0, opts.nthreads ) );
+    int err = errno;
+    newindex.reset();
+    indexseen.reset();
+    oldindex.reset();
+    errno = err;
+    return ok;
+}
+
+bool indexer_state::run( const vector<string>& paths ) {
+    if ( !opts.indexfile.empty() ) {
+        // The index holds the totals for the whole walk
+        new_table();
+        open_index();
+    }
+
+    for( const string& path : paths ) {
+        if ( opts.serialwalk ) {
+            walking = this;
+            if ( nftw( path.c_str(), ntfw_process_file, 32, 0 ) < 0 ) {
+                cerr << "Error processing directory " << path << ": "
+                     << strerror( errno ) << endl;
+            }
+            walking = nullptr;
+            continue;
+        }
+
+        struct stat st;
+        if ( stat( path.c_str(), &st ) < 0 ) {
+            cerr << "Error processing directory " << path << ": "
+                 << strerror( errno ) << endl;
+        } else if ( S_ISDIR( st.st_mode ) ) {
+            submit( task::directory, path );
+        } else if ( S_ISREG( st.st_mode ) && wanted( path.data(), path.size() ) ) {
+            submit( task::file, path );
+        }
+    }
+
+    // Wait for the walk and every file to be finished
+    pool->wait();
+    return newindex ? close_index() : true;
+}
+
+void indexer_state::pool_runner::run( int n, const function<void( int )>& f ) {
+    auto pc = make_shared<parallel_call>( f, n );
+    int count = min( n - 1, ix.pool->size() );
+    helpers.fetch_add( count );
+    for( int i=0; i<count; ++i ) {
+        task* t = new task( task::call, string() );
+        t->pc = pc;
+        ix.pool->submit( t, worker_tid - 1 );
+    }
+    pc->work();
+    pc->wait();
+}
+
+void indexer_state::worker( int mytid ) {
+    task* t;
+    worker_tid = mytid;
+    kjp::detail::runner = &runner;      // For top-K scans nested in one of ours
+    if ( opts.numa ) {
+        int cpu = topology.cpu_of_worker( mytid - 1 );
+        if ( !kjp::pin_thread( vector<int>{ cpu } ) ) {
+            ostringstream os;
+            os << "[" << mytid << "] Warning: Cannot pin to CPU " << cpu << ": " << strerror( errno ) << endl;
+            cerr << os.str();
+        }
+        debug && cout << "[" << mytid << "]" << " Pinned to CPU " << cpu << endl;
+    }
+    // Constructed after pinning, so the worker's buffers are on its own node
+    worker_context ctx( *this, mytid );
+    debug && cout << "[" << mytid << "]" << " Starting..." << endl;
+    uint64_t waited = kjp::stats::enabled ? kjp::stats::now_ns() : 0;
+    while( pool->next( mytid - 1, t ) ) {
+        debug && cout << "[" << mytid << "]" << " Processing " << t->path << endl;
+        if ( kjp::stats::enabled ) {
+            kjp::stats::counters& st = kjp::stats::mine();
+            uint64_t now = kjp::stats::now_ns();
+            st.queue_waits++;
+            st.queue_wait_ns += now - waited;
+            waited = now;
+        }
+
+        if ( t->kind == task::directory ) {
+            worker_process_directory( ctx, *t );
+        } else if ( t->kind == task::chunk ) {
+            worker_process_chunk( ctx, *t );
+        } else if ( t->kind == task::buffer ) {
+            worker_process_buffer( ctx, *t );
+        } else if ( t->kind == task::text ) {
+            worker_process_text( ctx, *t );
+        } else if ( t->kind == task::frame ) {
+            worker_process_frame( ctx, *t );
+        } else if ( t->kind == task::call ) {
+            t->pc->work();
+            runner.helpers.fetch_sub( 1 );
+        } else {
+            worker_process_file( ctx, t->path );
+        }
+        delete t;
+        if ( kjp::stats::enabled ) {
+            // Before done(), so that it's all in by the time the run is
+            kjp::stats::counters& st = kjp::stats::mine();
+            uint64_t now = kjp::stats::now_ns();
+            st.task_ns += now - waited;
+            st.bytes += ctx.nbytes;
+            st.words += ctx.nwords;
+            ctx.nbytes = ctx.nwords = 0;
+            waited = now;
+        }
+        pool->done();
+    }
+}
+
+// Queue up the matching files and the subdirectories of name
+void indexer_state::worker_process_directory( worker_context& ctx, task& t ) {
+    const string& name = t.path;
+    string prefix = name;
+    if ( prefix.empty() || prefix.back() != '/' ) prefix += '/';
+
+    shared_ptr<kjp::directory> dir = kjp::open_directory( name, t.offset, t.parent );
+    t.parent.reset();           // The last subdirectory to be opened closes it
+    // Unless too many are open already, in which case the subdirectories go by their paths
+    shared_ptr<kjp::directory> share = dir && dir->shareable() ? dir : nullptr;
+    bool ok = dir && kjp::list_directory( *dir, ctx.dirbuf,
+        [&]( const char* entry, size_t len, kjp::dirent_kind kind ) {
+            if ( kind == kjp::dirent_kind::directory ) {
+                submit_directory( prefix + entry, prefix.size(), share, ctx.tid );
+            } else if ( wanted( entry, len ) ) {
+                submit( task::file, prefix + entry, ctx.tid );
+            }
+        } );
+    if ( !ok ) {
+        ostringstream os;
+        os << "[" << ctx.tid << "] Cannot read directory: " << name << ": " << strerror(errno) << endl;
+        cerr << os.str();
+    }
+}
+
+// The original tokenizer, kept around so its output can be compared against the scanner
+void indexer_state::regex_process_range( worker_context& ctx, const char* begin, const char* end ) {
+    static const regex re_word( "[[:alnum:]]+" );
+    static const cregex_iterator re_end;
+
+    cregex_iterator rit( begin, end, re_word );
+    while( rit != re_end ) {
+        string word(std::move(rit->str()));
+        transform( word.begin(), word.end(), word.begin(), ::tolower );
+        if ( ctx.tok.keeps( word.data(), word.size() ) ) ctx.count( word.data(), word.size() );
+        // debug && cout << "Got word: " << word << endl;
+        ++rit;
+    }
+}
+
+// Tokenize a range of bytes with whichever engine was selected
+void indexer_state::process_range( worker_context& ctx, const char* begin, const char* end ) {
+    uint64_t start = kjp::stats::enabled ? kjp::stats::now_ns() : 0;
+    ctx.nbytes += end - begin;
+    if ( opts.engine == tokenizer_engine::regex ) {
+        regex_process_range( ctx, begin, end );
+    } else {
+        auto emit = [&ctx]( const char* p, size_t len ) { ctx.count( p, len ); };
+        ctx.tok.scan( begin, end - begin, emit );
+        ctx.tok.finish( emit );
+    }
+    if ( kjp::stats::enabled ) kjp::stats::mine().scan_ns += kjp::stats::now_ns() - start;
+}
+
+// Queue name up as chunks if it is big enough to be worth splitting
+bool indexer_state::split_file( worker_context& ctx, const string& name, size_t size ) {
+    if ( opts.chunksize == 0 || size <= opts.chunksize ) return false;
+
+    debug && cout << "[" << ctx.tid << "] Splitting " << name << " (" << size << " bytes)" << endl;
+    for( size_t off=0; off<size; off+=opts.chunksize ) {
+        submit_chunk( name, off, min( opts.chunksize, size - off ), ctx.tid );
+    }
+    return true;
+}
+
+// Count the words that start inside the chunk: a word running into the chunk from
+// the one before belongs to that one, and a word running out of it is finished here.
+void indexer_state::worker_process_chunk( worker_context& ctx, const task& t ) {
+    kjp::file_view fv;
+    if ( !fv.open( t.path.c_str(), ctx.buf ) ) {
+        report_open_error( ctx, t.path, errno );
+        return;
+    }
+    const char* data = fv.data();
+    const char* limit = data + fv.size();
+    if ( t.offset >= fv.size() ) return;    // File shrank since it was split
+
+    const char* begin = data + t.offset;
+    const char* end = data + min( t.offset + t.length, fv.size() );
+    if ( begin > data ) {
+        while( begin < end && kjp::is_word_byte( begin[-1] ) && kjp::is_word_byte( *begin ) ) ++begin;
+    }
+    if ( begin < end && kjp::is_word_byte( end[-1] ) ) {
+        while( end < limit && kjp::is_word_byte( *end ) ) ++end;
+    }
+    debug && cout << "[" << ctx.tid << "] Chunk " << t.path << " [" << ( begin - data )
+                  << ", " << ( end - data ) << ")" << endl;
+    process_range( ctx, begin, end );
+    ctx.finish( t.path );
+    if ( kjp::stats::enabled ) kjp::stats::mine().chunks++;
+}
+
+// A whole file, read by the prefetcher
+void indexer_state::worker_process_buffer( worker_context& ctx, const task& t ) {
+    debug && cout << "[" << ctx.tid << "] Read " << t.length << " bytes (prefetched)" << endl;
+    process_range( ctx, t.buf->data.data(), t.buf->data.data() + t.length );
+    reader->release( t.buf );
+    ctx.finish( t.path );
+    if ( kjp::stats::enabled ) kjp::stats::mine().files++;
+}
+
+// Takes the text of (a frame of) a compressed file as it is decompressed, and cuts it
+// between words: each piece is counted here, or with handoff set queued for another
+// worker while there are no more blocks waiting than workers.  With keep_ends set the
+// partial words at either end aren't counted but kept in head and tail.
+struct text_splitter {
+    worker_context& ctx;
+    shared_ptr<compressed_file> cf;
+    bool handoff;
+    bool keep_ends;
+    bool started;
+    bool whole;         // Nothing but a word, all in head
+    string head, tail;
+
+    text_splitter( worker_context& c, const shared_ptr<compressed_file>& f, bool h, bool k ) :
+        ctx(c), cf(f), handoff(h), keep_ends(k), started(false), whole(false) {}
+
+    void operator()( vector<char>& out, bool last ) {
+        size_t cut = out.size();
+        if ( !last || keep_ends ) {
+            while( cut > 0 && kjp::is_word_byte( out[cut-1] ) ) --cut;
+        }
+        size_t begin = 0;
+        if ( keep_ends && !started ) {
+            if ( cut == 0 ) {
+                // No word has ended yet
+                if ( last ) {
+                    head.assign( out.data(), out.size() );
+                    whole = true;
+                    out.clear();
+                }
+                return;
+            }
+            while( kjp::is_word_byte( out[begin] ) ) ++begin;
+            head.assign( out.data(), begin );
+            started = true;
+        }
+        if ( last && keep_ends ) tail.assign( out.data() + cut, out.size() - cut );
+        if ( cut == begin ) {
+            if ( last ) out.clear();
+            return;
+        }
+
+        if ( handoff && cf->blocks.load() < ctx.ix.pool->size() ) {
+            cf->blocks++;
+            vector<char> rest( out.begin() + cut, out.end() );
+            out.resize( cut );
+            task* t = new task( task::text, cf->path, begin, cut - begin );
+            t->cf = cf;
+            t->data.swap( out );
+            out.swap( rest );
+            ctx.ix.pool->submit( t, ctx.tid - 1 );
+        } else {
+            ctx.ix.process_range( ctx, out.data() + begin, out.data() + cut );
+            out.erase( out.begin(), out.begin() + cut );
+        }
+        if ( last ) out.clear();
+    }
+};
+
+void indexer_state::report_decompress_error( worker_context& ctx, const string& name, const string& err ) {
+    ostringstream os;
+    os << "[" << ctx.tid << "] Cannot decompress: " << name << ": " << err << endl;
+    cout << os.str();
+}
+
+// who is the worker's number, or the stage the path failed in
+void indexer_state::report_open_error( const string& who, const string& path, int err ) {
+    ostringstream os;
+    os << "[" << who << "] Cannot open: " << path << ": " << strerror( err ) << endl;
+    cout << os.str();
+}
+
+void indexer_state::report_open_error( worker_context& ctx, const string& path, int err ) {
+    report_open_error( to_string( ctx.tid ), path, err );
+}
+
+// A compressed file is decompressed here, with what comes out counted as it comes,
+// by this worker and (with --chunk) any others that are free.  A zstd file in several
+// frames is split up by frame instead, for the frames to be decompressed in parallel.
+void indexer_state::worker_process_compressed( worker_context& ctx, const string& name, kjp::compression comp ) {
+    auto cf = make_shared<compressed_file>( name );
+    if ( !cf->fv.open( name.c_str(), cf->buf ) ) {
+        report_open_error( ctx, name, errno );
+        return;
+    }
+    string err;
+    if ( comp == kjp::compression::zstd && opts.chunksize > 0 ) {
+        if ( !kjp::zstd_frames( cf->fv.data(), cf->fv.size(), cf->frames, err ) ) {
+            report_decompress_error( ctx, name, err );
+            return;
+        }
+        size_t n = cf->frames.size();
+        if ( n > 1 ) {
+            debug && cout << "[" << ctx.tid << "] Splitting " << name << " (" << n << " frames)" << endl;
+            cf->heads.resize( n );
+            cf->tails.resize( n );
+            cf->whole.resize( n );
+            cf->frames_left = n;
+            for( size_t i=0; i<n; ++i ) {
+                task* t = new task( task::frame, name, i );
+                t->cf = cf;
+                pool->submit( t, ctx.tid - 1 );
+            }
+            return;
+        }
+    }
+
+    debug && cout << "[" << ctx.tid << "] Decompressing " << name << " (" << kjp::compression_name( comp )
+                  << ", " << cf->fv.size() << " bytes)" << endl;
+    text_splitter split( ctx, cf, opts.chunksize > 0, false );
+    if ( !kjp::decompress( comp, cf->fv.data(), cf->fv.size(), opts.chunksize > 0 ? min( opts.chunksize, TEXT_BLOCK ) : TEXT_BLOCK,
+                           std::ref( split ), err ) ) {
+        report_decompress_error( ctx, name, err );
+    }
+    ctx.finish( name );
+    if ( kjp::stats::enabled ) kjp::stats::mine().files++;
+}
+
+// A block of decompressed text
+void indexer_state::worker_process_text( worker_context& ctx, const task& t ) {
+    debug && cout << "[" << ctx.tid << "] Block of " << t.path << " (" << t.length << " bytes)" << endl;
+    process_range( ctx, t.data.data() + t.offset, t.data.data() + t.offset + t.length );
+    t.cf->blocks--;
+    ctx.finish( t.path );
+    if ( kjp::stats::enabled ) kjp::stats::mine().chunks++;
+}
+
+// One frame of a zstd file.  Whoever finishes the last frame counts the words that
+// run from one frame into the next.
+void indexer_state::worker_process_frame( worker_context& ctx, const task& t ) {
+    compressed_file& cf = *t.cf;
+    size_t i = t.offset;
+    debug && cout << "[" << ctx.tid << "] Frame " << i << " of " << t.path << endl;
+    text_splitter split( ctx, t.cf, false, true );
+    string err;
+    if ( kjp::decompress( kjp::compression::zstd, cf.fv.data() + cf.frames[i].first, cf.frames[i].second,
+                          min( opts.chunksize, TEXT_BLOCK ), std::ref( split ), err ) ) {
+        cf.heads[i].swap( split.head );
+        cf.tails[i].swap( split.tail );
+        cf.whole[i] = split.whole;
+    } else {
+        report_decompress_error( ctx, t.path, err );
+    }
+
+    if ( cf.frames_left.fetch_sub( 1 ) == 1 ) {
+        string word;
+        for( size_t f=0; f<cf.frames.size(); ++f ) {
+            word += cf.heads[f];
+            if ( cf.whole[f] ) continue;
+            process_range( ctx, word.data(), word.data() + word.size() );
+            word.swap( cf.tails[f] );
+        }
+        process_range( ctx, word.data(), word.data() + word.size() );
+        if ( kjp::stats::enabled ) kjp::stats::mine().files++;
+    }
+    ctx.finish( t.path );
+    if ( kjp::stats::enabled ) kjp::stats::mine().chunks++;
+}
+
+// Take a file's counts from the last run back out of the table
+void indexer_state::subtract_indexed( size_t file ) {
+    oldindex->for_each_count( file, [this]( uint32_t w, uint32_t c ) {
+        hc->insert_n( string_view( oldindex->word( w ), oldindex->word_len( w ) ), -int( c ) );
+    } );
+}
+
+// Returns false if name hasn't changed since the last run, so its counts are already in
+bool indexer_state::index_prepare( worker_context& ctx, const string& name, const struct stat& st ) {
+    kjp::file_stamp stamp = kjp::file_stamp::of( st );
+    long old = oldindex ? oldindex->find_file( name ) : -1;
+    if ( old >= 0 ) {
+        indexseen[old] = true;
+        if ( oldindex->stamp( old ) == stamp ) {
+            debug && cout << "[" << ctx.tid << "] Unchanged: " << name << endl;
+            newindex->carry( name, old );
+            return false;
+        }
+        debug && cout << "[" << ctx.tid << "] Changed: " << name << endl;
+        subtract_indexed( old );
+    }
+    newindex->set_file( name, stamp );
+    return true;
+}
+
+void indexer_state::worker_process_file( worker_context& ctx, const string& name ) {
+    if ( !opts.share.owns( name.data(), name.size() ) ) return;     // Another node's
+
+    kjp::compression comp = kjp::compression_of( name.data(), name.size() );
+    bool splittable = opts.chunksize > 0 && opts.io == io_mode::stream && comp == kjp::compression::none;
+    if ( newindex || splittable ) {
+        struct stat st;
+        if ( stat( name.c_str(), &st ) < 0 ) {
+            report_open_error( ctx, name, errno );
+            return;
+        }
+        if ( newindex && !index_prepare( ctx, name, st ) ) return;
+        if ( splittable && split_file( ctx, name, st.st_size ) ) return;
+    }
+
+    if ( comp != kjp::compression::none ) {
+        // Mapped whatever the I/O mode: it's the decompression these are waiting on
+        worker_process_compressed( ctx, name, comp );
+        return;
+    }
+
+    if ( opts.io == io_mode::uring ) {
+        // The reader stage takes it from here, and will submit what it finds
+        pool->hold();
+        reader->read( name );
+        return;
+    }
+
+    if ( opts.io == io_mode::mmap ) {
+        // The whole file in one go, no line splitting required
+        kjp::file_view fv;
+        if ( !fv.open( name.c_str(), ctx.buf ) ) {
+            report_open_error( ctx, name, errno );
+            return;
+        }
+        if ( split_file( ctx, name, fv.size() ) ) return;
+        debug && cout << "[" << ctx.tid << "] Read " << fv.size() << " bytes"
+                      << ( fv.is_mapped() ? " (mapped)" : "" ) << endl;
+        process_range( ctx, fv.data(), fv.data() + fv.size() );
+        ctx.finish( name );
+        if ( kjp::stats::enabled ) kjp::stats::mine().files++;
+        return;
+    }
+
+    ifstream infile( name );
+    if ( !infile.good() ) {
+        report_open_error( ctx, name, errno );
+        return;
+    }
+
+    string line;
+    while( getline( infile, line ) ) {
+        debug && cout << "[" << ctx.tid << "] Got line: " << line << endl;
+        process_range( ctx, line.data(), line.data() + line.size() );
+    }
+    ctx.finish( name );
+    if ( kjp::stats::enabled ) kjp::stats::mine().files++;
+}
+
+}
+}
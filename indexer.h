@@ -0,0 +1,102 @@
+//
+// ssfi as a library
+// An indexer owns everything a run needs, the worker threads, their buffers, the
+// table and (for --io=uring) the reader stage, and keeps it from one index() call to
+// the next, so that counting a small tree costs no thread startup.  The command line
+// tool is a wrapper around one:
+//
+//     kjp::indexer_options o;
+//     o.nthreads = 8;
+//     kjp::indexer ix( o );
+//     ix.index( { "docs" } );
+//     for( auto& w : ix.top( 10 ) ) std::cout << w.first << " : " << w.second << "\n";
+//     ix.reset();                 // and again, with the same threads
+//
+// Files that can't be read are reported on stdout and skipped, as with the tool.
+// An indexer is not itself thread-safe: one call at a time.
+//
+#ifndef __INDEXER_H__
+#define __INDEXER_H__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility> // For std::pair
+#include <vector>
+
+#include "distributed.h"    // For partition
+#include "fileio.h"         // For io_mode
+#include "stopwords.h"      // For word_filter
+#include "tokenizer.h"      // For tokenizer_engine
+#include "walker.h"         // For extension_filter
+#include "wordcounter.h"
+
+namespace kjp {
+
+    // The command line's options, less the ones about what to do with the counts
+    struct indexer_options {
+        int nthreads = 1;
+        tokenizer_engine engine = tokenizer_engine::automatic;
+        bool utf8 = false;              // Unicode words, case folded, rather than ASCII ones
+        io_mode io = io_mode::stream;
+        bool preaggregate = true;       // Count words per thread before merging them
+        long aggbatch = 0;              // Merge every aggbatch words; 0 means once per file
+        bool incremental = true;        // Incremental resizing in stripedhashcounter
+        bool flat = false;              // flathashcounter rather than stripedhashcounter
+        bool serialwalk = false;        // Walk the tree with nftw on the calling thread
+        bool numa = false;              // Pin the workers, and keep a table shard per node
+        size_t approx = 0;              // Counters per thread for approximate counts; 0 for exact
+        size_t memlimit = 0;            // Spill the table to disk past this many bytes; 0 for no limit
+        std::string spilldir;           // Where to; $TMPDIR or /tmp if empty
+        size_t chunksize = 32 << 20;    // Split files larger than this into pieces; 0 means never
+        size_t inflight = 64;           // Opens and reads outstanding with io_mode::uring
+        extension_filter ext;           // .txt if empty
+        word_filter words;              // Words not to count, such as stopwords
+        partition share;                // Only count the files this node owns
+        std::string indexfile;          // Keep per-file counts here, if set
+        unsigned ngram = 1;             // Count runs of this many words; past 1, files aren't
+                                        // split, and approx, memlimit and indexfile don't apply
+    };
+
+    namespace detail { struct indexer_state; }
+
+    class indexer {
+        std::unique_ptr<detail::indexer_state> st;
+
+    public:
+        typedef wordcounter::element element;
+
+        // Starts the workers
+        explicit indexer( const indexer_options& opts );
+        ~indexer();
+        indexer( const indexer& ) = delete;
+        indexer& operator=( const indexer& ) = delete;
+
+        // The options in effect: the tokenizer engine resolved, and so on
+        const indexer_options& options() const;
+
+        // Count every matching file under paths (files or directories), on top of
+        // whatever has been counted since the last reset().  With an index file, each
+        // call is a complete run: it starts from the index, and writes it back.
+        // Returns false with errno set if the index couldn't be written.
+        bool index( const std::vector<std::string>& paths );
+
+        // The count most frequent words (or n-grams, their words separated by spaces)
+        // so far, all of them if count is 0, most frequent first, ties in alphabetical order
+        std::vector<element> top( int count );
+
+        // Forget every count, keeping the threads and their buffers
+        void reset();
+
+        // For reporting: what the table's resizes cost, what has been spilled to disk
+        // with a memory limit, and with approximate counts how many words were seen and
+        // how far any count may be too high
+        wordcounter::resize_stats resize_stats() const;
+        size_t spilled_runs() const;
+        size_t spilled_bytes() const;
+        long approx_words() const;
+        long approx_error() const;
+    };
+}
+
+#endif
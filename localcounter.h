@@ -0,0 +1,97 @@
+//
+// A single-threaded word counter for pre-aggregation
+// Each worker counts words here and periodically merges the totals into the shared
+// table with one insert_n() per distinct word, instead of one insert() per occurrence.
+// Flat open addressing with linear probing; slots (and their string buffers) are
+// recycled after each flush so steady-state counting does not allocate.
+//
+#ifndef __LOCALCOUNTER_H__
+#define __LOCALCOUNTER_H__
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace kjp {
+
+    class localcounter {
+        struct slot {
+            std::string key;
+            size_t hash;
+            int count;          // 0 means the slot is free
+
+            slot() : hash(0), count(0) {}
+        };
+
+        std::vector<slot> table;
+        std::vector<size_t> occupied;       // Indices of in-use slots, for flush()
+        size_t mask;
+
+        static size_t hash_of( const char* p, size_t len ) {
+            return hash_bytes( p, len, 0x9e3779b97f4a7c15ULL );
+        }
+
+        void grow() {
+            std::vector<slot> old;
+            old.swap( table );
+            table.resize( old.size() * 2 );
+            mask = table.size() - 1;
+            occupied.clear();
+            for( auto& it : old ) {
+                if ( it.count == 0 ) continue;
+                size_t i = it.hash & mask;
+                while( table[i].count != 0 ) i = ( i + 1 ) & mask;
+                table[i].key.swap( it.key );
+                table[i].hash = it.hash;
+                table[i].count = it.count;
+                occupied.push_back( i );
+            }
+        }
+
+    public:
+        explicit localcounter( size_t size=1024 ) {
+            size_t sz = 16;
+            while( sz < size ) sz *= 2;
+            table.resize( sz );
+            mask = sz - 1;
+        }
+
+        // Count one occurrence of the len bytes at p
+        void add( const char* p, size_t len ) {
+            size_t h = hash_of( p, len );
+            size_t i = h & mask;
+            while( table[i].count != 0 ) {
+                slot& s = table[i];
+                if ( s.hash == h && s.key.size() == len && memcmp( s.key.data(), p, len ) == 0 ) {
+                    ++s.count;
+                    return;
+                }
+                i = ( i + 1 ) & mask;
+            }
+            table[i].key.assign( p, len );
+            table[i].hash = h;
+            table[i].count = 1;
+            occupied.push_back( i );
+
+            // Keep the load factor at or below 1/2
+            if ( occupied.size() * 2 > table.size() ) grow();
+        }
+
+        size_t distinct() const { return occupied.size(); }
+
+        // Hand every (word, count) pair to sink and empty the counter
+        template <typename F>
+        void flush( F sink ) {
+            for( auto i : occupied ) {
+                sink( table[i].key, table[i].count );
+                table[i].count = 0;
+            }
+            occupied.clear();
+        }
+    };
+}
+
+#endif
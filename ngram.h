@@ -0,0 +1,207 @@
+//
+// Counting n-grams: runs of n consecutive words
+// Each word is hashed once as it comes out of the tokenizer, and an n-gram is known by
+// a rolling polynomial over the hashes of its words, so moving the window along one
+// word costs a multiply and a subtract whatever n is.  The tables key on that 64-bit
+// hash alone: the words are only looked at when an n-gram is new to a table, to copy
+// them (joined by spaces) into its arena as the n-gram's text for output.  Two
+// n-grams are counted as one if their hashes agree, which at 64 bits isn't expected
+// before some billions of distinct n-grams.
+//
+// Every n-gram lies within a file; the window starts afresh with each one.
+//
+#ifndef __NGRAM_H__
+#define __NGRAM_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "hash.h"
+#include "stripedhash.h"
+
+namespace kjp {
+
+    // An n-gram as a table stores it
+    struct ngram {
+        uint64_t hash;
+        std::string_view text;      // Its words, separated by spaces
+    };
+
+    // An n-gram to look up: its words are n views, in order, only joined if it's new
+    struct ngram_ref {
+        uint64_t hash;
+        const std::string_view* words;
+        unsigned n;
+    };
+
+    inline bool operator==( const ngram& a, const ngram_ref& b ) { return a.hash == b.hash; }
+    // For the tie break in top-K
+    inline bool operator<( const ngram& a, const ngram& b ) { return a.text < b.text; }
+
+    inline std::ostream& operator<<( std::ostream& os, const ngram& g ) { return os << g.text; }
+    inline std::ostream& operator<<( std::ostream& os, const ngram_ref& g ) {
+        for( unsigned i=0; i<g.n; ++i ) os << ( i ? " " : "" ) << g.words[i];
+        return os;
+    }
+
+    template <>
+    struct key_storage<ngram> {
+        typedef ngram stored;
+        typedef const ngram_ref& lookup;
+
+        static ngram store( arena& a, const ngram_ref& key ) {
+            size_t len = key.n - 1;
+            for( unsigned i=0; i<key.n; ++i ) len += key.words[i].size();
+            char* p = static_cast<char*>( a.allocate( len, 1 ) );
+            char* q = p;
+            for( unsigned i=0; i<key.n; ++i ) {
+                if ( i ) *q++ = ' ';
+                memcpy( q, key.words[i].data(), key.words[i].size() );
+                q += key.words[i].size();
+            }
+            return ngram{ key.hash, std::string_view( p, len ) };
+        }
+    };
+
+    // The hash is already well mixed; the seed keeps the tables' layouts apart
+    template <>
+    struct hash<ngram> {
+        uint64_t operator()( const ngram_ref& g, uint64_t seed ) const { return hash_u64( g.hash, seed ); }
+        uint64_t operator()( const ngram& g, uint64_t seed ) const { return hash_u64( g.hash, seed ); }
+    };
+
+    typedef stripedhashcounter<ngram> ngramcounter;
+
+    // The last n words of a file
+    class ngram_window {
+        static constexpr uint64_t WORD_SEED = 0x2545f4914f6cdd1dULL;
+        static constexpr uint64_t BASE = 0x100000001b3ULL;     // Odd, so multiplying by it loses nothing
+
+        unsigned n;
+        std::vector<std::string> words;         // A ring; the next word goes in words[next]
+        std::vector<std::string_view> views;    // Word i at i and i+n, so the last n are in a row
+        std::vector<uint64_t> hashes;
+        unsigned next;
+        unsigned seen;                          // Words since clear(), up to n
+        uint64_t rolling;                       // Sum of the last n hashes times BASE^age
+        uint64_t outgoing;                      // BASE^n
+
+    public:
+        explicit ngram_window( unsigned len ) :
+            n( len ), words( len ), views( 2 * len ), hashes( len ), next(0), seen(0), rolling(0), outgoing(1) {
+            for( unsigned i=0; i<n; ++i ) outgoing *= BASE;
+        }
+
+        void clear() {
+            seen = 0;
+            rolling = 0;
+        }
+
+        // Add the next word.  Once there have been n, returns true with key set to the
+        // n-gram ending in it, which is good until the next call.
+        bool push( const char* p, size_t len, ngram_ref& key ) {
+            uint64_t h = hash_bytes( p, len, WORD_SEED );
+            rolling = rolling * BASE + h;
+            if ( seen == n ) {
+                rolling -= hashes[next] * outgoing;
+            } else {
+                ++seen;
+            }
+            hashes[next] = h;
+            words[next].assign( p, len );
+            views[next] = views[next + n] = words[next];
+            next = next + 1 == n ? 0 : next + 1;
+            if ( seen < n ) return false;
+
+            key.hash = hash_u64( rolling, n );
+            key.words = &views[next];           // The oldest word is the one to go next
+            key.n = n;
+            return true;
+        }
+    };
+
+    // localcounter for n-grams: single-threaded pre-aggregation before the shared
+    // table.  The text of each n-gram is kept once per flush, in one buffer.
+    class ngram_localcounter {
+        struct slot {
+            uint64_t hash;
+            size_t off, len;        // Of the text in text
+            int count;              // 0 means the slot is free
+        };
+
+        std::vector<slot> table;
+        std::vector<size_t> occupied;
+        std::vector<char> text;
+        size_t mask;
+
+        void grow() {
+            std::vector<slot> old( table.size() * 2, slot{ 0, 0, 0, 0 } );
+            old.swap( table );
+            mask = table.size() - 1;
+            occupied.clear();
+            for( const slot& s : old ) {
+                if ( s.count == 0 ) continue;
+                size_t i = s.hash & mask;
+                while( table[i].count != 0 ) i = ( i + 1 ) & mask;
+                table[i] = s;
+                occupied.push_back( i );
+            }
+        }
+
+    public:
+        explicit ngram_localcounter( size_t size=1024 ) {
+            size_t sz = 16;
+            while( sz < size ) sz *= 2;
+            table.assign( sz, slot{ 0, 0, 0, 0 } );
+            mask = sz - 1;
+        }
+
+        void add( const ngram_ref& key ) {
+            size_t i = key.hash & mask;
+            while( table[i].count != 0 ) {
+                if ( table[i].hash == key.hash ) {
+                    ++table[i].count;
+                    return;
+                }
+                i = ( i + 1 ) & mask;
+            }
+            slot& s = table[i];
+            s.hash = key.hash;
+            s.off = text.size();
+            for( unsigned w=0; w<key.n; ++w ) {
+                if ( w ) text.push_back( ' ' );
+                text.insert( text.end(), key.words[w].begin(), key.words[w].end() );
+            }
+            s.len = text.size() - s.off;
+            s.count = 1;
+            occupied.push_back( i );
+
+            // Keep the load factor at or below 1/2
+            if ( occupied.size() * 2 > table.size() ) grow();
+        }
+
+        size_t distinct() const { return occupied.size(); }
+
+        // Call f( key, count ) for every n-gram counted since the last flush, with the
+        // text as key's only "word", and start over
+        template <typename F>
+        void flush( F f ) {
+            for( size_t i : occupied ) {
+                slot& s = table[i];
+                std::string_view t( text.data() + s.off, s.len );
+                f( ngram_ref{ s.hash, &t, 1 }, s.count );
+                s.count = 0;
+            }
+            occupied.clear();
+            text.clear();
+        }
+    };
+}
+
+#endif
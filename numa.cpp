@@ -0,0 +1,155 @@
+//
+// NUMA topology and thread pinning
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
+#include "numa.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace kjp {
+
+namespace {
+    const char NODE_DIR[] = "/sys/devices/system/node";
+
+    // From <numaif.h>, which comes with libnuma rather than the C library
+    constexpr int MPOL_BIND_POLICY = 2;
+    constexpr unsigned MPOL_MF_MOVE_PAGES = 1 << 1;
+
+    // Compress a sorted CPU list back into "0-3,8" form
+    std::string format_cpulist( const std::vector<int>& cpus ) {
+        std::ostringstream os;
+        for( size_t i=0; i<cpus.size(); ) {
+            size_t j = i;
+            while( j + 1 < cpus.size() && cpus[j+1] == cpus[j] + 1 ) ++j;
+            os << ( i ? "," : "" ) << cpus[i];
+            if ( j > i ) os << "-" << cpus[j];
+            i = j + 1;
+        }
+        return os.str();
+    }
+}
+
+bool parse_cpulist( const std::string& s, std::vector<int>& out ) {
+    out.clear();
+    const char* p = s.c_str();
+    while( *p && *p != '\n' ) {
+        char* end;
+        long lo = strtol( p, &end, 10 ), hi = lo;
+        if ( end == p || lo < 0 ) return false;
+        p = end;
+        if ( *p == '-' ) {
+            hi = strtol( p + 1, &end, 10 );
+            if ( end == p + 1 || hi < lo ) return false;
+            p = end;
+        }
+        for( long c=lo; c<=hi; ++c ) out.push_back( int( c ) );
+        if ( *p == ',' ) ++p;
+        else if ( *p && *p != '\n' ) return false;
+    }
+    std::sort( out.begin(), out.end() );
+    out.erase( std::unique( out.begin(), out.end() ), out.end() );
+    return true;
+}
+
+numa_topology numa_topology::detect() {
+    numa_topology t;
+
+    cpu_set_t allowed;
+    CPU_ZERO( &allowed );
+    bool masked = sched_getaffinity( 0, sizeof(allowed), &allowed ) == 0;
+
+    std::vector<int> node_ids;
+    if ( DIR* d = opendir( NODE_DIR ) ) {
+        while( struct dirent* e = readdir( d ) ) {
+            char* end;
+            if ( strncmp( e->d_name, "node", 4 ) != 0 ) continue;
+            long n = strtol( e->d_name + 4, &end, 10 );
+            if ( end != e->d_name + 4 && *end == '\0' ) node_ids.push_back( int( n ) );
+        }
+        closedir( d );
+    }
+    std::sort( node_ids.begin(), node_ids.end() );
+
+    for( int n : node_ids ) {
+        std::ifstream in( std::string( NODE_DIR ) + "/node" + std::to_string( n ) + "/cpulist" );
+        std::string line;
+        std::vector<int> cpus, usable;
+        if ( !std::getline( in, line ) || !parse_cpulist( line, cpus ) ) continue;
+        for( int c : cpus ) {
+            if ( !masked || ( c < CPU_SETSIZE && CPU_ISSET( c, &allowed ) ) ) usable.push_back( c );
+        }
+        if ( usable.empty() ) continue;
+        t.ids.push_back( n );
+        t.cpus.push_back( usable );
+    }
+
+    if ( t.cpus.empty() ) {
+        // No sysfs: one node with whatever we may run on
+        std::vector<int> all;
+        for( int c=0; c<CPU_SETSIZE; ++c ) {
+            if ( masked && CPU_ISSET( c, &allowed ) ) all.push_back( c );
+        }
+        if ( all.empty() ) all.push_back( 0 );
+        t.ids.push_back( 0 );
+        t.cpus.push_back( all );
+    }
+    return t;
+}
+
+std::string numa_topology::to_string() const {
+    std::ostringstream os;
+    for( size_t i=0; i<cpus.size(); ++i ) {
+        os << ( i ? "; " : "" ) << "node" << ids[i] << ": " << format_cpulist( cpus[i] );
+    }
+    return os.str();
+}
+
+bool pin_thread( const std::vector<int>& cpus ) {
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for( int c : cpus ) {
+        if ( c >= 0 && c < CPU_SETSIZE ) CPU_SET( c, &set );
+    }
+    int err = pthread_setaffinity_np( pthread_self(), sizeof(set), &set );
+    if ( err != 0 ) {
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+bool bind_memory( void* p, size_t len, int node ) {
+    if ( node < 0 ) {
+        errno = EINVAL;
+        return false;
+    }
+    uintptr_t page = sysconf( _SC_PAGESIZE );
+    uintptr_t lo = ( reinterpret_cast<uintptr_t>( p ) + page - 1 ) & ~( page - 1 );
+    uintptr_t hi = ( reinterpret_cast<uintptr_t>( p ) + len ) & ~( page - 1 );
+    if ( hi <= lo ) return true;        // Not a whole page; it stays wherever it is
+
+    constexpr size_t BITS = sizeof( unsigned long ) * CHAR_BIT;
+    std::vector<unsigned long> mask( node / BITS + 1 );
+    mask[node / BITS] |= 1UL << ( node % BITS );
+    // The kernel reads one bit fewer than maxnode
+    return syscall( SYS_mbind, lo, hi - lo, MPOL_BIND_POLICY, mask.data(), mask.size() * BITS + 1,
+                    MPOL_MF_MOVE_PAGES ) == 0;
+}
+}
@@ -0,0 +1,50 @@
+//
+// NUMA topology and thread pinning for --numa
+// The nodes and their CPUs come from sysfs, restricted to the CPUs we may run on.  A
+// machine (or container) without /sys/devices/system/node looks like a single node.
+//
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace kjp {
+
+    class numa_topology {
+        std::vector<int> ids;                   // sysfs node numbers
+        std::vector<std::vector<int>> cpus;     // The CPUs of each node, ascending
+
+    public:
+        // Nodes without any CPU we are allowed to use are left out
+        static numa_topology detect();
+
+        size_t nodes() const { return cpus.size(); }
+        int node_id( size_t node ) const { return ids[node]; }
+        const std::vector<int>& node_cpus( size_t node ) const { return cpus[node]; }
+
+        // Workers are dealt out to the nodes in turn, and to the CPUs of a node in order
+        size_t node_of_worker( int worker ) const { return worker % nodes(); }
+        int cpu_of_worker( int worker ) const {
+            const std::vector<int>& c = cpus[node_of_worker( worker )];
+            return c[( worker / nodes() ) % c.size()];
+        }
+
+        // e.g. "node0: 0-3,8-11; node1: 4-7,12-15"
+        std::string to_string() const;
+    };
+
+    // Parse a sysfs CPU list such as "0-3,8,10-11"; false if it is malformed
+    bool parse_cpulist( const std::string& s, std::vector<int>& out );
+
+    // Restrict the calling thread to cpus.  Returns false with errno set on failure.
+    bool pin_thread( const std::vector<int>& cpus );
+
+    // Keep the whole pages of [p, p+len) on node (a sysfs node number): those already
+    // touched are moved there, and the rest come from there when first touched,
+    // whichever thread touches them.  Returns false with errno set on failure.
+    bool bind_memory( void* p, size_t len, int node );
+}
+
+#endif
@@ -0,0 +1,353 @@
+//
+// Asynchronous file reading with io_uring, or with blocking reader threads
+//
+
+#include "prefetch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace kjp {
+
+// Just enough of an io_uring instance for one thread to drive: the mapped rings, a
+// local submission tail, and the two syscalls
+struct prefetcher::ring {
+    int fd;
+    unsigned entries;
+    void* sq_ptr;
+    size_t sq_len;
+    void* cq_ptr;
+    size_t cq_len;
+    io_uring_sqe* sqes;
+    size_t sqes_len;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes;
+    unsigned tail;              // Our copy of *sq_tail, published by enter()
+    unsigned to_submit;
+
+    ring() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(static_cast<io_uring_sqe*>( MAP_FAILED )),
+             to_submit(0) {}
+
+    ~ring() {
+        if ( sqes != MAP_FAILED ) munmap( sqes, sqes_len );
+        if ( cq_ptr != MAP_FAILED && cq_ptr != sq_ptr ) munmap( cq_ptr, cq_len );
+        if ( sq_ptr != MAP_FAILED ) munmap( sq_ptr, sq_len );
+        if ( fd >= 0 ) ::close( fd );
+    }
+
+    // Does the kernel have the operations we need (openat and read arrived in 5.6)?
+    bool supported() {
+        const unsigned nops = 64;
+        std::vector<char> mem( sizeof(io_uring_probe) + nops * sizeof(io_uring_probe_op), 0 );
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>( mem.data() );
+        if ( syscall( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, nops ) < 0 ) return false;
+        for( unsigned op : { IORING_OP_OPENAT, IORING_OP_READ } ) {
+            if ( op > probe->last_op || !( probe->ops[op].flags & IO_URING_OP_SUPPORTED ) ) return false;
+        }
+        return true;
+    }
+
+    bool setup( unsigned n ) {
+        io_uring_params p;
+        memset( &p, 0, sizeof(p) );
+        fd = syscall( __NR_io_uring_setup, n, &p );
+        if ( fd < 0 ) return false;
+        if ( !supported() ) {
+            errno = ENOSYS;
+            return false;
+        }
+
+        entries = p.sq_entries;
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if ( single ) sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+        sq_ptr = mmap( nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+        if ( sq_ptr == MAP_FAILED ) return false;
+        cq_ptr = single ? sq_ptr
+                        : mmap( nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+        if ( cq_ptr == MAP_FAILED ) return false;
+        sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>( mmap( nullptr, sqes_len, PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES ) );
+        if ( sqes == MAP_FAILED ) return false;
+
+        char* sq = static_cast<char*>( sq_ptr );
+        char* cq = static_cast<char*>( cq_ptr );
+        sq_head = reinterpret_cast<unsigned*>( sq + p.sq_off.head );
+        sq_tail = reinterpret_cast<unsigned*>( sq + p.sq_off.tail );
+        sq_mask = reinterpret_cast<unsigned*>( sq + p.sq_off.ring_mask );
+        sq_array = reinterpret_cast<unsigned*>( sq + p.sq_off.array );
+        cq_head = reinterpret_cast<unsigned*>( cq + p.cq_off.head );
+        cq_tail = reinterpret_cast<unsigned*>( cq + p.cq_off.tail );
+        cq_mask = reinterpret_cast<unsigned*>( cq + p.cq_off.ring_mask );
+        cqes = reinterpret_cast<io_uring_cqe*>( cq + p.cq_off.cqes );
+        tail = *sq_tail;
+        return true;
+    }
+
+    // A cleared submission entry, or nullptr if the queue is full
+    io_uring_sqe* next_sqe() {
+        unsigned head = __atomic_load_n( sq_head, __ATOMIC_ACQUIRE );
+        if ( tail - head >= entries ) return nullptr;
+        unsigned i = tail & *sq_mask;
+        sq_array[i] = i;
+        ++tail;
+        ++to_submit;
+        memset( &sqes[i], 0, sizeof(io_uring_sqe) );
+        return &sqes[i];
+    }
+
+    // Submit what has been queued, and wait for at least wait completions
+    int enter( unsigned wait ) {
+        __atomic_store_n( sq_tail, tail, __ATOMIC_RELEASE );
+        int r = syscall( __NR_io_uring_enter, fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0 );
+        if ( r >= 0 ) to_submit -= r;
+        return r;
+    }
+
+    bool pop( io_uring_cqe& out ) {
+        unsigned head = *cq_head;
+        if ( head == __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) ) return false;
+        out = cqes[head & *cq_mask];
+        __atomic_store_n( cq_head, head + 1, __ATOMIC_RELEASE );
+        return true;
+    }
+};
+
+prefetcher::prefetcher( size_t n, size_t nworkers, size_t large, ready_fn ready, large_fn lf, error_fn error ) :
+    inflight( n > 0 ? n : 1 ), large_threshold( std::min( large, MAX_BUFFER ) ), on_ready(ready), on_large(lf), on_error(error),
+    stopping(false) {
+    size_t nbuffers = inflight + BUFFERS_PER_WORKER * nworkers;
+    for( size_t i=0; i<nbuffers; ++i ) {
+        buffers.emplace_back( new buffer );
+        buffers.back()->len = 0;
+        free.push_back( buffers.back().get() );
+    }
+}
+
+prefetcher::~prefetcher() {
+    stop();
+}
+
+void prefetcher::start() {
+    std::unique_ptr<ring> r( new ring );
+    if ( r->setup( inflight ) ) {
+        uring = std::move( r );
+        threads.emplace_back( &prefetcher::uring_loop, this );
+        return;
+    }
+    for( size_t i=0; i<inflight; ++i ) {
+        threads.emplace_back( &prefetcher::blocking_loop, this );
+    }
+}
+
+const char* prefetcher::backend() const {
+    return uring ? "io_uring" : "threads";
+}
+
+void prefetcher::read( const std::string& path ) {
+    std::lock_guard<std::mutex> lg( mtx );
+    paths.push_back( path );
+    cv.notify_one();
+}
+
+void prefetcher::release( buffer* b ) {
+    std::lock_guard<std::mutex> lg( mtx );
+    free.push_back( b );
+    cv.notify_one();
+}
+
+void prefetcher::stop() {
+    {
+        std::lock_guard<std::mutex> lg( mtx );
+        stopping = true;
+        cv.notify_all();
+    }
+    for( auto& t : threads ) t.join();
+    threads.clear();
+}
+
+bool prefetcher::take( std::string& path, buffer*& buf, bool block ) {
+    std::unique_lock<std::mutex> lg( mtx );
+    while( true ) {
+        if ( !paths.empty() && !free.empty() ) {
+            path = std::move( paths.front() );
+            paths.pop_front();
+            buf = free.back();
+            free.pop_back();
+            return true;
+        }
+        if ( stopping || !block ) return false;
+        cv.wait( lg );
+    }
+}
+
+void prefetcher::uring_loop() {
+    struct op {
+        std::string path;
+        buffer* buf;
+        int fd;
+        size_t size, got;
+        bool reading;           // Otherwise opening
+    };
+    std::vector<op> ops( inflight );
+    std::vector<size_t> idle;
+    for( size_t i=0; i<inflight; ++i ) idle.push_back( inflight - 1 - i );
+
+    auto queue_read = [this]( op& o, size_t slot ) {
+        io_uring_sqe* sqe = uring->next_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = o.fd;
+        sqe->addr = reinterpret_cast<uint64_t>( o.buf->data.data() + o.got );
+        sqe->len = std::min( o.size - o.got, MAX_READ );       // The rest as short reads
+        sqe->off = o.got;
+        sqe->user_data = slot;
+    };
+    // Finished with slot one way or another
+    auto retire = [&]( op& o, size_t slot, int err ) {
+        if ( o.fd >= 0 ) ::close( o.fd );
+        if ( err ) {
+            release( o.buf );
+            on_error( o.path, err );
+        } else {
+            o.buf->path.swap( o.path );
+            o.buf->len = o.got;
+            on_ready( o.buf );
+        }
+        idle.push_back( slot );
+    };
+
+    while( true ) {
+        // Keep as many opens and reads going as we are allowed
+        while( !idle.empty() ) {
+            size_t slot = idle.back();
+            op& o = ops[slot];
+            if ( !take( o.path, o.buf, idle.size() == inflight ) ) {
+                if ( idle.size() == inflight ) return;      // Stopped
+                break;
+            }
+            idle.pop_back();
+            o.fd = -1;
+            o.size = o.got = 0;
+            o.reading = false;
+            io_uring_sqe* sqe = uring->next_sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>( o.path.c_str() );
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = slot;
+        }
+
+        if ( uring->enter( 1 ) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+            // The ring is unusable; fail whatever was accepted, and read the rest without it
+            int err = errno;
+            for( size_t slot=0; slot<inflight; ++slot ) {
+                if ( std::find( idle.begin(), idle.end(), slot ) == idle.end() ) retire( ops[slot], slot, err );
+            }
+            blocking_loop();
+            return;
+        }
+
+        io_uring_cqe cqe;
+        while( uring->pop( cqe ) ) {
+            size_t slot = cqe.user_data;
+            op& o = ops[slot];
+            if ( !o.reading ) {
+                if ( cqe.res < 0 ) {
+                    retire( o, slot, -cqe.res );
+                    continue;
+                }
+                o.fd = cqe.res;
+                struct stat st;
+                if ( fstat( o.fd, &st ) < 0 ) {
+                    retire( o, slot, errno );
+                    continue;
+                }
+                o.size = st.st_size;
+                if ( o.size >= large_threshold ) {
+                    ::close( o.fd );
+                    release( o.buf );
+                    on_large( o.path, o.size );
+                    idle.push_back( slot );
+                    continue;
+                }
+                if ( o.size == 0 ) {
+                    retire( o, slot, 0 );
+                    continue;
+                }
+                if ( o.buf->data.size() < o.size ) o.buf->data.resize( o.size );
+                o.reading = true;
+                queue_read( o, slot );
+                continue;
+            }
+
+            if ( cqe.res == -EINTR || cqe.res == -EAGAIN ) {
+                queue_read( o, slot );
+            } else if ( cqe.res < 0 ) {
+                retire( o, slot, -cqe.res );
+            } else if ( cqe.res > 0 && ( o.got += cqe.res ) < o.size ) {
+                queue_read( o, slot );              // Short read
+            } else {
+                retire( o, slot, 0 );               // Everything, or the file shrank
+            }
+        }
+    }
+}
+
+void prefetcher::blocking_loop() {
+    std::string path;
+    buffer* b;
+    while( take( path, b, true ) ) {
+        int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+        struct stat st;
+        if ( fd < 0 || fstat( fd, &st ) < 0 ) {
+            int err = errno;
+            if ( fd >= 0 ) ::close( fd );
+            release( b );
+            on_error( path, err );
+            continue;
+        }
+        size_t size = st.st_size;
+        if ( size >= large_threshold ) {
+            ::close( fd );
+            release( b );
+            on_large( path, size );
+            continue;
+        }
+
+        if ( b->data.size() < size ) b->data.resize( size );
+        size_t got = 0;
+        int err = 0;
+        while( got < size ) {
+            ssize_t r = pread( fd, b->data.data() + got, size - got, got );
+            if ( r < 0 && errno == EINTR ) continue;
+            if ( r < 0 ) err = errno;
+            if ( r <= 0 ) break;
+            got += r;
+        }
+        ::close( fd );
+        if ( err ) {
+            release( b );
+            on_error( path, err );
+            continue;
+        }
+        b->path.swap( path );
+        b->len = got;
+        on_ready( b );
+    }
+}
+
+}
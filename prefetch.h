@@ -0,0 +1,104 @@
+//
+// Asynchronous file reading for --io=uring
+// A reader stage between the walk and the workers: paths go in, whole files come out
+// in buffers.  Up to inflight opens and reads are outstanding at once, however many
+// workers there are to tokenize the results, so a slow disk or network filesystem can
+// be kept busy without a thread per outstanding read.
+//
+// The buffers are a fixed set, recycled as the workers finish with them.  When they
+// are all full and waiting for a worker no new reads are started, which bounds both
+// memory and how far the reader runs ahead.
+//
+// The reads go through io_uring (driven with raw syscalls, so there is no liburing
+// dependency) on one reader thread.  Where io_uring isn't available (old kernels,
+// seccomp) the same stage is run by inflight threads doing blocking reads instead.
+//
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace kjp {
+
+    class prefetcher {
+    public:
+        struct buffer {
+            std::string path;
+            std::vector<char> data;     // Capacity is kept from file to file
+            size_t len;                 // Bytes of data in use
+        };
+
+        // Called from the reader stage: a file is ready, a file is at least
+        // large_threshold (or MAX_BUFFER) bytes and wasn't read, or a file couldn't be
+        // read (errno style error code).  Every path passed to read() gets exactly one callback.
+        typedef std::function<void( buffer* )> ready_fn;
+        typedef std::function<void( const std::string&, size_t )> large_fn;
+        typedef std::function<void( const std::string&, int )> error_fn;
+
+    private:
+        #ifdef PREFETCH_BUFFERS_PER_WORKER
+        static constexpr size_t BUFFERS_PER_WORKER=PREFETCH_BUFFERS_PER_WORKER;
+        #else
+        static constexpr size_t BUFFERS_PER_WORKER=2;  // Filled buffers that may wait for each worker
+        #endif
+        #ifdef PREFETCH_MAX_BUFFER
+        static constexpr size_t MAX_BUFFER=PREFETCH_MAX_BUFFER;
+        #else
+        static constexpr size_t MAX_BUFFER=size_t( 1 ) << 30;  // Larger files are large whatever the threshold
+        #endif
+        static constexpr size_t MAX_READ=size_t( 1 ) << 30;    // Per read; an sqe's len is 32 bits
+
+        struct ring;
+
+        size_t inflight;
+        size_t large_threshold;
+        ready_fn on_ready;
+        large_fn on_large;
+        error_fn on_error;
+
+        std::vector<std::unique_ptr<buffer>> buffers;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::string> paths;      // Waiting to be opened
+        std::vector<buffer*> free;          // Buffers nobody is using
+        bool stopping;
+
+        std::unique_ptr<ring> uring;
+        std::vector<std::thread> threads;
+
+        // Wait for a path and a buffer to read it into; false once stopped
+        bool take( std::string& path, buffer*& buf, bool block );
+        void uring_loop();
+        void blocking_loop();
+
+    public:
+        // nworkers is the number of threads the buffers are meant for
+        prefetcher( size_t inflight, size_t nworkers, size_t large_threshold,
+                    ready_fn ready, large_fn large, error_fn error );
+        ~prefetcher();
+        prefetcher( const prefetcher& ) = delete;
+        prefetcher& operator=( const prefetcher& ) = delete;
+
+        // Start the io_uring reader, or the blocking threads if io_uring can't be set up
+        void start();
+        // "io_uring" or "threads"
+        const char* backend() const;
+
+        // Queue path to be read
+        void read( const std::string& path );
+        // Done with a buffer handed out through ready_fn
+        void release( buffer* b );
+        // Wait for the reader stage to exit.  Every read must have been called back.
+        void stop();
+    };
+}
+
+#endif
@@ -0,0 +1,54 @@
+//
+// Sorted runs of word counts: temporary run files
+//
+
+#include "runs.h"
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace kjp {
+
+run_file::~run_file() {
+    if ( map && len > 0 ) munmap( map, len );
+    if ( fd >= 0 ) ::close( fd );
+}
+
+bool run_file::create( const std::string& dir ) {
+    std::string name = dir + "/ssfi-run-XXXXXX";
+    fd = mkostemp( &name[0], O_CLOEXEC );
+    if ( fd < 0 ) return false;
+    unlink( name.c_str() );
+    return true;
+}
+
+bool run_file::append( const std::string& bytes ) {
+    const char* p = bytes.data();
+    size_t n = bytes.size();
+    while( n > 0 ) {
+        ssize_t r = ::write( fd, p, n );
+        if ( r < 0 ) {
+            if ( errno == EINTR ) continue;
+            return false;
+        }
+        p += r;
+        n -= r;
+        len += r;
+    }
+    return true;
+}
+
+bool run_file::map_contents() {
+    if ( map || len == 0 ) return true;
+    void* m = mmap( nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( m == MAP_FAILED ) return false;
+    madvise( m, len, MADV_SEQUENTIAL );
+    map = m;
+    return true;
+}
+
+}
@@ -0,0 +1,134 @@
+//
+// Sorted runs of word counts
+// A run is a sequence of (word, count) entries in word byte order, front coded: each
+// entry is the length of the prefix it shares with the one before, the rest of the
+// word, and the count, as LEB128 varints.  Words from the same table share a lot of
+// prefixes once sorted, so most entries take a few bytes more than their suffix.
+//
+// Runs are what the counting nodes send the coordinator (distributed.h) and what a
+// table over its memory budget is spilled to (spillcounter.h).  Either way they end
+// up merged, k at a time, in one pass that holds one entry per run.
+//
+#ifndef __RUNS_H__
+#define __RUNS_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "index.h"       // For the varints
+
+namespace kjp {
+
+    // Writes entries, which must come in word order, to out.  The caller may take out
+    // away at any point between entries.
+    struct run_writer {
+        std::string out;
+        std::string last;
+
+        void add( std::string_view w, uint64_t count ) {
+            size_t shared = 0;
+            size_t lim = std::min( w.size(), last.size() );
+            while( shared < lim && w[shared] == last[shared] ) ++shared;
+            detail::put_varint( out, shared );
+            detail::put_varint( out, w.size() - shared );
+            out.append( w.data() + shared, w.size() - shared );
+            detail::put_varint( out, count );
+            last.assign( w.data(), w.size() );
+        }
+    };
+
+    // Steps through a run; word and count are the current entry
+    struct run_reader {
+        const unsigned char* p;
+        const unsigned char* end;
+        std::string word;
+        uint64_t count;
+        bool bad;
+
+        run_reader( const char* data, size_t len ) :
+            p( reinterpret_cast<const unsigned char*>( data ) ), end( p + len ), count(0), bad(false) {}
+        explicit run_reader( const std::string& run ) : run_reader( run.data(), run.size() ) {}
+
+        // False at the end of the run, or with bad set if it is damaged
+        bool next() {
+            if ( p == end ) return false;
+            uint64_t shared, len;
+            if ( !detail::get_varint( p, end, shared ) || !detail::get_varint( p, end, len ) ||
+                 shared > word.size() || len > uint64_t( end - p ) ) {
+                bad = true;
+                return false;
+            }
+            word.resize( shared );
+            word.append( reinterpret_cast<const char*>( p ), len );
+            p += len;
+            if ( !detail::get_varint( p, end, count ) || count > INT32_MAX ) {
+                bad = true;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    // Merge runs, calling f( word, sum, n ) for each distinct word in order, where n is
+    // the number of runs it was in.  Returns false if any of them is damaged.
+    template <typename F>
+    bool merge_runs( std::vector<run_reader>& runs, F f ) {
+        auto later = [&runs]( size_t a, size_t b ) { return runs[a].word > runs[b].word; };
+        std::priority_queue<size_t, std::vector<size_t>, decltype( later )> heap( later );
+        auto advance = [&]( size_t i ) {
+            if ( runs[i].next() ) heap.push( i );
+            return !runs[i].bad;
+        };
+        for( size_t i=0; i<runs.size(); ++i ) {
+            if ( !advance( i ) ) return false;
+        }
+
+        std::string word;
+        while( !heap.empty() ) {
+            size_t i = heap.top();
+            heap.pop();
+            word = runs[i].word;
+            int64_t sum = runs[i].count;
+            uint32_t n = 1;
+            if ( !advance( i ) ) return false;
+            while( !heap.empty() && runs[heap.top()].word == word ) {
+                i = heap.top();
+                heap.pop();
+                sum += runs[i].count;
+                ++n;
+                if ( !advance( i ) ) return false;
+            }
+            f( word, sum, n );
+        }
+        return true;
+    }
+
+    // A run on disk, in a temporary file that is unlinked as soon as it is made, so it
+    // goes away with us however we exit.  Written with append(), then mapped to be read.
+    class run_file {
+        int fd;
+        size_t len;
+        void* map;
+
+    public:
+        run_file() : fd(-1), len(0), map(nullptr) {}
+        ~run_file();
+        run_file( const run_file& ) = delete;
+        run_file& operator=( const run_file& ) = delete;
+
+        // Create the file in dir.  These return false with errno set on failure.
+        bool create( const std::string& dir );
+        bool append( const std::string& bytes );
+        bool map_contents();
+
+        size_t size() const { return len; }
+        const char* data() const { return static_cast<const char*>( map ); }
+    };
+}
+
+#endif
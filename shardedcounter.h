@@ -0,0 +1,79 @@
+//
+// A word counter split into independent shards, one per NUMA node
+// Each word belongs to exactly one shard, picked by a hash of its own, so the shards
+// never have to agree on anything: a shard's table, locks and resizes are only ever
+// touched by the operations on its words, and the results are merged only when the
+// top words are extracted.  Whoever builds the shards decides where their memory
+// lives; see indexer_state::build_table() for --numa.
+//
+
+#ifndef __SHARDED_COUNTER_H__
+#define __SHARDED_COUNTER_H__
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <utility> // For std::pair
+#include <vector>
+
+#include "hash.h"
+#include "topk.h"
+#include "wordcounter.h"
+
+class shardedcounter : public wordcounter {
+    static constexpr uint64_t ROUTE_SEED = 0x51ed270b27f6a3c5ULL;
+
+    std::vector<std::unique_ptr<wordcounter>> shards;
+
+    wordcounter& shard_for( std::string_view key ) const {
+        uint64_t h = kjp::hash_bytes( key.data(), key.size(), ROUTE_SEED );
+        // Multiply-shift rather than modulo: the shard count needn't be a power of two
+        return *shards[( ( h >> 32 ) * shards.size() ) >> 32];
+    }
+
+public:
+    explicit shardedcounter( std::vector<std::unique_ptr<wordcounter>>&& s ) : shards( std::move( s ) ) {}
+
+    size_t nshards() const { return shards.size(); }
+
+    int insert_n( std::string_view key, int delta ) override { return shard_for( key ).insert_n( key, delta ); }
+    int contains( std::string_view key ) const override { return shard_for( key ).contains( key ); }
+
+    // Every shard is extracted in parallel; their words are disjoint, so merging the
+    // sorted runs is all that's left
+    std::vector<element> extract_top( int count, int nthreads ) override {
+        int per = std::max<int>( 1, nthreads / int( shards.size() ) );
+        std::vector<std::vector<element>> runs( shards.size() );
+        kjp::detail::run_parallel( shards.size(), [&]( int i ) {
+            runs[i] = shards[i]->extract_top( count, per );
+        } );
+
+        kjp::count_order<element> better;
+        std::vector<element> out = std::move( runs[0] );
+        for( size_t i=1; i<runs.size(); ++i ) {
+            std::vector<element> merged;
+            merged.reserve( out.size() + runs[i].size() );
+            std::merge( std::make_move_iterator( out.begin() ), std::make_move_iterator( out.end() ),
+                        std::make_move_iterator( runs[i].begin() ), std::make_move_iterator( runs[i].end() ),
+                        std::back_inserter( merged ), better );
+            if ( count > 0 && merged.size() > size_t( count ) ) merged.resize( count );
+            out.swap( merged );
+        }
+        return out;
+    }
+
+    resize_stats get_resize_stats() const override {
+        resize_stats rs{ 0, 0, 0, 0 };
+        for( const auto& s : shards ) {
+            resize_stats r = s->get_resize_stats();
+            rs.resizes += r.resizes;
+            rs.pauses += r.pauses;
+            rs.total_ns += r.total_ns;
+            rs.max_ns = std::max( rs.max_ns, r.max_ns );
+        }
+        return rs;
+    }
+};
+
+#endif
@@ -0,0 +1,238 @@
+//
+// An approximate word counter with a fixed memory budget
+// Each shard is a SpaceSaving summary (Metwally, Agrawal and El Abbadi, "Efficient
+// Computation of Frequent and Top-k Elements in Data Streams", ICDT 2005): at most
+// capacity counters, and a word that isn't tracked takes over the smallest one,
+// inheriting the evicted count as its possible overestimate.
+//
+// Every inserting thread sticks to one shard, so the shard locks are uncontended.
+// Queries merge the shards: a word missing from a shard may still have been seen there
+// up to that shard's minimum number of times, so that minimum stands in for its count.
+// Counts are never underestimated, and never overestimated by more than error_bound(),
+// which is at most (words inserted) / capacity.
+//
+
+#ifndef __SPACE_SAVING_H__
+#define __SPACE_SAVING_H__
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility> // For std::pair
+#include <vector>
+
+#include "topk.h"
+
+class spacesavingcounter {
+public:
+    typedef std::pair<std::string,int> element;
+
+    struct resize_stats {
+        long resizes;       // Always 0; the summaries never grow
+        long pauses;
+        long total_ns;
+        long max_ns;
+    };
+
+private:
+    #ifdef SPACESAVING_DEFAULT_CAPACITY
+    static constexpr size_t DEFAULT_CAPACITY=SPACESAVING_DEFAULT_CAPACITY;
+    #else
+    static constexpr size_t DEFAULT_CAPACITY=10000;     // Counters per shard
+    #endif
+
+    // One SpaceSaving summary: a min-heap on count, plus an index from word to heap slot
+    class summary {
+        struct counter {
+            std::string key;
+            long count;
+        };
+
+        std::vector<counter> heap;
+        std::unordered_map<std::string, size_t> index;
+        size_t capacity;
+
+        void place( size_t i, counter&& c ) {
+            heap[i] = std::move( c );
+            index[heap[i].key] = i;
+        }
+
+        // count at i went up; restore the heap below it
+        void sift_down( size_t i ) {
+            counter c = std::move( heap[i] );
+            size_t n = heap.size();
+            while( true ) {
+                size_t l = 2 * i + 1;
+                if ( l >= n ) break;
+                size_t m = ( l + 1 < n && heap[l+1].count < heap[l].count ) ? l + 1 : l;
+                if ( heap[m].count >= c.count ) break;
+                place( i, std::move( heap[m] ) );
+                i = m;
+            }
+            place( i, std::move( c ) );
+        }
+
+        void sift_up( size_t i ) {
+            counter c = std::move( heap[i] );
+            while( i > 0 ) {
+                size_t p = ( i - 1 ) / 2;
+                if ( heap[p].count <= c.count ) break;
+                place( i, std::move( heap[p] ) );
+                i = p;
+            }
+            place( i, std::move( c ) );
+        }
+
+    public:
+        std::mutex mtx;
+        long total;             // Occurrences inserted into this shard
+        std::string scratch;    // The key being inserted, so the index can be searched without allocating
+
+        explicit summary( size_t cap ) : capacity(cap), total(0) {
+            heap.reserve( cap );
+            index.reserve( cap );
+        }
+
+        // The most any word this summary doesn't track can have been seen here
+        long floor() const { return heap.size() < capacity ? 0 : heap.front().count; }
+
+        long add( const std::string& key, long delta ) {
+            total += delta;
+            auto it = index.find( key );
+            if ( it != index.end() ) {
+                size_t i = it->second;
+                heap[i].count += delta;
+                sift_down( i );
+                return heap[index[key]].count;
+            }
+            if ( heap.size() < capacity ) {
+                heap.push_back( counter{ key, delta } );
+                index[key] = heap.size() - 1;
+                sift_up( heap.size() - 1 );
+                return delta;
+            }
+            // Evict the smallest counter and let key inherit it
+            long m = heap.front().count;
+            index.erase( heap.front().key );
+            heap.front().key = key;
+            heap.front().count = m + delta;
+            index[key] = 0;
+            sift_down( 0 );
+            return m + delta;
+        }
+
+        // key's count, or floor() if it isn't tracked
+        long estimate( const std::string& key ) const {
+            auto it = index.find( key );
+            return it == index.end() ? floor() : heap[it->second].count;
+        }
+
+        template <typename F>
+        void for_each( F f ) const {
+            for( const auto& c : heap ) f( c.key, c.count );
+        }
+    };
+
+    std::vector<std::unique_ptr<summary>> shards;
+    size_t capacity;
+    std::atomic<int> nextshard;
+
+    summary& my_shard() {
+        static thread_local int mine = -1;
+        if ( mine < 0 ) mine = nextshard.fetch_add( 1 );
+        return *shards[mine % shards.size()];
+    }
+
+    static int clamp( long n ) { return n > INT_MAX ? INT_MAX : int( n ); }
+
+public:
+    spacesavingcounter( size_t cap=DEFAULT_CAPACITY, int nshards=1 ) :
+        capacity( cap > 0 ? cap : 1 ), nextshard(0) {
+        if ( nshards < 1 ) nshards = 1;
+        for( int i=0; i<nshards; ++i ) shards.emplace_back( new summary( capacity ) );
+    }
+
+    size_t get_capacity() const { return capacity; }
+
+    int insert( std::string_view key ) { return insert_n( key, 1 ); }
+
+    // Add delta occurrences of key; returns its estimate within this thread's shard
+    int insert_n( std::string_view key, int delta ) {
+        summary& s = my_shard();
+        std::lock_guard<std::mutex> lg( s.mtx );
+        s.scratch.assign( key.data(), key.size() );
+        return clamp( s.add( s.scratch, delta ) );
+    }
+
+    // An upper bound on key's count (0 if no shard has room to have seen it)
+    int contains( std::string_view k ) const {
+        std::string key( k );
+        long total = 0;
+        for( const auto& s : shards ) {
+            std::lock_guard<std::mutex> lg( s->mtx );
+            total += s->estimate( key );
+        }
+        return clamp( total );
+    }
+
+    // No estimate is more than this above the true count
+    long error_bound() const {
+        long b = 0;
+        for( const auto& s : shards ) {
+            std::lock_guard<std::mutex> lg( s->mtx );
+            b += s->floor();
+        }
+        return b;
+    }
+
+    // Occurrences inserted so far
+    long total() const {
+        long n = 0;
+        for( const auto& s : shards ) {
+            std::lock_guard<std::mutex> lg( s->mtx );
+            n += s->total;
+        }
+        return n;
+    }
+
+    resize_stats get_resize_stats() const { return resize_stats{ 0, 0, 0, 0 }; }
+
+    // The count words with the highest estimates (every tracked word if count is 0),
+    // most frequent first.  Meant to be called once the inserters are done.
+    std::vector<element> extract_top( int count, int nthreads=1 ) {
+        std::vector<std::unique_lock<std::mutex>> lgs;
+        for( auto& s : shards ) lgs.emplace_back( s->mtx );
+
+        // Merge: start every word at the sum of the floors, then swap in the real
+        // count wherever a shard actually tracks it
+        long floors = 0;
+        for( const auto& s : shards ) floors += s->floor();
+        std::unordered_map<std::string, long> merged;
+        for( const auto& s : shards ) {
+            long f = s->floor();
+            s->for_each( [&]( const std::string& key, long c ) {
+                auto r = merged.emplace( key, floors );
+                r.first->second += c - f;
+            } );
+        }
+
+        std::vector<element> entries;
+        entries.reserve( merged.size() );
+        for( auto& it : merged ) entries.push_back( element( it.first, clamp( it.second ) ) );
+        return kjp::parallel_top<element>( entries.size(), count, nthreads,
+            [&entries]( size_t lo, size_t hi, kjp::topk_heap<element>& heap ) {
+                for( size_t i=lo; i<hi; ++i ) {
+                    if ( heap.rejects( entries[i].second ) ) continue;
+                    heap.offer( std::move( entries[i] ) );
+                }
+            } );
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+//
+// A word counter with a memory budget
+// Words are counted in an ordinary table until it is estimated to fill half the
+// budget; the other half is for the sorted copy of it that is made when it is then
+// written out to disk as a sorted run (runs.h).  The table is replaced by an empty one
+// and counting carries on.  The top words come from a streaming merge of all the runs
+// into a bounded heap, so however many distinct words there are, only the budget plus
+// one entry per run is ever held in memory.
+//
+// The estimate is entries times a fixed overhead plus the key bytes, rather than
+// anything the allocator reports.
+//
+// Inserts take a shared lock on the table, so that a spill can swap it out from
+// under them; once a spill is wanted, new inserts wait rather than keep the spiller
+// from ever getting the lock.
+//
+
+#ifndef __SPILL_COUNTER_H__
+#define __SPILL_COUNTER_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "runs.h"
+#include "topk.h"
+#include "wordcounter.h"
+
+class spillingcounter : public wordcounter {
+    #ifdef SPILL_ENTRY_BYTES
+    static constexpr size_t ENTRY_BYTES=SPILL_ENTRY_BYTES;
+    #else
+    static constexpr size_t ENTRY_BYTES=96;     // Per word on top of its bytes, for the estimate
+    #endif
+    static constexpr size_t WRITE_BLOCK=1 << 20;
+
+    std::function<wordcounter*()> make_table;
+    std::unique_ptr<wordcounter> table;
+    std::atomic<size_t> limit;              // Estimated bytes in table that make it spill
+    std::string dir;
+    int nthreads;
+
+    mutable std::shared_mutex tablemtx;     // Shared by inserters, exclusive for a spill
+    std::atomic<size_t> used;               // Estimated bytes in table
+    std::atomic<bool> spilling;
+    std::mutex waitmtx;
+    std::condition_variable waitcv;
+
+    std::vector<std::unique_ptr<kjp::run_file>> runs;
+    size_t spilled_bytes;
+    resize_stats resizes;                   // Of the tables spilled so far
+
+    static int clamp( int64_t n ) { return n > INT_MAX ? INT_MAX : int( n ); }
+
+    static std::vector<const element*> by_word( const std::vector<element>& entries ) {
+        std::vector<const element*> sorted;
+        sorted.reserve( entries.size() );
+        for( const element& e : entries ) sorted.push_back( &e );
+        std::sort( sorted.begin(), sorted.end(),
+                   []( const element* a, const element* b ) { return a->first < b->first; } );
+        return sorted;
+    }
+
+    // Write the table out as a run and start a new one.  Needs tablemtx held exclusively.
+    bool spill_locked() {
+        std::vector<element> entries = table->extract_top( 0, nthreads );
+        std::vector<const element*> sorted = by_word( entries );
+
+        std::unique_ptr<kjp::run_file> f( new kjp::run_file );
+        bool ok = f->create( dir );
+        kjp::run_writer w;
+        for( size_t i=0; ok && i<sorted.size(); ++i ) {
+            w.add( sorted[i]->first, sorted[i]->second );
+            if ( w.out.size() >= WRITE_BLOCK ) {
+                ok = f->append( w.out );
+                w.out.clear();
+            }
+        }
+        if ( ok ) ok = f->append( w.out );
+        if ( !ok ) {
+            // Keep what we have in memory rather than lose it
+            std::cerr << "Warning: Cannot spill counts to " << dir << ": " << strerror( errno )
+                      << "; carrying on without a memory limit" << std::endl;
+            limit = SIZE_MAX;
+            return false;
+        }
+
+        resize_stats rs = table->get_resize_stats();
+        resizes.resizes += rs.resizes;
+        resizes.pauses += rs.pauses;
+        resizes.total_ns += rs.total_ns;
+        resizes.max_ns = std::max( resizes.max_ns, rs.max_ns );
+        spilled_bytes += f->size();
+        runs.push_back( std::move( f ) );
+        entries.clear();
+        table.reset();
+        table.reset( make_table() );
+        used = 0;
+        return true;
+    }
+
+    void spill() {
+        if ( spilling.exchange( true ) ) return;    // Someone else is on it
+        {
+            std::unique_lock<std::shared_mutex> lg( tablemtx );
+            if ( used.load() > limit ) spill_locked();
+        }
+        std::lock_guard<std::mutex> lg( waitmtx );
+        spilling = false;
+        waitcv.notify_all();
+    }
+
+public:
+    // make builds each new table; runs go in dir
+    spillingcounter( std::function<wordcounter*()> make, size_t budget, const std::string& d, int nt ) :
+        make_table( std::move( make ) ), table( make_table() ), limit( budget / 2 ), dir( d ),
+        nthreads( std::max( 1, nt ) ), used(0), spilling(false), spilled_bytes(0), resizes{ 0, 0, 0, 0 } {}
+
+    size_t nruns() const { return runs.size(); }
+    size_t bytes_spilled() const { return spilled_bytes; }
+
+    // The count returned is only the one in memory, since the last spill
+    int insert_n( std::string_view key, int delta ) override {
+        if ( spilling.load( std::memory_order_acquire ) ) {
+            std::unique_lock<std::mutex> lg( waitmtx );
+            waitcv.wait( lg, [this]() { return !spilling.load(); } );
+        }
+        int n;
+        {
+            std::shared_lock<std::shared_mutex> lg( tablemtx );
+            n = table->insert_n( key, delta );
+        }
+        if ( n == delta && used.fetch_add( key.size() + ENTRY_BYTES ) + key.size() + ENTRY_BYTES > limit ) {
+            spill();
+        }
+        return n;
+    }
+
+    // Slow once anything has been spilled: reads every run
+    int contains( std::string_view key ) const override {
+        std::shared_lock<std::shared_mutex> lg( tablemtx );
+        int64_t n = table->contains( key );
+        for( const auto& f : runs ) {
+            if ( !f->map_contents() ) continue;
+            kjp::run_reader r( f->data(), f->size() );
+            while( r.next() ) {
+                if ( r.word == key ) {
+                    n += r.count;
+                    break;
+                }
+            }
+        }
+        return clamp( n );
+    }
+
+    // Spills whatever is still in memory too (or failing that makes a run of it there),
+    // and merges all the runs.  Meant to be called once the inserters are done.
+    std::vector<element> extract_top( int count, int nthreads ) override {
+        std::unique_lock<std::shared_mutex> lg( tablemtx );
+        if ( runs.empty() ) return table->extract_top( count, nthreads );
+
+        kjp::run_writer last;
+        if ( !spill_locked() ) {
+            std::vector<element> entries = table->extract_top( 0, nthreads );
+            for( const element* e : by_word( entries ) ) last.add( e->first, e->second );
+        }
+        std::vector<kjp::run_reader> readers;
+        readers.emplace_back( last.out );
+        for( const auto& f : runs ) {
+            if ( !f->map_contents() ) {
+                std::cerr << "Error: Cannot read spilled counts: " << strerror( errno ) << std::endl;
+                continue;
+            }
+            readers.emplace_back( f->data(), f->size() );
+        }
+        kjp::topk_heap<element> heap( count );
+        bool ok = kjp::merge_runs( readers, [&heap]( const std::string& w, int64_t sum, uint32_t ) {
+            int n = clamp( sum );
+            if ( !heap.rejects( n ) ) heap.offer( element( w, n ) );
+        } );
+        if ( !ok ) std::cerr << "Error: Spilled counts are damaged" << std::endl;
+        return heap.take();
+    }
+
+    resize_stats get_resize_stats() const override {
+        std::shared_lock<std::shared_mutex> lg( tablemtx );
+        resize_stats rs = table->get_resize_stats();
+        rs.resizes += resizes.resizes;
+        rs.pauses += resizes.pauses;
+        rs.total_ns += resizes.total_ns;
+        rs.max_ns = std::max( rs.max_ns, resizes.max_ns );
+        return rs;
+    }
+};
+
+#endif
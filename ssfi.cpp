@@ -1,63 +1,171 @@
 //
 // ssfi - Super Simple File Indexer
 // Author: Kenneth Platz @kjplatz 
+// The command line front end to kjp::indexer (indexer.h)
 
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE
-#endif // _GNU_SOURCE
 #include <algorithm>
-#include <atomic>
-#include <cctype>
 #include <cerrno>
-#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
 #include <iostream>
-#include <mutex>
-#include <sstream>
 #include <string>
-#include <regex>
-#include <thread>
+#include <vector>
 
-#include <ftw.h>
 #include <getopt.h> // For getopt_long
 
-#include "bdqueue.h"     // For lock-based bounded queue
-#include "stripedhash.h" // for cuckooHashCounter
+#include "decompress.h"  // For compression_supported
+#include "distributed.h" // For --worker and --coordinator
+#include "index.h"       // For --query and --top
+#include "indexer.h"     // For everything else
+#include "stats.h"       // For --stats
 
 using namespace std;
-using kjp::unboundedQueue;
+using kjp::tokenizer_engine;
 
-int debug = false;
-unboundedQueue<string> bq;
-stripedhashcounter<string> hc;
-mutex donemtx;
-condition_variable donecv;
+extern int debug;
+int utf8mode = false;       // Unicode words, case folded, rather than ASCII ones
+int resizestats = false;
+bool statsjson = false;     // --stats=json
+int querymode = false;      // Arguments are words to look up in the index, not paths
+int showfiles = false;      // --query also lists the files each word is in
+int numamode = false;       // Pin the workers, and keep a table shard on every node
+const char* indexfile = nullptr;
+const char* coordinator = nullptr;  // Ship our counts to this coordinator, with --worker
+kjp::indexer_options opts;  // Everything else on the command line
 
-void worker( int mytid, unboundedQueue<string>* q, atomic<int>* dc );
-int ntfw_process_file(const char *name, const struct stat *status, int type, struct FTW *fb);
-void worker_process_file( int mytid, const string& name );
+// Accepts a plain number of bytes, or one with a k, m or g suffix
+bool parse_size( const char* s, size_t& out ) {
+    char* end;
+    unsigned long long v = strtoull( s, &end, 10 );
+    if ( end == s ) return false;
+    switch( *end ) {
+    case 'k': case 'K': v <<= 10; ++end; break;
+    case 'm': case 'M': v <<= 20; ++end; break;
+    case 'g': case 'G': v <<= 30; ++end; break;
+    }
+    if ( *end != '\0' ) return false;
+    out = v;
+    return true;
+}
+
+int run_query( int nwords, char** words, long top );
+int run_coordinator( const char* address, int count );
+
+// Long-only options
+enum {
+    OPT_TOKENIZER = 256,
+    OPT_IO,
+    OPT_AGGREGATE,
+    OPT_RESIZE,
+    OPT_TABLE,
+    OPT_EXT,
+    OPT_WALK,
+    OPT_CHUNK,
+    OPT_APPROX,
+    OPT_INDEX,
+    OPT_TOP,
+    OPT_STATS,
+    OPT_INFLIGHT,
+    OPT_WORKER,
+    OPT_COORDINATOR,
+    OPT_PARTITION,
+    OPT_MEMLIMIT,
+    OPT_NGRAM,
+    OPT_STOPWORDS,
+    OPT_MINLEN
+};
 
 void display_help( const char* fname, ostream& os ) {
-    os << "Usage: " << basename(fname) << " -N <num> [-d] [-h]" << endl
+    os << "Usage: " << basename(fname) << " -N <num> [-d] [-h] <path>..." << endl
+       << "       " << basename(fname) << " --index=<file> --query <word>..." << endl
+       << "       " << basename(fname) << " --index=<file> --top <num>" << endl
+       << "       " << basename(fname) << " --coordinator=[<host>:]<port> [-c <num>]" << endl
        << "     -N <num> : Indicate number of worker threads" << endl
-       << "     -c <num> : Extract the top <num> frequently occurring words (default:10)" << endl
+       << "     -c <num> : Extract the top <num> frequently occurring words, or every word" << endl
+       << "                if <num> is 0 or all (default:10)" << endl
        << "     -h       : Display this help and exit" << endl
-       << "     -d       : Enable debugging" << endl;
+       << "     -d       : Enable debugging" << endl
+       << "     --tokenizer=<engine> : Word scanner: auto, avx2, sse2, scalar or regex (default: auto)" << endl
+       << "     --utf8       : Read the text as UTF-8: words are runs of Unicode letters, marks and" << endl
+       << "                    digits, and are case folded (not with --tokenizer=regex)" << endl
+       << "     --stopwords[=<file>] : Don't count common English words (the, and, of, ...), or the" << endl
+       << "                            words in <file>; may be repeated" << endl
+       << "     --min-len=<n> : Don't count words of fewer than <n> characters" << endl
+       << "     --io=<mode>  : File ingestion: stream (ifstream + getline), mmap, or uring (read ahead" << endl
+       << "                    asynchronously with io_uring, or reader threads) (default: stream)" << endl
+       << "     --inflight=<n> : Opens and reads outstanding with --io=uring (default: 64)" << endl
+       << "     --aggregate=<n> : Pre-aggregate counts per thread, merging every <n> words," << endl
+       << "                       once per file (file), or not at all (off) (default: file)" << endl
+       << "     --table=<layout> : Hash table: striped (pointer per slot) or flat (inline counts," << endl
+       << "                        arena-allocated keys) (default: striped)" << endl
+       << "     --resize=<mode> : Hash table growth: incremental or stw (stop-the-world) (default: incremental)" << endl
+       << "     --approx[=<n>]  : Approximate counts in <n> counters per thread (default: 10000)," << endl
+       << "                       using bounded memory; the error bound is reported on stderr" << endl
+       << "     --mem-limit=<size> : Keep the table to about <size> bytes (k, m, g suffixes allowed)," << endl
+       << "                          spilling sorted runs to $TMPDIR (default: /tmp) past that" << endl
+       << "     --ngram=<n>     : Count runs of <n> consecutive words within a file (1-16) rather" << endl
+       << "                       than single words; files aren't split, and the table is striped" << endl
+       << "     --index=<file>  : Keep per-file counts in <file>, and only read the files that" << endl
+       << "                       changed since it was last written" << endl
+       << "     --query         : Look the words up in the index instead of indexing anything" << endl
+       << "     --files         : With --query, also list the files each word occurs in" << endl
+       << "     --top <num>     : Print the <num> most frequent words in the index" << endl
+       << "     --resize-stats  : Report how long operations were held up by resizes" << endl
+       << "     --numa          : Pin the workers to CPUs across the NUMA nodes, and keep one table" << endl
+       << "                       shard per node in that node's memory" << endl
+       << "     --stats[=<format>] : Report where the time went (bytes, words, lock waits, probe" << endl
+       << "                          lengths, resizes, queue waits) on stderr as text or json" << endl
+       << "     --ext=<list> : Index files with these extensions; may be repeated, comma separated," << endl
+       << "                    or * for every file (default: .txt).  Files compressed with gzip" << endl
+       << "                    (.gz) or zstd (.zst) match by the name they'd have uncompressed" << endl
+       << "     --walk=<mode> : Directory traversal: parallel (by the workers) or nftw (default: parallel)" << endl
+       << "     --chunk=<size> : Split files larger than <size> bytes (k, m, g suffixes allowed)" << endl
+       << "                      into pieces counted in parallel; 0 to disable (default: 32m)" << endl
+       << "     --partition=<i>/<n> : Only count the files that fall to node <i> of <n>, by a hash" << endl
+       << "                           of their path; every node should be given the same paths" << endl
+       << "     --worker=<host>:<port> : Send the counts to a coordinator instead of printing them" << endl
+       << "     --coordinator=[<host>:]<port> : Wait for the workers of every partition and print the" << endl
+       << "                                     top words across all of them" << endl;
 }
 int main( int argc, char** argv ) {
     int c;
     int option_index = 0;
     int nthreads = 0;
     int count = 10;
-    atomic<int> donecount(0);
+    long topcount = -1;
+    const char* listenaddr = nullptr;   // With --coordinator
+    vector<const char*> stopfiles;      // Read once we know whether it's --utf8
 
     struct option long_options[] = {
         { "debug", no_argument, &debug, 'd' },
-        { "count", required_argument, &count, 'c' },
+        { "count", required_argument, 0, 'c' },
         { "nthreads", required_argument, 0, 'N' },
         { "help", no_argument, 0, 'h' },
+        { "tokenizer", required_argument, 0, OPT_TOKENIZER },
+        { "utf8", no_argument, &utf8mode, true },
+        { "io", required_argument, 0, OPT_IO },
+        { "aggregate", required_argument, 0, OPT_AGGREGATE },
+        { "resize", required_argument, 0, OPT_RESIZE },
+        { "table", required_argument, 0, OPT_TABLE },
+        { "resize-stats", no_argument, &resizestats, true },
+        { "ext", required_argument, 0, OPT_EXT },
+        { "walk", required_argument, 0, OPT_WALK },
+        { "chunk", required_argument, 0, OPT_CHUNK },
+        { "approx", optional_argument, 0, OPT_APPROX },
+        { "index", required_argument, 0, OPT_INDEX },
+        { "query", no_argument, &querymode, true },
+        { "files", no_argument, &showfiles, true },
+        { "top", required_argument, 0, OPT_TOP },
+        { "stats", optional_argument, 0, OPT_STATS },
+        { "numa", no_argument, &numamode, true },
+        { "inflight", required_argument, 0, OPT_INFLIGHT },
+        { "worker", required_argument, 0, OPT_WORKER },
+        { "coordinator", required_argument, 0, OPT_COORDINATOR },
+        { "partition", required_argument, 0, OPT_PARTITION },
+        { "mem-limit", required_argument, 0, OPT_MEMLIMIT },
+        { "ngram", required_argument, 0, OPT_NGRAM },
+        { "stopwords", optional_argument, 0, OPT_STOPWORDS },
+        { "min-len", required_argument, 0, OPT_MINLEN },
         { 0, 0, 0, 0 } };
 
     do {
@@ -67,6 +175,168 @@ int main( int argc, char** argv ) {
         case 'h' : display_help(argv[0], cout); return 0;
         case 'd' : debug = true; break;
         case 'N' : nthreads = atoi( optarg ); break;
+        case 'c' :
+            if ( strcmp( optarg, "all" ) == 0 ) {
+                count = 0;
+            } else {
+                char* end;
+                count = strtol( optarg, &end, 10 );
+                if ( end == optarg || *end != '\0' || count < 0 ) {
+                    cerr << "Error: Invalid count: " << optarg << endl;
+                    return 1;
+                }
+            }
+            break;
+        case OPT_TOKENIZER :
+            if ( !kjp::parse_tokenizer_engine( optarg, opts.engine ) ) {
+                cerr << "Error: Unknown tokenizer: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_IO :
+            if ( !kjp::parse_io_mode( optarg, opts.io ) ) {
+                cerr << "Error: Unknown I/O mode: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_AGGREGATE :
+            if ( strcmp( optarg, "file" ) == 0 ) {
+                opts.preaggregate = true;
+                opts.aggbatch = 0;
+            } else if ( strcmp( optarg, "off" ) == 0 ) {
+                opts.preaggregate = false;
+            } else {
+                char* end;
+                opts.aggbatch = strtol( optarg, &end, 10 );
+                if ( *end != '\0' || opts.aggbatch < 0 ) {
+                    cerr << "Error: Invalid aggregation batch: " << optarg << endl;
+                    return 1;
+                }
+                opts.preaggregate = opts.aggbatch > 0;
+            }
+            break;
+        case OPT_RESIZE :
+            if ( strcmp( optarg, "incremental" ) == 0 ) {
+                opts.incremental = true;
+            } else if ( strcmp( optarg, "stw" ) == 0 ) {
+                opts.incremental = false;
+            } else {
+                cerr << "Error: Unknown resize mode: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_TABLE :
+            if ( strcmp( optarg, "striped" ) == 0 ) {
+                opts.flat = false;
+            } else if ( strcmp( optarg, "flat" ) == 0 ) {
+                opts.flat = true;
+            } else {
+                cerr << "Error: Unknown table layout: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_EXT :
+            opts.ext.add( optarg );
+            break;
+        case OPT_WALK :
+            if ( strcmp( optarg, "parallel" ) == 0 ) {
+                opts.serialwalk = false;
+            } else if ( strcmp( optarg, "nftw" ) == 0 ) {
+                opts.serialwalk = true;
+            } else {
+                cerr << "Error: Unknown walk mode: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_CHUNK :
+            if ( !parse_size( optarg, opts.chunksize ) ) {
+                cerr << "Error: Invalid chunk size: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_APPROX :
+            opts.approx = 10000;
+            if ( optarg && ( !parse_size( optarg, opts.approx ) || opts.approx == 0 ) ) {
+                cerr << "Error: Invalid number of counters: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_MEMLIMIT :
+            if ( !parse_size( optarg, opts.memlimit ) || opts.memlimit == 0 ) {
+                cerr << "Error: Invalid memory limit: " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_NGRAM : {
+            char* end;
+            long n = strtol( optarg, &end, 10 );
+            if ( end == optarg || *end != '\0' || n < 1 || n > 16 ) {
+                cerr << "Error: Invalid n-gram length (1-16): " << optarg << endl;
+                return 1;
+            }
+            opts.ngram = n;
+            break;
+        }
+        case OPT_STOPWORDS :
+            if ( optarg ) {
+                stopfiles.push_back( optarg );
+            } else {
+                opts.words.use_builtin();
+            }
+            break;
+        case OPT_MINLEN : {
+            char* end;
+            long n = strtol( optarg, &end, 10 );
+            if ( end == optarg || *end != '\0' || n < 0 || n > 1024 ) {
+                cerr << "Error: Invalid minimum word length (0-1024): " << optarg << endl;
+                return 1;
+            }
+            opts.words.set_min_len( n );
+            break;
+        }
+        case OPT_INDEX :
+            indexfile = optarg;
+            break;
+        case OPT_TOP : {
+            char* end;
+            topcount = strtol( optarg, &end, 10 );
+            if ( end == optarg || *end != '\0' || topcount < 0 ) {
+                cerr << "Error: Invalid count: " << optarg << endl;
+                return 1;
+            }
+            break;
+        }
+        case OPT_INFLIGHT : {
+            char* end;
+            long n = strtol( optarg, &end, 10 );
+            if ( end == optarg || *end != '\0' || n < 1 || n > 4096 ) {
+                cerr << "Error: Invalid number of reads in flight (1-4096): " << optarg << endl;
+                return 1;
+            }
+            opts.inflight = n;
+            break;
+        }
+        case OPT_WORKER :
+            coordinator = optarg;
+            break;
+        case OPT_COORDINATOR :
+            listenaddr = optarg;
+            break;
+        case OPT_PARTITION :
+            if ( !opts.share.parse( optarg ) ) {
+                cerr << "Error: Invalid partition (expected <i>/<n> with <i> below <n>): " << optarg << endl;
+                return 1;
+            }
+            break;
+        case OPT_STATS :
+            if ( optarg && strcmp( optarg, "json" ) == 0 ) {
+                statsjson = true;
+            } else if ( optarg && strcmp( optarg, "text" ) != 0 ) {
+                cerr << "Error: Unknown stats format: " << optarg << endl;
+                return 1;
+            }
+            kjp::stats::enabled = true;
+            break;
         case 0:
         case -1:   break;
  
@@ -76,110 +346,196 @@ int main( int argc, char** argv ) {
 
     } while ( c >= 0 );
 
+    if ( opts.ext.empty() ) opts.ext.add( ".txt" );
+
     debug && cout << "Debugging enabled." << endl;
     debug && cout << "Number of threads: " << nthreads << endl;
     debug && cout << "Number of words: " << count << endl;
+    if ( opts.engine != tokenizer_engine::regex ) {
+        opts.engine = kjp::resolve_tokenizer_engine( opts.engine );
+    }
+    if ( utf8mode && opts.engine == tokenizer_engine::regex ) {
+        cerr << "Error: --utf8 doesn't work with --tokenizer=regex" << endl;
+        return 1;
+    }
+    for( const char* f : stopfiles ) {
+        if ( !opts.words.load( f, utf8mode ) ) {
+            cerr << "Error: Cannot read stopwords from " << f << ": " << strerror( errno ) << endl;
+            return 1;
+        }
+    }
+    debug && cout << "Tokenizer: " << kjp::tokenizer_engine_name( opts.engine ) << ( utf8mode ? " (UTF-8)" : "" ) << endl;
+    debug && cout << "Leaving out: " << opts.words.to_string() << endl;
+    debug && cout << "I/O mode: " << kjp::io_mode_name( opts.io ) << endl;
+    debug && cout << "Extensions: " << opts.ext.to_string() << endl;
+    debug && cout << "Compressed input:" << ( kjp::compression_supported( kjp::compression::gzip ) ? " gzip" : "" )
+                  << ( kjp::compression_supported( kjp::compression::zstd ) ? " zstd" : "" ) << endl;
+    debug && cout << "Walk: " << ( opts.serialwalk ? "nftw" : "parallel" ) << endl;
+    debug && cout << "Chunk size: " << opts.chunksize << endl;
+    debug && cout << "Table: " << ( opts.approx ? "approximate (" + to_string( opts.approx ) + " counters per thread)" :
+                                    opts.flat ? string{"flat"} : string{"striped"} ) << endl;
+    debug && cout << "N-grams: " << opts.ngram << endl;
+    debug && cout << "Memory limit: " << ( opts.memlimit ? to_string( opts.memlimit ) : string{"none"} ) << endl;
+    debug && cout << "Resize: " << ( opts.incremental && !opts.flat ? "incremental" : "stop-the-world" ) << endl;
+    debug && cout << "Pre-aggregation: " << ( !opts.preaggregate ? string{"off"} :
+                                              opts.aggbatch == 0 ? string{"per file"} :
+                                              to_string( opts.aggbatch ) + " words" ) << endl;
+
+    if ( querymode || topcount >= 0 ) {
+        if ( !indexfile ) {
+            cerr << "Error: --query and --top need an --index" << endl;
+            return 1;
+        }
+        return run_query( argc - optind, argv + optind, topcount );
+    }
+    if ( listenaddr ) {
+        if ( optind < argc || coordinator ) {
+            cerr << "Error: The coordinator doesn't count anything itself; run --worker nodes for that" << endl;
+            return 1;
+        }
+        return run_coordinator( listenaddr, count );
+    }
+    if ( opts.share.count > 1 ) {
+        debug && cout << "Partition: " << opts.share.index << "/" << opts.share.count << endl;
+    }
 
     if ( nthreads <= 0 ) {
         cerr << "Error: Number of threads must be specified and greater than zero" << endl;
         return 1;
     }
+    if ( indexfile && opts.approx ) {
+        cerr << "Error: --index needs exact counts and can't be used with --approx" << endl;
+        return 1;
+    }
+    if ( opts.memlimit && ( indexfile || opts.approx ) ) {
+        cerr << "Error: --mem-limit can't be used with " << ( indexfile ? "--index, which keeps every word in memory" :
+                                                               "--approx, which is bounded already" ) << endl;
+        return 1;
+    }
+    if ( opts.memlimit && coordinator ) {
+        cerr << "Error: --mem-limit can't be used with --worker, which answers the coordinator from every word in memory" << endl;
+        return 1;
+    }
+    if ( opts.ngram > 1 && ( indexfile || opts.approx || opts.memlimit ) ) {
+        cerr << "Error: --ngram can't be used with " << ( indexfile ? "--index" : opts.approx ? "--approx" : "--mem-limit" )
+             << ", which keep single words" << endl;
+        return 1;
+    }
 
+    opts.nthreads = nthreads;
+    opts.utf8 = utf8mode;
+    opts.numa = numamode;
+    if ( indexfile ) opts.indexfile = indexfile;
 
-    // hashTable<string,int> ht;         // Hash table for handling entries
-
-    for( int i=0; i<nthreads; ++i ) {
-        // thread t = new thread( worker, bq, ht, done );
-        thread* t = new thread( worker, (i+1), &bq, &donecount );
-        t->detach(); 
+    uint64_t start_ns = kjp::stats::now_ns();
+    kjp::indexer ix( opts );
+    if ( !ix.index( vector<string>( argv + optind, argv + argc ) ) ) {
+        cerr << "Error writing index " << indexfile << ": " << strerror( errno ) << endl;
     }
 
-    for( ; optind < argc; ++optind ) {
-        if ( nftw( argv[optind], ntfw_process_file, 32, 0 ) < 0 ) {
-            cerr << "Error processing directory " << argv[optind] << ": "
-                 << strerror( errno ) << endl;
+    int status = 0;
+    // The coordinator decides how many words it needs from us, so a worker keeps them all
+    std::vector<kjp::indexer::element> entries = ix.top( coordinator ? 0 : count );
+    if ( coordinator ) {
+        debug && cout << "Sending " << entries.size() << " words' counts to " << coordinator << endl;
+        string err;
+        if ( !kjp::serve_counts( coordinator, opts.share, entries, err ) ) {
+            cerr << "Error sending counts to " << coordinator << ": " << err << endl;
+            status = 1;
+        }
+    } else {
+        for( auto it : entries ) {
+            cout << it.first << " : " << it.second << endl;
         }
     }
 
-    // Terminal value, let each worker thread know it's done
-    for( int i=0; i<nthreads; ++i ) {
-        bq.enq( string{""} );
+    if ( opts.memlimit ) {
+        debug && cout << "Spilled: " << ix.spilled_runs() << " runs, " << ix.spilled_bytes() << " bytes" << endl;
+    }
+    if ( opts.approx ) {
+        cerr << "Approximate counts from " << ix.approx_words() << " words: each is at most "
+             << ix.approx_error() << " too high" << endl;
     }
 
-    // Sleep until everyone is done.
-    // No need to busy-wait here
-    while( donecount.load() < nthreads ) {
-        unique_lock<mutex> lg( donemtx );
-        donecv.wait( lg );
+    if ( resizestats ) {
+        auto rs = ix.resize_stats();
+        cerr << "Resizes: " << rs.resizes << ", paused operations: " << rs.pauses
+             << ", total pause: " << rs.total_ns / 1000 << " us"
+             << ", max pause: " << rs.max_ns / 1000 << " us" << endl;
     }
-   
-    std::vector<stripedhashcounter<string>::element> entries = hc.extract_top( count );
-    for( auto it : entries ) {
-        cout << it.first << " : " << it.second << endl;
+    if ( kjp::stats::enabled ) {
+        auto rs = ix.resize_stats();
+        kjp::stats::report( cerr, statsjson, ( kjp::stats::now_ns() - start_ns ) / 1e9, nthreads,
+                            kjp::stats::resize_info{ rs.resizes, rs.pauses, rs.total_ns, rs.max_ns } );
     }
-    return 0;
+    return status;
 }
 
-int ntfw_process_file(const char *name, const struct stat *status, int type, struct FTW *fb) {
-    if ( type != FTW_F ) return 0;
+// Answer --query and --top straight from the mapped index
+int run_query( int nwords, char** words, long top ) {
+    kjp::index_reader idx;
+    if ( !idx.open( indexfile ) ) {
+        cerr << "Error reading index " << indexfile << ": "
+             << ( errno == EINVAL ? "not a valid index" : strerror( errno ) ) << endl;
+        return 1;
+    }
 
-    int l = strlen(name);
-    if ( l < 4 ) {
-        // debug && cout << name << ": too short, skipping" << endl; 
-        return 0;
+    // Words are folded the way the index's were
+    if ( nwords > 0 && utf8mode != idx.utf8() ) {
+        cerr << "Warning: Index " << indexfile << " was made " << ( idx.utf8() ? "with" : "without" )
+             << " --utf8; folding the words to match" << endl;
+    }
+    for( int i=0; i<nwords; ++i ) {
+        string w( words[i] );
+        if ( idx.utf8() ) {
+            kjp::utf8_fold( words[i], strlen( words[i] ), w );
+        } else {
+            transform( w.begin(), w.end(), w.begin(), ::tolower );
+        }
+        long id = idx.find_word( w.data(), w.size() );
+        cout << w << " : " << ( id >= 0 ? idx.word_count( id ) : 0 ) << endl;
+        if ( showfiles && id >= 0 ) {
+            bool ok = idx.for_each_posting( id, [&idx]( uint32_t f, uint32_t n ) {
+                cout << "    " << idx.path( f ) << " : " << n << endl;
+            } );
+            if ( !ok ) {
+                cerr << "Error reading index " << indexfile << ": not a valid index" << endl;
+                return 1;
+            }
+        }
     }
-    if ( strcasecmp( name + l - 4, ".txt" ) != 0 ) {
-        // debug && cout << name << ": does not end in .txt" << endl;
-        return 0;
+
+    size_t n = min<size_t>( top < 0 ? 0 : top, idx.nwords() );
+    for( size_t i=0; i<n; ++i ) {
+        long id = idx.top_word( i );
+        if ( id < 0 ) {
+            cerr << "Error reading index " << indexfile << ": not a valid index" << endl;
+            return 1;
+        }
+        cout << string( idx.word( id ), idx.word_len( id ) ) << " : " << idx.word_count( id ) << endl;
     }
-    debug && cout << "Processing: " << name << endl;
-    bq.enq( string{name} ); 
-    
     return 0;
 }
 
-//int worker( int mytid, unboundedQueue<string>* q, atomic<int>* dc );
-void worker( int mytid, unboundedQueue<string>* q, atomic<int>* done ) {
-    string s;
-    debug && cout << "[" << mytid << "]" << " Starting..." << endl;
-    s = q->deq();
-    while( s.length() > 0 ) {
-        debug && cout << "[" << mytid << "]" << " Processing " << s << endl;
-        
-        worker_process_file( mytid, s );
-        s = q->deq();
-    }
-    done->fetch_add(1);
-    unique_lock<mutex> dlg(donemtx);        
-    donecv.notify_all();
-}
-
-void worker_process_file( int mytid, const string& name ) {
-    static const regex re_word( "[[:alnum:]]+" );
-    static const regex_iterator<string::iterator> re_end;
-
-    ifstream infile( name );
-    if ( !infile.good() ) {
-        ostringstream os;
-        os << "[" << mytid << "] Cannot open: " << name << ": " << strerror(errno) << endl;
-        cout << os.str();
-        return;
-    }
-
-    string line;
-    // Prime the loop
-    getline( infile, line );
-    while( infile.good() ) {
-        debug && cout << "[" << mytid << "] Got line: " << line << endl;
-        regex_iterator<string::iterator> rit( line.begin(), line.end(), re_word );
-        while( rit != re_end ) {
-            string word(std::move(rit->str()));
-            transform( word.begin(), word.end(), word.begin(), ::tolower );
-            int count = hc.insert( word );
-            // debug && cout << "[" << mytid << "] Got word: " << word << "[" << count << "]" << endl;
-            ++rit;
-        }
-        // Read the next line and... go!
-        getline( infile, line );
+// Collect the workers' counts and print the top words across all of them
+int run_coordinator( const char* address, int count ) {
+    vector<pair<string,int64_t>> top;
+    kjp::tput_summary s;
+    string err;
+    if ( !kjp::gather_top( address, count, top, s, err ) ) {
+        cerr << "Error coordinating on " << address << ": " << err << endl;
+        return 1;
+    }
+    debug && cout << "Nodes: " << s.nodes << endl;
+    debug && cout << "Phase 1: " << s.words[0] << " words, " << s.bytes[0] << " bytes" << endl;
+    if ( count > 0 ) {
+        debug && cout << "Phase 2: " << s.words[1] << " words, " << s.bytes[1] << " bytes (threshold "
+                      << s.threshold << ", bound " << s.bound << ")" << endl;
+        debug && cout << "Phase 3: " << s.words[2] << " words, " << s.bytes[2] << " bytes ("
+                      << s.candidates << " candidates, " << s.exact << " already exact)" << endl;
     }
+    for( auto& it : top ) {
+        cout << it.first << " : " << it.second << endl;
+    }
+    return 0;
 }
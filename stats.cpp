@@ -0,0 +1,136 @@
+//
+// Per-thread counters for --stats, and the report
+//
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace kjp {
+namespace stats {
+
+    bool enabled = false;
+    thread_local counters* current = nullptr;
+
+namespace {
+
+    std::mutex registry_mtx;
+    // Owned here rather than by the threads, which are gone by the time we report
+    std::vector<std::unique_ptr<counters>> registry;
+
+    double ms( uint64_t ns ) { return ns / 1e6; }
+
+    double percent( uint64_t n, uint64_t total ) { return total ? 100.0 * n / total : 0; }
+
+    // The busiest stripes, most waited on first
+    std::vector<std::pair<size_t, uint64_t>> hottest( const counters& c, size_t n ) {
+        std::vector<std::pair<size_t, uint64_t>> v;
+        for( size_t i=0; i<STRIPES; ++i ) {
+            if ( c.stripe_wait_ns[i] ) v.emplace_back( i, c.stripe_wait_ns[i] );
+        }
+        std::sort( v.begin(), v.end(), []( const std::pair<size_t, uint64_t>& a,
+                                           const std::pair<size_t, uint64_t>& b ) {
+            return a.second > b.second || ( a.second == b.second && a.first < b.first );
+        } );
+        if ( v.size() > n ) v.resize( n );
+        return v;
+    }
+}
+
+    void counters::add( const counters& o ) {
+        files += o.files;
+        chunks += o.chunks;
+        bytes += o.bytes;
+        words += o.words;
+        task_ns += o.task_ns;
+        scan_ns += o.scan_ns;
+        queue_waits += o.queue_waits;
+        queue_wait_ns += o.queue_wait_ns;
+        lock_waits += o.lock_waits;
+        lock_wait_ns += o.lock_wait_ns;
+        for( size_t i=0; i<STRIPES; ++i ) stripe_wait_ns[i] += o.stripe_wait_ns[i];
+        for( size_t i=0; i<PROBE_BUCKETS; ++i ) probes[i] += o.probes[i];
+    }
+
+    counters& enroll() {
+        std::unique_ptr<counters> c( new counters );
+        memset( c.get(), 0, sizeof(counters) );
+        current = c.get();
+        std::lock_guard<std::mutex> lg( registry_mtx );
+        registry.push_back( std::move( c ) );
+        return *current;
+    }
+
+    counters total() {
+        counters t;
+        memset( &t, 0, sizeof(t) );
+        std::lock_guard<std::mutex> lg( registry_mtx );
+        for( const auto& c : registry ) t.add( *c );
+        return t;
+    }
+
+    void report( std::ostream& os, bool json, double seconds, int nthreads, const resize_info& rs ) {
+        counters t = total();
+        uint64_t ops = 0;
+        for( size_t i=0; i<PROBE_BUCKETS; ++i ) ops += t.probes[i];
+        auto hot = hottest( t, 5 );
+        double mbps = seconds > 0 ? t.bytes / seconds / 1e6 : 0;
+        double wps = seconds > 0 ? t.words / seconds : 0;
+
+        std::ios::fmtflags flags = os.flags();
+        os << std::fixed << std::setprecision( 1 );
+        if ( json ) {
+            os << "{ \"seconds\": " << std::setprecision( 3 ) << seconds << std::setprecision( 1 )
+               << ", \"threads\": " << nthreads
+               << ", \"files\": " << t.files << ", \"chunks\": " << t.chunks
+               << ", \"bytes\": " << t.bytes << ", \"words\": " << t.words
+               << ", \"mb_per_s\": " << mbps << ", \"words_per_s\": " << wps << "," << std::endl
+               << "  \"task_ms\": " << ms( t.task_ns ) << ", \"scan_ms\": " << ms( t.scan_ns )
+               << ", \"queue_waits\": " << t.queue_waits << ", \"queue_wait_ms\": " << ms( t.queue_wait_ns )
+               << "," << std::endl
+               << "  \"lock_waits\": " << t.lock_waits << ", \"lock_wait_ms\": " << ms( t.lock_wait_ns )
+               << ", \"hot_stripes\": [";
+            for( size_t i=0; i<hot.size(); ++i ) {
+                os << ( i ? ", " : "" ) << "{ \"stripe\": " << hot[i].first << ", \"wait_ms\": "
+                   << ms( hot[i].second ) << " }";
+            }
+            os << "]," << std::endl << "  \"probes\": [";
+            for( size_t i=0; i<PROBE_BUCKETS; ++i ) os << ( i ? ", " : "" ) << t.probes[i];
+            os << "]," << std::endl
+               << "  \"resizes\": " << rs.resizes << ", \"resize_pauses\": " << rs.pauses
+               << ", \"resize_pause_ms\": " << ms( rs.total_ns ) << ", \"resize_max_ms\": " << ms( rs.max_ns )
+               << " }" << std::endl;
+            os.flags( flags );
+            return;
+        }
+
+        os << "Elapsed: " << std::setprecision( 3 ) << seconds << " s with " << nthreads << " threads"
+           << std::setprecision( 1 ) << std::endl
+           << "Read: " << t.files << " files, " << t.chunks << " chunks, " << t.bytes << " bytes ("
+           << mbps << " MB/s)" << std::endl
+           << "Words: " << t.words << " (" << std::setprecision( 0 ) << wps << " per second)"
+           << std::setprecision( 1 ) << std::endl
+           << "Worker time: " << ms( t.task_ns ) << " ms on tasks, of which " << ms( t.scan_ns )
+           << " ms tokenizing and counting; " << ms( t.queue_wait_ns ) << " ms waiting for "
+           << t.queue_waits << " tasks" << std::endl
+           << "Stripe locks: " << t.lock_waits << " contended, " << ms( t.lock_wait_ns ) << " ms waiting";
+        for( size_t i=0; i<hot.size(); ++i ) {
+            os << ( i ? ", " : "; hottest: " ) << hot[i].first << " (" << ms( hot[i].second ) << " ms)";
+        }
+        os << std::endl << "Probe lengths (of " << ops << " table operations):";
+        for( size_t i=0; i<PROBE_BUCKETS; ++i ) {
+            if ( !t.probes[i] ) continue;
+            os << " " << i + 1 << ( i + 1 == PROBE_BUCKETS ? "+" : "" ) << ": " << percent( t.probes[i], ops ) << "%";
+        }
+        os << std::endl
+           << "Resizes: " << rs.resizes << ", paused operations: " << rs.pauses
+           << ", total pause: " << ms( rs.total_ns ) << " ms, max pause: " << ms( rs.max_ns ) << " ms" << std::endl;
+        os.flags( flags );
+    }
+}
+}
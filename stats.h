@@ -0,0 +1,100 @@
+//
+// Run-time instrumentation for --stats
+// Every thread keeps its own counters, so recording never shares a cache line with
+// another thread; they are only added up for the report, once the workers are done.
+// With stats off, each instrumentation point costs a load and a well-predicted branch
+// on stats::enabled, and the timers are never read.
+//
+// Stripe lock waits are only timed when the lock is actually contended: a try_lock()
+// that succeeds is free.  Waits are attributed to the stripe number modulo STRIPES,
+// since the number of stripes changes as the tables grow.
+//
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+
+namespace kjp {
+namespace stats {
+
+    #ifdef STATS_STRIPES
+    constexpr size_t STRIPES=STATS_STRIPES;
+    #else
+    constexpr size_t STRIPES=64;            // Lock wait buckets
+    #endif
+    constexpr size_t PROBE_BUCKETS=17;      // Probe lengths 1 to 16, and longer
+
+    struct counters {
+        uint64_t files, chunks, bytes, words;
+        uint64_t task_ns;                   // Working on files, chunks and directories
+        uint64_t scan_ns;                   // Of which tokenizing and counting
+        uint64_t queue_waits, queue_wait_ns;    // Waiting for the pool to hand out a task
+        uint64_t lock_waits, lock_wait_ns;      // Contended stripe locks
+        uint64_t stripe_wait_ns[STRIPES];
+        uint64_t probes[PROBE_BUCKETS];         // Shared table operations by probe length
+
+        void add( const counters& o );
+    };
+
+    extern bool enabled;
+    extern thread_local counters* current;
+
+    counters& enroll();
+
+    // This thread's counters
+    inline counters& mine() { return current ? *current : enroll(); }
+
+    // The counters of every thread that recorded anything, added up
+    counters total();
+
+    inline uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    // A shared table operation looked at n slots
+    inline void probe( size_t n ) {
+        if ( !enabled ) return;
+        mine().probes[( n < PROBE_BUCKETS ? n : PROBE_BUCKETS ) - 1]++;
+    }
+
+    // A lock_guard for a hash table stripe that times contended acquisitions
+    class stripe_guard {
+        std::mutex& mtx;
+
+    public:
+        stripe_guard( std::mutex& m, size_t stripe ) : mtx(m) {
+            if ( !enabled ) {
+                mtx.lock();
+                return;
+            }
+            if ( mtx.try_lock() ) return;
+            uint64_t start = now_ns();
+            mtx.lock();
+            uint64_t ns = now_ns() - start;
+            counters& c = mine();
+            c.lock_waits++;
+            c.lock_wait_ns += ns;
+            c.stripe_wait_ns[stripe % STRIPES] += ns;
+        }
+        ~stripe_guard() { mtx.unlock(); }
+
+        stripe_guard( const stripe_guard& ) = delete;
+        stripe_guard& operator=( const stripe_guard& ) = delete;
+    };
+
+    // What the tables already keep track of themselves
+    struct resize_info {
+        long resizes, pauses, total_ns, max_ns;
+    };
+
+    // Write the summary of a run that took seconds with nthreads workers, as text or JSON
+    void report( std::ostream& os, bool json, double seconds, int nthreads, const resize_info& rs );
+}
+}
+
+#endif
@@ -0,0 +1,76 @@
+//
+// Words not to count: the stopword files
+//
+
+#include "stopwords.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+
+#include "tokenizer.h"
+
+namespace kjp {
+
+    void word_filter::add( const char* w, size_t len ) {
+        if ( listed( w, len ) ) return;
+        words.emplace_back( w, len );
+
+        // Keep the load factor at or below 1/2
+        if ( words.size() * 2 > slots.size() ) {
+            size_t sz = slots.empty() ? 64 : slots.size() * 2;
+            slots.assign( sz, 0 );
+            mask = sz - 1;
+            for( size_t n=0; n<words.size(); ++n ) {
+                size_t i = hash_bytes( words[n].data(), words[n].size(), SEED ) & mask;
+                while( slots[i] != 0 ) i = ( i + 1 ) & mask;
+                slots[i] = n + 1;
+            }
+            return;
+        }
+        size_t i = hash_bytes( w, len, SEED ) & mask;
+        while( slots[i] != 0 ) i = ( i + 1 ) & mask;
+        slots[i] = words.size();
+    }
+
+    bool word_filter::load( const std::string& path, bool utf8 ) {
+        std::ifstream in( path, std::ios::binary );
+        if ( !in.good() ) return false;
+        std::string text( ( std::istreambuf_iterator<char>( in ) ), std::istreambuf_iterator<char>() );
+        if ( in.bad() ) {
+            errno = EIO;
+            return false;
+        }
+        tokenizer tok( tokenizer_engine::automatic, utf8 );
+        auto emit = [this]( const char* w, size_t len ) { add( w, len ); };
+        tok.scan( text.data(), text.size(), emit );
+        tok.finish( emit );
+        return true;
+    }
+
+    uint64_t word_filter::hash() const {
+        if ( empty() ) return 0;
+        std::vector<const std::string*> sorted;
+        sorted.reserve( words.size() );
+        for( const std::string& w : words ) sorted.push_back( &w );
+        std::sort( sorted.begin(), sorted.end(), []( const std::string* a, const std::string* b ) { return *a < *b; } );
+
+        uint64_t h = hash_u64( minlen, SEED );
+        auto add_word = [&h]( const char* w, size_t len ) { h = hash_u64( h ^ hash_bytes( w, len, SEED ), SEED ); };
+        // The built-in words themselves, in case the list changes
+        for( size_t i=0; builtin && i<stopwords::COUNT; ++i ) add_word( stopwords::builtin[i].data(), stopwords::builtin[i].size() );
+        h = hash_u64( h ^ words.size(), SEED );
+        for( const std::string* w : sorted ) add_word( w->data(), w->size() );
+        return h | 1;
+    }
+
+    std::string word_filter::to_string() const {
+        if ( empty() ) return "none";
+        std::string s;
+        if ( builtin ) s += "built-in stopwords (" + std::to_string( stopwords::COUNT ) + ")";
+        if ( !words.empty() ) s += ( s.empty() ? "" : ", " ) + std::to_string( words.size() ) + " listed stopwords";
+        if ( minlen ) s += ( s.empty() ? "" : ", " ) + std::string( "under " ) + std::to_string( minlen ) + " characters";
+        return s;
+    }
+}
@@ -0,0 +1,159 @@
+//
+// Words not to count: stopwords, and words that are too short
+// The filter is applied by the tokenizer, so a word it rejects never reaches a local
+// counter or the shared table.  That matters most for the commonest words, which are
+// the stopwords, and which all threads would otherwise be inserting into the same
+// few entries.
+//
+// The built-in list is looked up in a perfect hash table built at compile time: the
+// seed is searched for until no two of the words land in the same slot, so a lookup
+// is a short hash of the word, one byte load and at most one compare.  Words longer
+// than the longest stopword are turned away before any of that.  Words from a file
+// go in an ordinary open addressing set.
+//
+#ifndef __STOPWORDS_H__
+#define __STOPWORDS_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hash.h"
+
+namespace kjp {
+namespace stopwords {
+
+    // Common English words, as the tokenizer emits them: lowercase, and split at
+    // apostrophes, so "don't" and "it's" leave "don", "t" and "s" behind
+    constexpr std::string_view builtin[] = {
+        "a", "about", "above", "after", "again", "against", "ain", "all", "am", "an",
+        "and", "any", "are", "aren", "as", "at", "be", "because", "been", "before",
+        "being", "below", "between", "both", "but", "by", "can", "couldn", "d", "did",
+        "didn", "do", "does", "doesn", "doing", "don", "down", "during", "each", "few",
+        "for", "from", "further", "had", "hadn", "has", "hasn", "have", "haven", "having",
+        "he", "her", "here", "hers", "herself", "him", "himself", "his", "how", "i",
+        "if", "in", "into", "is", "isn", "it", "its", "itself", "just", "ll",
+        "m", "ma", "me", "mightn", "more", "most", "mustn", "my", "myself", "needn",
+        "no", "nor", "not", "now", "o", "of", "off", "on", "once", "only",
+        "or", "other", "our", "ours", "ourselves", "out", "over", "own", "re", "s",
+        "same", "shan", "she", "should", "shouldn", "so", "some", "such", "t", "than",
+        "that", "the", "their", "theirs", "them", "themselves", "then", "there", "these", "they",
+        "this", "those", "through", "to", "too", "under", "until", "up", "ve", "very",
+        "was", "wasn", "we", "were", "weren", "what", "when", "where", "which", "while",
+        "who", "whom", "why", "will", "with", "won", "wouldn", "y", "you", "your",
+        "yours", "yourself", "yourselves"
+    };
+    constexpr size_t COUNT = sizeof( builtin ) / sizeof( builtin[0] );
+    static_assert( COUNT < 256, "slots hold a word's index in a byte" );
+
+    constexpr size_t longest() {
+        size_t n = 0;
+        for( const auto& w : builtin ) n = w.size() > n ? w.size() : n;
+        return n;
+    }
+    constexpr size_t MAX_LEN = longest();
+
+    constexpr unsigned BITS = 12;           // 4096 one-byte slots, for about 150 words
+    constexpr size_t SLOTS = size_t( 1 ) << BITS;
+
+    // FNV-1a, then a multiply to bring the mixing up into the bits we keep
+    constexpr size_t slot_of( const char* p, size_t len, uint32_t seed ) {
+        uint32_t h = seed ^ uint32_t( len );
+        for( size_t i=0; i<len; ++i ) h = ( h ^ static_cast<unsigned char>( p[i] ) ) * 0x01000193u;
+        return ( h * 0x9e3779b1u ) >> ( 32 - BITS );
+    }
+
+    struct perfect_table {
+        uint32_t seed = 0;                  // 0 if no seed was found
+        uint8_t slot[SLOTS] = {};           // 1 + the index of the word in it, or 0
+    };
+
+    constexpr perfect_table build() {
+        for( uint32_t seed=1; seed<100000; ++seed ) {
+            perfect_table t;
+            t.seed = seed;
+            bool ok = true;
+            for( size_t i=0; ok && i<COUNT; ++i ) {
+                size_t s = slot_of( builtin[i].data(), builtin[i].size(), seed );
+                if ( t.slot[s] ) {
+                    ok = false;
+                } else {
+                    t.slot[s] = uint8_t( i + 1 );
+                }
+            }
+            if ( ok ) return t;
+        }
+        return perfect_table{};
+    }
+
+    inline constexpr perfect_table table = build();
+    static_assert( table.seed != 0, "no collision-free seed; the list has a duplicate, or wants more BITS" );
+
+    inline bool is_builtin( const char* w, size_t len ) {
+        if ( len > MAX_LEN ) return false;
+        unsigned i = table.slot[slot_of( w, len, table.seed )];
+        return i != 0 && builtin[i-1].size() == len && memcmp( builtin[i-1].data(), w, len ) == 0;
+    }
+}
+
+    // What the tokenizer leaves out, as set on the command line
+    class word_filter {
+        bool builtin;
+        size_t minlen;                      // In characters
+        std::vector<std::string> words;     // From files
+        std::vector<uint32_t> slots;        // 1 + an index into words, or 0
+        size_t mask;
+
+        static constexpr uint64_t SEED = 0x5851f42d4c957f2dULL;
+
+        bool listed( const char* w, size_t len ) const {
+            if ( words.empty() ) return false;
+            for( size_t i=hash_bytes( w, len, SEED ) & mask; slots[i] != 0; i=( i + 1 ) & mask ) {
+                const std::string& s = words[slots[i] - 1];
+                if ( s.size() == len && memcmp( s.data(), w, len ) == 0 ) return true;
+            }
+            return false;
+        }
+
+        // Characters rather than bytes, for UTF-8: every byte but the continuations
+        static size_t chars( const char* w, size_t len ) {
+            size_t n = 0;
+            for( size_t i=0; i<len; ++i ) n += ( static_cast<unsigned char>( w[i] ) & 0xc0 ) != 0x80;
+            return n;
+        }
+
+    public:
+        word_filter() : builtin(false), minlen(0), mask(0) {}
+
+        void use_builtin() { builtin = true; }
+        void set_min_len( size_t n ) { minlen = n; }
+
+        // Leave out the word [w, w+len), which should be as the tokenizer emits it
+        void add( const char* w, size_t len );
+
+        // Leave out the words in path, wherever they are in it, tokenized the way the
+        // text will be.  Returns false with errno set if it can't be read.
+        bool load( const std::string& path, bool utf8 );
+
+        // Whether it leaves out anything at all
+        bool empty() const { return !builtin && minlen == 0 && words.empty(); }
+
+        // The same for filters that leave out the same words, whatever order they were
+        // added in, and 0 for an empty one
+        uint64_t hash() const;
+
+        bool keeps( const char* w, size_t len ) const {
+            // A character is at most 4 bytes, so only short words need counting
+            if ( len < minlen || ( len < 4 * minlen && chars( w, len ) < minlen ) ) return false;
+            if ( builtin && stopwords::is_builtin( w, len ) ) return false;
+            return !listed( w, len );
+        }
+
+        std::string to_string() const;
+    };
+}
+
+#endif
@@ -2,28 +2,81 @@
 // A concurrent striped hash table
 // We use quadratic probing here, since it's fast and generally gives good performance
 //
+// Resizing is either stop-the-world (every stripe is locked while the whole table is
+// rehashed) or incremental: the old and new configs coexist, and every operation helps
+// move a bounded number of buckets across until the old one is drained.
+//
+// Operations hold an epoch guard (epoch.h) rather than a reference to the config they
+// are working in, so finding the current one is a plain acquire load.  Replaced configs
+// and removed entries are retired, and freed once nobody can still be looking at them.
+//
 
 #ifndef __STRIPED_HASH_H__
 #define __STRIPED_HASH_H__
 
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <random>
 #include <string>
+#include <string_view>
 #include <sstream>
+#include <thread>
 #include <utility> // For std::pair
 #include <vector> 
 
+#include "arena.h"
+#include "epoch.h"
+#include "hash.h"
+#include "numa.h"
+#include "stats.h"
+#include "topk.h"
+
 
 extern int debug;
 
-template <typename K>
+namespace kjp {
+    // How stripedhashcounter<K> holds its keys, and what lookups take.  By default a
+    // key is copied into its entry.  Strings are looked up by string_view, so a word
+    // can be counted straight out of the I/O buffer, and their bytes are copied into
+    // the table's arena only when the word is first inserted.
+    template <typename K>
+    struct key_storage {
+        typedef K stored;
+        typedef const K& lookup;
+
+        static const K& store( arena&, const K& key ) { return key; }
+    };
+
+    template <>
+    struct key_storage<std::string> {
+        typedef std::string_view stored;
+        typedef std::string_view lookup;
+
+        static std::string_view store( arena& a, std::string_view key ) {
+            char* p = static_cast<char*>( a.allocate( key.size(), 1 ) );
+            memcpy( p, key.data(), key.size() );
+            return std::string_view( p, key.size() );
+        }
+    };
+}
+
+// Hasher is called as Hasher()( key, seed ), with key a key_storage<K>::lookup or a
+// stored key, and must return 64 well-mixed bits; the low bits pick the slot
+template <typename K, typename Hasher = kjp::hash<K>>
 class stripedhashcounter {
 public:
     typedef std::pair<K,int> element;
+    typedef typename kjp::key_storage<K>::lookup key_type;
 private:
+    typedef typename kjp::key_storage<K>::stored stored_key;
+
     #ifdef HASH_DEFAULT_SIZE
     // Initial size of hash table
     static constexpr int DEFAULT_SIZE=HASH_DEFAULT_SIZE; 
@@ -37,73 +90,237 @@ private:
     static constexpr int DEFAULT_MC=8;
     #endif
 
-    element sentinel;                // Value of this guy doesn't matter, just his address...
+    // Whether -d can log from inside the table at all.  Off in release builds, so the
+    // probe loops carry no logging code and no load of debug.
+    #ifdef HASH_TRACE
+    static constexpr bool TRACE=HASH_TRACE;
+    #elif defined(NDEBUG)
+    static constexpr bool TRACE=false;
+    #else
+    static constexpr bool TRACE=true;
+    #endif
+
+    #ifdef HASH_MIGRATE_CHUNK
+    static constexpr int MIGRATE_CHUNK=HASH_MIGRATE_CHUNK;
+    #else
+    static constexpr int MIGRATE_CHUNK=64;           // Buckets moved per operation during a resize
+    #endif
+
+    // What the table actually stores.  The count is atomic so that incrementing a key
+    // which is already present does not need a lock; the key never changes once the
+    // entry has been published.
+    struct entry {
+        stored_key first;
+        std::atomic<int> second;
+
+        entry() : second(0) {}
+        entry( const stored_key& k, int v ) : first(k), second(v) {}
+    };
+
+    entry sentinel;                  // Value of this guy doesn't matter, just his address...
 
     class config {
     public:
-        std::vector<element*> table;
-        std::vector<element*> deleted;
+        std::vector<std::atomic<entry*>> table;
         std::vector<std::mutex> locks;
-        int ha, hb, hp;
-        bool resizing;
-
-        config( int sz, std::default_random_engine g ) : table(sz, nullptr), locks( sqrt(sz) + 1), resizing(false) {
-            std::uniform_int_distribution<int> dist(1,sz-1);
-            ha = dist(g);
-            hp = 2 * sz + 1;
-        }
-
-        ~config() {
-            for( auto it = deleted.begin(); it != deleted.end(); ++it ) {
-                delete *it;
-                *it = nullptr;
-            }
+        uint64_t seed;                   // Drawn at random for each config
+        size_t mask;                     // table.size() - 1; the size is a power of two
+        std::atomic<bool> resizing;      // Set once this config has been replaced
+
+        // Incremental resizing: the config being drained into this one, the next of its
+        // buckets to claim, and how many have been moved so far.
+        std::atomic<config*> prev;
+        std::atomic<size_t> migrate_next, migrated;
+        // Migrated entries may land further out than maxcollisions; lookups probe this far
+        std::atomic<int> probe_limit;
+
+        config( size_t sz, int mc, std::mt19937_64& g ) : table(sz), locks( sqrt(sz) + 1), resizing(false),
+            prev(nullptr), migrate_next(0), migrated(0), probe_limit(mc) {
+            seed = g();
+            mask = sz - 1;
         }
 
-        std::string to_string(const element* sentinel) const {
+        std::string to_string(const entry* sentinel) const {
             std::ostringstream os;
             for( unsigned i=0; i<table.size(); ++i ) {
-                if ( table.at(i) && table.at(i) != sentinel ) {
+                entry* e = table[i].load();
+                if ( e && e != sentinel ) {
                     os << i << "    ";
-                    os << table.at(i)->first << ":" << table.at(i)->second << " :: ";
+                    os << e->first << ":" << e->second.load() << " :: ";
                     os << std::endl;
                 } 
             }
             return os.str();
         }
-        int nelem(const element* sentinel) const {
+        int nelem(const entry* sentinel) const {
             int i=0;
-            for( auto it : table ) {
-                if ( it != nullptr && it != sentinel ) ++i;
+            for( auto& it : table ) {
+                entry* e = it.load();
+                if ( e != nullptr && e != sentinel ) ++i;
             }
             return i;
         }
     };
 
 
-    std::shared_ptr<config> cfg, oldcfg;
+    std::atomic<config*> cfg;
+    kjp::arena keys;                 // Key bytes, for key types that keep them out of line
+
+    // With a home node, every config's slots are bound to it, and the entries come from
+    // an arena bound to it rather than from whichever thread's malloc inserted them.
+    // Removed entries then stay in the arena until the table goes.
+    int home;
+    kjp::arena entries;
+
+    config* new_config( size_t sz ) {
+        config* c = new config( sz, maxcollisions, generator );
+        if ( home >= 0 ) kjp::bind_memory( c->table.data(), c->table.size() * sizeof( c->table[0] ), home );
+        return c;
+    }
+
+    entry* new_entry( key_type key, int delta ) {
+        stored_key k = kjp::key_storage<K>::store( keys, key );
+        if ( home < 0 ) return new entry( k, delta );
+        return new( entries.allocate( sizeof( entry ), alignof( entry ) ) ) entry( k, delta );
+    }
+
+    void free_entry( entry* e ) {
+        if ( home < 0 ) {
+            delete e;
+        } else {
+            e->~entry();
+        }
+    }
 
     int maxcollisions;
-    std::default_random_engine generator;
-    int hash_func( const K&, int ha, int hp ) const;
+    bool incremental;
+
+    // Time spent by operations that were held up by a resize
+    std::atomic<long> nresizes, npauses, pause_total_ns, pause_max_ns;
+
+    void record_pause( std::chrono::steady_clock::time_point start ) {
+        long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start ).count();
+        npauses.fetch_add( 1, std::memory_order_relaxed );
+        pause_total_ns.fetch_add( ns, std::memory_order_relaxed );
+        long m = pause_max_ns.load( std::memory_order_relaxed );
+        while( ns > m && !pause_max_ns.compare_exchange_weak( m, ns ) ) {}
+    }
+    std::mt19937_64 generator;
+
+    // Of a key being looked up or one already stored, which needn't be the same type
+    template <typename Key>
+    uint64_t hash_func( const Key& key, const config* c ) const {
+        return Hasher()( key, c->seed );
+    }
+
+    // The i'th slot of the probe sequence starting at base.
+    // Every operation (including resize_helper) must agree on this.
+    // Triangular offsets visit every slot when size is a power of two, which
+    // incremental resizing relies on to always find a home for a migrated entry.
+    static size_t probe( uint64_t base, size_t i, size_t mask ) {
+        return (base + i * (i + 1) / 2) & mask;
+    }
+
+    // How far lookups need to probe in this config
+    int probe_limit( const config* c ) const {
+        int l = c->probe_limit.load( std::memory_order_acquire );
+        return l > maxcollisions ? l : maxcollisions;
+    }
+
+    // Lock-free lookup of key in c; adds the number of slots looked at to probes
+    entry* find( const config* c, key_type key, int& probes ) const {
+        uint64_t base = hash_func( key, c );
+        size_t mask = c->mask;
+        int limit = probe_limit( c );
+        for( int i=0; i<limit; ++i ) {
+            entry *e = c->table[probe( base, i, mask )].load( std::memory_order_acquire );
+            ++probes;
+            if ( e == nullptr ) return nullptr;
+            if ( e != &sentinel && e->first == key ) return e;
+        }
+        return nullptr;
+    }
+    entry* find( const config* c, key_type key ) const {
+        int probes = 0;
+        return find( c, key, probes );
+    }
+
+    // Move entry e (from current->prev) into current.  Nobody else can be placing
+    // the same key, since new keys only go into current if prev doesn't have them.
+    void migrate_entry( config* current, entry* e ) {
+        uint64_t base = hash_func( e->first, current );
+        size_t mask = current->mask;
+        for( size_t i=0; i<=mask; ++i ) {
+            size_t slot = probe( base, i, mask );
+            size_t stripe = slot % current->locks.size();
+            kjp::stats::stripe_guard lg( current->locks[stripe], stripe );
+            entry* s = current->table[slot].load( std::memory_order_relaxed );
+            if ( s != nullptr && s != &sentinel ) continue;
+
+            // Publish the new limit before the entry, so that anyone who can see the
+            // entry here without also finding it in prev will probe far enough.
+            int l = current->probe_limit.load();
+            while( (int)i + 1 > l && !current->probe_limit.compare_exchange_weak( l, i + 1 ) ) {}
+            current->table[slot].store( e, std::memory_order_release );
+            return;
+        }
+        // Can't happen: the probe sequence covers the table and it is at most half full
+        std::cerr << "stripedhashcounter: no free slot while migrating" << std::endl;
+        std::abort();
+    }
 
-    std::shared_ptr<config> resize_helper( std::shared_ptr<config> current, int newsz ) {
-        std::shared_ptr<config> newcfg = std::make_shared<config>(newsz, generator);
+    // Claim and move up to n buckets from current->prev.  Returns false once
+    // there is nothing left to claim.
+    bool help_migrate( config* current, config* prev, size_t n ) {
+        size_t size = prev->table.size();
+        size_t start = prev->migrate_next.fetch_add( n );
+        if ( start >= size ) return false;
+        size_t end = start + n < size ? start + n : size;
+
+        for( size_t b=start; b<end; ++b ) {
+            entry* e = prev->table[b].load( std::memory_order_acquire );
+            if ( e == nullptr || e == &sentinel ) continue;
+            migrate_entry( current, e );
+        }
+        if ( prev->migrated.fetch_add( end - start ) + ( end - start ) == size ) {
+            TRACE && debug && std::cout << "Migration to " << current->table.size() << " slots complete" << std::endl;
+            current->prev.store( nullptr );
+            kjp::epoch::retire( prev );
+        }
+        return true;
+    }
+
+    // Help until current has no prev left
+    void finish_migration( config* current ) {
+        config* prev;
+        while( ( prev = current->prev.load( std::memory_order_acquire ) ) != nullptr ) {
+            if ( !help_migrate( current, prev, MIGRATE_CHUNK ) ) {
+                // Everything is claimed; wait for the stragglers
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // A copy of current with newsz slots, or nullptr if some key collides too often
+    config* resize_helper( const config* current, int newsz ) {
+        std::unique_ptr<config> newcfg( new_config( newsz ) );
 
-        debug && std::cout << "Resize helper.  New size = " << newsz << std::endl;
+        TRACE && debug && std::cout << "Resize helper.  New size = " << newsz << std::endl;
 
         // Since this newcfg is private to our thread (for now),
         // we don't need to worry about locking anything when we insert
-        for( auto it : current->table ) {
+        for( auto& slotp : current->table ) {
+            entry* it = slotp.load( std::memory_order_relaxed );
             if ( it == nullptr || it == &sentinel ) continue;
-            int slot = hash_func( it->first, newcfg->ha, newcfg->hp );
+            uint64_t base = hash_func( it->first, newcfg.get() );
             int i;
             for( i=0; i<maxcollisions; ++i ) {
-                slot = (slot + (i * i)) % newcfg->table.size();
+                size_t slot = probe( base, i, newcfg->mask );
                 // Only need to check for nullptr here
                 // There is no chance that someone deleted an entry.
-                if ( newcfg->table[slot] == nullptr ) {
-                    newcfg->table[slot] = it;
+                if ( newcfg->table[slot].load( std::memory_order_relaxed ) == nullptr ) {
+                    newcfg->table[slot].store( it, std::memory_order_relaxed );
                     break;
                 } 
             }
@@ -112,20 +329,54 @@ private:
                 return nullptr;
             }
         }
-        if ( debug ) {
+        if ( TRACE && debug ) {
             std::cout << "Size of old table: " << current->nelem(&sentinel) << std::endl;
             std::cout << "Size of new table: " << newcfg->nelem(&sentinel) << std::endl;
         }
-        return newcfg;
+        return newcfg.release();
     };
 
-    void resize( std::shared_ptr<config> old ) {
-        std::shared_ptr<config> current = old;
+    void resize( config* old ) {
+        if ( incremental ) {
+            resize_incremental( old );
+        } else {
+            resize_stw( old );
+        }
+    }
+
+    // Start moving old into a table twice its size.  All we hold the locks for is the
+    // switch-over itself; the buckets are moved by help_migrate() as operations go by.
+    void resize_incremental( config* old ) {
+        if ( old->resizing ) return;
+
+        // Only one migration at a time: old must be complete before it can be drained
+        finish_migration( old );
+        // Whatever the last resize retired is most likely safe to free by now, and
+        // better freed before the new table is allocated than after
+        kjp::epoch::poll();
+
+        std::vector<std::unique_lock<std::mutex>> lgs;
+        for( unsigned i=0; i<old->locks.size(); ++i ) {
+            lgs.emplace_back( old->locks[i] );
+        }
+        if ( old->resizing ) return;
+
+        config* newcfg = new_config( old->table.size() * 2 );
+        newcfg->prev.store( old, std::memory_order_relaxed );
+        old->resizing = true;
+        nresizes.fetch_add( 1 );
+        cfg.store( newcfg, std::memory_order_release );
+        TRACE && debug && std::cout << "Started migrating " << old->table.size() << " slots to " << newcfg->table.size() << std::endl;
+    }
+
+    void resize_stw( config* old ) {
+        config* current = old;
         int newsz = old->table.size();
         
         // Check to see if someone is resizing...
         // Someone already 
         if ( old->resizing ) return;
+        kjp::epoch::poll();
 
         // Need to use unique_lock here, because they are move-assignable.
         // lock_guards are not.
@@ -134,35 +385,89 @@ private:
             lgs.emplace_back( current->locks[i] );
         }
         if ( old->resizing ) return;
-        std::shared_ptr<config> newcfg;
+        config* newcfg;
       
         do {
             newsz *= 2;
             newcfg = resize_helper( old, newsz );
         } while( newcfg == nullptr );
        
-        oldcfg = old;
-        cfg = newcfg;
-        if ( debug ) {
+        // Anyone who was waiting on one of our locks must not touch the old table,
+        // so mark it before letting go.  The new table is published with a release
+        // store, so its slots are visible to whoever loads it.  The old one goes once
+        // the last of those who had already loaded it is done.
+        old->resizing = true;
+        nresizes.fetch_add( 1 );
+        cfg.store( newcfg, std::memory_order_release );
+        if ( TRACE && debug ) {
             std::cout << "<<< In resize() " << std::endl;
-            std::cout << "Size of old table: " << oldcfg->nelem(&sentinel) << std::endl;
-            std::cout << "Size of new table: " << cfg->nelem(&sentinel) << std::endl;
+            std::cout << "Size of old table: " << old->nelem(&sentinel) << std::endl;
+            std::cout << "Size of new table: " << cfg.load()->nelem(&sentinel) << std::endl;
 
             std::cout << "==== OLD ====" << std::endl;
-            std::cout << oldcfg->to_string(&sentinel) << std::endl;
+            std::cout << old->to_string(&sentinel) << std::endl;
 
             std::cout << "==== NEW ====" << std::endl;
             std::cout << newcfg->to_string(&sentinel) << std::endl;
 
             std::cout << "==== CURRENT ====" << std::endl;
-            std::cout << cfg->to_string(&sentinel) << std::endl;
+            std::cout << cfg.load()->to_string(&sentinel) << std::endl;
         }
+        kjp::epoch::retire( old );
     };
 public:
-    stripedhashcounter( int size=DEFAULT_SIZE, int mc=DEFAULT_MC ) :
-        oldcfg(nullptr), maxcollisions(mc) {
+    struct resize_stats {
+        long resizes;       // Number of times the table grew
+        long pauses;        // Operations that had to resize or help migrate
+        long total_ns;      // Time those operations spent on it
+        long max_ns;        // The longest single pause
+    };
+
+    stripedhashcounter( int size=DEFAULT_SIZE, int mc=DEFAULT_MC, bool incr=true ) :
+        home(-1), maxcollisions(mc), incremental(incr), nresizes(0), npauses(0), pause_total_ns(0), pause_max_ns(0) {
         generator.seed( std::chrono::system_clock::now().time_since_epoch().count() );
-        cfg = std::make_shared<config>( size, generator );
+        // Keep the size a power of two; see probe()
+        int sz = 1;
+        while( sz < size ) sz *= 2;
+        cfg.store( new_config( sz ) );
+    }
+
+    // The entries belong to whichever config holds them once migration is done, apart
+    // from removed ones, which have been retired
+    ~stripedhashcounter() {
+        config* current = cfg.load();
+        {
+            kjp::epoch::guard g;
+            finish_migration( current );
+        }
+        for( auto& slotp : current->table ) {
+            entry* e = slotp.load( std::memory_order_relaxed );
+            if ( e != nullptr && e != &sentinel ) free_entry( e );
+        }
+        delete current;
+        kjp::epoch::collect();
+    }
+    stripedhashcounter( const stripedhashcounter& ) = delete;
+    stripedhashcounter& operator=( const stripedhashcounter& ) = delete;
+
+    // Keep the table's memory on node (a sysfs node number) from now on, and move what
+    // it has already.  Meant to be called before the table is shared.  Returns false
+    // with errno set if the slots couldn't be moved.
+    bool set_home_node( int node ) {
+        home = node;
+        keys.set_home_node( node );
+        entries.set_home_node( node );
+        config* c = cfg.load();
+        return kjp::bind_memory( c->table.data(), c->table.size() * sizeof( c->table[0] ), node );
+    }
+
+    // Choose between incremental and stop-the-world resizing.
+    // Only call this while nobody else is using the table.
+    void set_incremental_resize( bool incr ) { incremental = incr; }
+    bool incremental_resize() const { return incremental; }
+
+    resize_stats get_resize_stats() const {
+        return resize_stats{ nresizes.load(), npauses.load(), pause_total_ns.load(), pause_max_ns.load() };
     }
 
     // Contains method:
@@ -170,141 +475,160 @@ public:
     //     count of key's occurrences.  
     //     As this is a concurrent data structure, this value returns a value that is correct at some
     //     point during its execution.
-    int contains( const K& key ) const {
-        std::shared_ptr<config> current = cfg;
-
-        int slot = hash_func( key, current->ha, current->hp );
-        for( int i=0; i<maxcollisions; ++i ) {
-            slot = (slot + i * i) % current->table.size();
-            element *e = current->table.at(slot);
-            if ( e == nullptr ) return 0;
-            if ( e->first == key ) {
-                return e->second.load();
-            }
+    int contains( key_type key ) const {
+        kjp::epoch::guard g;
+        const config* current = cfg.load( std::memory_order_acquire );
+
+        entry *e = find( current, key );
+        if ( e == nullptr ) {
+            // Might not have been migrated yet
+            const config* prev = current->prev.load( std::memory_order_acquire );
+            if ( prev ) e = find( prev, key );
         }
-        return 0;
+        return e ? e->second.load() : 0;
     }
 
-    int insert( const K& key ) {
+    int insert( key_type key ) { return insert_n( key, 1 ); }
+
+    // Add delta occurrences of key, returning the new count.
+    // Used to merge per-thread pre-aggregated counts in a single operation.
+    int insert_n( key_type key, int delta ) {
         // Repeat forever.
         // In the event of concurrent resizings we may need to try over and over
+        kjp::epoch::guard g;
         retry:
         while( true ) {
-            std::shared_ptr<config> current = cfg;
-            int base = hash_func( key, current->ha, current->hp );
+            config* current = cfg.load( std::memory_order_acquire );
+            config* prev = current->prev.load( std::memory_order_acquire );
+            if ( prev ) {
+                // Once every bucket is claimed, wait for the last ones to land rather
+                // than take the free slots they may need
+                auto start = std::chrono::steady_clock::now();
+                if ( !help_migrate( current, prev, MIGRATE_CHUNK ) ) finish_migration( current );
+                record_pause( start );
+            }
+            uint64_t base = hash_func( key, current );
+            size_t mask = current->mask;
+
+            // Fast path: if the key is already present, just bump its count.
+            // No lock is needed, even if a resize is under way: a resize moves the
+            // pointers to entries between tables, never the entries themselves.
+            // While a migration is running the key may still only be in prev.
+            int probes = 0;
+            entry *e = find( current, key, probes );
+            if ( e == nullptr && prev ) e = find( prev, key, probes );
+            if ( e != nullptr ) {
+                kjp::stats::probe( probes );
+                return e->second.fetch_add( delta ) + delta;
+            }
+
+            // Slow path: we (probably) need a new slot, which requires the stripe lock
             for( int i=0; i<maxcollisions; ++i ) {
                 // Use quadratic probing here.  This is easy to implement and generally
                 // gives a good spread among the slots
-                int slot = (base + i * i) % current->table.size();
-                std::lock_guard<std::mutex> lg( current->locks[slot % current->locks.size()] );
+                int slot = probe( base, i, mask );
+                size_t stripe = slot % current->locks.size();
+                kjp::stats::stripe_guard lg( current->locks[stripe], stripe );
                 // Check if the table is getting resized...
                 // Use goto here because we need to break out of two loops.
                 if ( current->resizing ) goto retry;
-                element *e = current->table.at(slot);
+                entry *e = current->table[slot].load( std::memory_order_relaxed );
 
                 // Is the slot free?
                 if ( e == nullptr || e == &sentinel ) {
-                    debug && std::cout << "Inserting [" << key << "] at slot " << slot << std::endl;;
-                    current->table.at( slot ) = new element( key, 1 );
-                    return 1;
+                    TRACE && debug && std::cout << "Inserting [" << key << "] at slot " << slot << std::endl;;
+                    current->table[slot].store( new_entry( key, delta ), std::memory_order_release );
+                    kjp::stats::probe( probes + i + 1 );
+                    return delta;
                 } 
 
-                // Does it match our key?  If so, go ahead and increment
+                // Does it match our key?  Someone beat us to it, so go ahead and increment
                 if ( e->first == key ) {
-                    debug && std::cout << "Found [" << key << "] at slot " << slot << ".  Incrementing from " << e->second << " to " << (e->second + 1) << std::endl;
-                    e->second += 1;
-                    return e->second;
+                    int n = e->second.fetch_add( delta ) + delta;
+                    kjp::stats::probe( probes + i + 1 );
+                    TRACE && debug && std::cout << "Found [" << key << "] at slot " << slot << ".  Incremented to " << n << std::endl;
+                    return n;
                 }
 
-                debug && std::cout << "Collision for [" << key << "] at slot " << slot << ".  (Found: " << e->first << ")" << std::endl;
+                TRACE && debug && std::cout << "Collision for [" << key << "] at slot " << slot << ".  (Found: " << e->first << ")" << std::endl;
               
             }
             // We got maxcollisions collisions, resize the table
-            resize(cfg);
-            debug && std::cout << "Had to resize for [" << key << "] will re-attempt." << std::endl;
+            auto start = std::chrono::steady_clock::now();
+            resize(current);
+            record_pause( start );
+            TRACE && debug && std::cout << "Had to resize for [" << key << "] will re-attempt." << std::endl;
         }
         return true;
     }
 
-    int remove( const K& key ) {
+    int remove( key_type key ) {
+        kjp::epoch::guard g;
         retry:
         while( true ) {
-            std::shared_ptr<config> current = cfg;
-            int base = hash_func( key, current->ha, current->hp );
-            for( int i=0; i<maxcollisions; ++i ) {
-                int slot = (base + i * i) % current->table.size();
-                std::lock_guard<std::mutex> lg( current->locks[slot % current->locks.size()] );
+            config* current = cfg.load( std::memory_order_acquire );
+            // Removing from a table that is still being drained is more trouble
+            // than it's worth; just finish the job first.
+            finish_migration( current );
+            uint64_t base = hash_func( key, current );
+            int limit = probe_limit( current );
+            for( int i=0; i<limit; ++i ) {
+                size_t slot = probe( base, i, current->mask );
+                size_t stripe = slot % current->locks.size();
+                kjp::stats::stripe_guard lg( current->locks[stripe], stripe );
                 if ( current->resizing ) goto retry;
-                element *e = current->table.at(slot);
+                entry *e = current->table[slot].load( std::memory_order_relaxed );
 
                 // Is the slot free?
-                if ( e == nullptr || e == &sentinel ) {
+                if ( e == nullptr ) {
                     return 0;
                 }
 
-                // Does it match our key?  If so, replace with the deleted sentinel value
-                if ( e->first == key ) {
-                    current->table.at( slot ) = &sentinel;
-                    current->deleted.push_back( e );        // And add to the list to be garbage collected
-                    return e->second;
+                // Does it match our key?  If so, replace with the deleted sentinel value.
+                // An increment racing with us on the lock-free path may be lost.
+                // Whoever is still incrementing it has it pinned, so it stays readable.
+                if ( e != &sentinel && e->first == key ) {
+                    current->table[slot].store( &sentinel, std::memory_order_release );
+                    int n = e->second.load();
+                    if ( home < 0 ) kjp::epoch::retire( e );
+                    return n;
                 }
   
             }
+            return 0;
         }
 
         return 0;
     }
 
-    int increment( const K& key ) { return insert(key); }
+    int increment( key_type key ) { return insert(key); }
 
-    std::vector<element>& extract_top( int count ) {
-        std::vector<element> *heap = new std::vector<element>{ count, sentinel };
+    // The count most frequent keys (all of them if count is 0), most frequent first,
+    // scanning the table with up to nthreads threads.  Meant to be called once the
+    // inserters are done.
+    std::vector<element> extract_top( int count, int nthreads=1 ) {
         std::vector<std::unique_lock<std::mutex>> lgs;
-        std::shared_ptr<config> current = cfg;
+        kjp::epoch::guard g;
+        config* current = cfg.load( std::memory_order_acquire );
+        finish_migration( current );
 
         // Need exclusive access...
         for( unsigned i=0; i<current->locks.size(); ++i ) {
             lgs.emplace_back( current->locks[i] );
         }
 
-        for( auto it : current->table ) {
-            if ( it == nullptr || it == &sentinel ||
-                 it->second < heap->front().second ||
-                 (it->second == heap->front().second &&
-                  it->first > heap->front().first) ) continue;
-            std::pop_heap( heap->begin(), heap->end(), 
-                           []( const element& e1, const element& e2 ) {
-                               return ( e1.second > e2.second ) || ( e1.second == e2.second && e1.first < e2.first);
-                           });
-            heap->pop_back();
-       
-            heap->push_back( *it );
-            std::push_heap( heap->begin(), heap->end(), 
-                            []( const element& e1, const element& e2 ) {
-                               return ( e1.second > e2.second ) || ( e1.second == e2.second && e1.first < e2.first);
-                            });
-        } 
-        std::sort( heap->begin(), heap->end(), 
-                   [](const element& a, const element& b) { 
-                       if ( a.second == b.second ) return a.first < b.first;
-                       return a.second > b.second; 
-                   } 
-                 );
-        return *heap;
-
+        const config* c = current;
+        return kjp::parallel_top<element>( c->table.size(), count, nthreads,
+            [this, c]( size_t lo, size_t hi, kjp::topk_heap<element>& heap ) {
+                for( size_t i=lo; i<hi; ++i ) {
+                    entry* it = c->table[i].load();
+                    if ( it == nullptr || it == &sentinel ) continue;
+                    int n = it->second.load();
+                    if ( n <= 0 || heap.rejects( n ) ) continue;
+                    heap.offer( element( K( it->first ), n ) );
+                }
+            } );
     }
 };
 
-template <>
-int stripedhashcounter<int>::hash_func( const int& i, int ha, int hp ) const {
-    return ha * i % hp;
-}
-template <>
-int stripedhashcounter<std::string>::hash_func( const std::string& s, int ha, int hp ) const {
-    int ret = 0;
-    for ( const auto it : s ) {
-        ret = ( ret * ha + it ) % hp;
-    }
-    return ret;
-}
 #endif
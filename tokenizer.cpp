@@ -0,0 +1,408 @@
+//
+// Byte classifiers for the word tokenizer
+//
+
+#include "tokenizer.h"
+#include "unicode_tables.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <immintrin.h>
+
+namespace kjp {
+
+namespace {
+
+    struct byte_tables {
+        char lower[256];
+        bool word[256];
+
+        byte_tables() {
+            for( int c=0; c<256; ++c ) {
+                lower[c] = ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+                word[c] = ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ||
+                          ( c >= '0' && c <= '9' );
+            }
+        }
+    };
+    const byte_tables tables;
+
+    // Handles any length, but the first byte must start a new 64-bit mask word
+    void classify_scalar( const char* in, char* out, size_t n, uint64_t* masks ) {
+        for( size_t i=0; i<n; i+=64 ) {
+            size_t lim = n - i < 64 ? n - i : 64;
+            uint64_t m = 0;
+            for( size_t j=0; j<lim; ++j ) {
+                unsigned char c = in[i+j];
+                out[i+j] = tables.lower[c];
+                m |= uint64_t( tables.word[c] ) << j;
+            }
+            masks[i/64] = m;
+        }
+    }
+
+    // x in [lo,hi], computed with signed compares since SSE2 lacks unsigned ones
+    inline __m128i in_range128( __m128i x, char lo, char hi ) {
+        __m128i s = _mm_add_epi8( x, _mm_set1_epi8( char( 128 - lo ) ) );
+        return _mm_cmplt_epi8( s, _mm_set1_epi8( char( -128 + ( hi - lo ) + 1 ) ) );
+    }
+
+    inline uint64_t classify16( const char* in, char* out ) {
+        __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( in ) );
+        __m128i upper = in_range128( v, 'A', 'Z' );
+        __m128i word = _mm_or_si128( _mm_or_si128( upper, in_range128( v, 'a', 'z' ) ),
+                                     in_range128( v, '0', '9' ) );
+        v = _mm_or_si128( v, _mm_and_si128( upper, _mm_set1_epi8( 0x20 ) ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), v );
+        return uint32_t( _mm_movemask_epi8( word ) );
+    }
+
+    void classify_sse2( const char* in, char* out, size_t n, uint64_t* masks ) {
+        size_t i = 0;
+        for( ; i + 64 <= n; i += 64 ) {
+            masks[i/64] = classify16( in + i,      out + i      )       |
+                          classify16( in + i + 16, out + i + 16 ) << 16 |
+                          classify16( in + i + 32, out + i + 32 ) << 32 |
+                          classify16( in + i + 48, out + i + 48 ) << 48;
+        }
+        if ( i < n ) classify_scalar( in + i, out + i, n - i, masks + i/64 );
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256i in_range256( __m256i x, char lo, char hi ) {
+        __m256i s = _mm256_add_epi8( x, _mm256_set1_epi8( char( 128 - lo ) ) );
+        return _mm256_cmpgt_epi8( _mm256_set1_epi8( char( -128 + ( hi - lo ) + 1 ) ), s );
+    }
+
+    __attribute__((target("avx2")))
+    inline uint64_t classify32( const char* in, char* out ) {
+        __m256i v = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( in ) );
+        __m256i upper = in_range256( v, 'A', 'Z' );
+        __m256i word = _mm256_or_si256( _mm256_or_si256( upper, in_range256( v, 'a', 'z' ) ),
+                                        in_range256( v, '0', '9' ) );
+        v = _mm256_or_si256( v, _mm256_and_si256( upper, _mm256_set1_epi8( 0x20 ) ) );
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>( out ), v );
+        return uint32_t( _mm256_movemask_epi8( word ) );
+    }
+
+    __attribute__((target("avx2")))
+    void classify_avx2( const char* in, char* out, size_t n, uint64_t* masks ) {
+        size_t i = 0;
+        for( ; i + 64 <= n; i += 64 ) {
+            masks[i/64] = classify32( in + i, out + i ) | classify32( in + i + 32, out + i + 32 ) << 32;
+        }
+        if ( i < n ) classify_scalar( in + i, out + i, n - i, masks + i/64 );
+    }
+
+    bool lookup_word( uint32_t cp ) {
+        const unicode::range* r = std::upper_bound( std::begin( unicode::word_ranges ), std::end( unicode::word_ranges ), cp,
+            []( uint32_t c, const unicode::range& x ) { return c < x.first; } );
+        return r != std::begin( unicode::word_ranges ) && cp <= r[-1].last;
+    }
+
+    uint32_t lookup_fold( uint32_t cp ) {
+        const unicode::fold_run* r = std::upper_bound( std::begin( unicode::fold_runs ), std::end( unicode::fold_runs ), cp,
+            []( uint32_t c, const unicode::fold_run& x ) { return c < x.first; } );
+        if ( r == std::begin( unicode::fold_runs ) ) return cp;
+        --r;
+        return cp <= r->last && ( cp - r->first ) % r->stride == 0 ? cp + r->delta : cp;
+    }
+
+    // The Basic Multilingual Plane, where nearly all text is, is looked up in tables
+    // rather than searched.  They go by pages of 256 code points: most pages are all
+    // word characters or none, and most fold nothing, so the pages are shared.  The
+    // two-byte characters (U+0080 to U+07FF: Latin, Greek, Cyrillic, Armenian, Hebrew,
+    // Arabic...) have a flat table of their own, for the fast path in mark_char().
+    constexpr uint32_t CACHED = 0x10000;
+    constexpr uint32_t TWO_BYTE = 0x800;
+    constexpr uint32_t WORD_FLAG = 0x80000000;
+    struct unicode_cache {
+        typedef std::array<uint64_t, 4> word_page;
+        typedef std::array<int32_t, 256> fold_page;
+
+        uint32_t two_byte[TWO_BYTE];            // Folding, | WORD_FLAG for word characters
+        uint16_t word_index[CACHED / 256];
+        uint16_t fold_index[CACHED / 256];
+        std::vector<word_page> words;
+        std::vector<fold_page> folds;           // The first folds nothing
+
+        template <typename T>
+        static uint16_t intern( std::vector<T>& pages, const T& page ) {
+            auto it = std::find( pages.begin(), pages.end(), page );
+            if ( it != pages.end() ) return it - pages.begin();
+            pages.push_back( page );
+            return pages.size() - 1;
+        }
+
+        unicode_cache() {
+            folds.push_back( fold_page() );
+            for( uint32_t p=0; p<CACHED / 256; ++p ) {
+                word_page w = {};
+                fold_page f = {};
+                for( uint32_t k=0; k<256; ++k ) {
+                    uint32_t cp = p * 256 + k;
+                    bool word = cp < 0x80 ? tables.word[cp] : lookup_word( cp );
+                    uint32_t fold = cp < 0x80 ? static_cast<unsigned char>( tables.lower[cp] ) : lookup_fold( cp );
+                    if ( word ) w[k / 64] |= 1ULL << ( k % 64 );
+                    f[k] = int32_t( fold - cp );
+                }
+                word_index[p] = intern( words, w );
+                fold_index[p] = intern( folds, f );
+            }
+            for( uint32_t cp=0; cp<TWO_BYTE; ++cp ) {
+                two_byte[cp] = fold( cp ) | ( word( cp ) ? WORD_FLAG : 0 );
+            }
+        }
+
+        bool word( uint32_t cp ) const {
+            return ( words[word_index[cp >> 8]][( cp & 0xff ) / 64] >> ( cp % 64 ) ) & 1;
+        }
+        uint32_t fold( uint32_t cp ) const {
+            return cp + folds[fold_index[cp >> 8]][cp & 0xff];
+        }
+    };
+    const unicode_cache ucache;
+
+    // Decode the character at s, with avail bytes to go.  Returns its length, or 0
+    // if it is malformed: overlong, a surrogate, out of range or cut short.
+    inline size_t decode( const unsigned char* s, size_t avail, uint32_t& cp ) {
+        unsigned char c = s[0];
+        size_t len;
+        uint32_t least;
+        if ( c < 0x80 ) {
+            cp = c;
+            return 1;
+        } else if ( c >= 0xc2 && c < 0xe0 ) {
+            len = 2; cp = c & 0x1f; least = 0x80;
+        } else if ( c >= 0xe0 && c < 0xf0 ) {
+            len = 3; cp = c & 0x0f; least = 0x800;
+        } else if ( c >= 0xf0 && c < 0xf5 ) {
+            len = 4; cp = c & 0x07; least = 0x10000;
+        } else {
+            return 0;
+        }
+        if ( avail < len ) return 0;
+        for( size_t k=1; k<len; ++k ) {
+            if ( ( s[k] & 0xc0 ) != 0x80 ) return 0;
+            cp = cp << 6 | ( s[k] & 0x3f );
+        }
+        if ( cp < least || cp > 0x10ffff || ( cp >= 0xd800 && cp < 0xe000 ) ) return 0;
+        return len;
+    }
+
+    inline size_t encoded_length( uint32_t cp ) {
+        return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    }
+
+    // Write cp's encoding, of len bytes, at out
+    inline void encode( uint32_t cp, size_t len, char* out ) {
+        switch( len ) {
+        case 1:
+            out[0] = char( cp );
+            break;
+        case 2:
+            out[0] = char( 0xc0 | cp >> 6 );
+            out[1] = char( 0x80 | ( cp & 0x3f ) );
+            break;
+        case 3:
+            out[0] = char( 0xe0 | cp >> 12 );
+            out[1] = char( 0x80 | ( ( cp >> 6 ) & 0x3f ) );
+            out[2] = char( 0x80 | ( cp & 0x3f ) );
+            break;
+        default:
+            out[0] = char( 0xf0 | cp >> 18 );
+            out[1] = char( 0x80 | ( ( cp >> 12 ) & 0x3f ) );
+            out[2] = char( 0x80 | ( ( cp >> 6 ) & 0x3f ) );
+            out[3] = char( 0x80 | ( cp & 0x3f ) );
+        }
+    }
+
+    // If the character at s[i] is a non-ASCII word character, mark it and fold it into
+    // out[i], or set refold if its folding is a different length.  Returns where the
+    // next character starts.
+    inline size_t mark_char( const unsigned char* s, char* out, size_t i, size_t n, uint64_t* masks, bool& refold ) {
+        unsigned char c = s[i];
+        if ( c < 0x80 ) return i + 1;
+        if ( c >= 0xc2 && c < 0xe0 && i + 1 < n && ( s[i+1] & 0xc0 ) == 0x80 ) {
+            // Two bytes, the most common case by far: straight out of the cache
+            uint32_t cp = ( c & 0x1f ) << 6 | ( s[i+1] & 0x3f );
+            uint32_t e = ucache.two_byte[cp];
+            if ( e & WORD_FLAG ) {
+                if ( i % 64 != 63 ) {
+                    masks[i / 64] |= 3ULL << ( i % 64 );
+                } else {
+                    masks[i / 64] |= 1ULL << 63;
+                    masks[i / 64 + 1] |= 1;
+                }
+                uint32_t f = e & ~WORD_FLAG;
+                if ( f >= 0x80 && f < 0x800 ) {
+                    encode( f, 2, out + i );
+                } else {
+                    refold = true;
+                }
+            }
+            return i + 2;
+        }
+        uint32_t cp;
+        size_t len = decode( s + i, n - i, cp );
+        if ( len == 0 ) return i + 1;
+        if ( is_word_char( cp ) ) {
+            for( size_t k=i; k<i+len; ++k ) masks[k / 64] |= 1ULL << ( k % 64 );
+            uint32_t f = fold_char( cp );
+            if ( f != cp ) {
+                if ( encoded_length( f ) == len ) {
+                    encode( f, len, out + i );
+                } else {
+                    refold = true;
+                }
+            }
+        }
+        return i + len;
+    }
+
+    // Mark the characters starting at the high bytes in a window of the input:
+    // bit k of hi (every stride'th bit) is the byte at base + k/stride.  next is where
+    // the first character not yet marked starts.
+    inline void mark_window( const unsigned char* s, char* out, size_t base, uint64_t hi, unsigned stride,
+                             size_t& next, size_t n, uint64_t* masks, bool& refold ) {
+        while( hi ) {
+            size_t j = base + __builtin_ctzll( hi ) / stride;
+            hi &= hi - 1;
+            if ( j < next ) continue;       // Part of the character before
+            next = mark_char( s, out, j, n, masks, refold );
+        }
+    }
+
+    inline void mark_rest( const unsigned char* s, char* out, size_t i, size_t n, uint64_t* masks, bool& refold ) {
+        while( i < n ) i = mark_char( s, out, i, n, masks, refold );
+    }
+
+    // Each of these checks as many bytes at a time for a high bit as it can, and only
+    // decodes from the ones it finds
+    bool mark_utf8_scalar( const char* in, char* out, size_t n, uint64_t* masks ) {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>( in );
+        bool refold = false;
+        size_t i = 0, next = 0;
+        for( ; i + 8 <= n; i += 8 ) {
+            uint64_t w;
+            memcpy( &w, s + i, 8 );
+            mark_window( s, out, i, w & 0x8080808080808080ULL, 8, next, n, masks, refold );
+        }
+        mark_rest( s, out, i > next ? i : next, n, masks, refold );
+        return refold;
+    }
+
+    bool mark_utf8_sse2( const char* in, char* out, size_t n, uint64_t* masks ) {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>( in );
+        bool refold = false;
+        size_t i = 0, next = 0;
+        for( ; i + 16 <= n; i += 16 ) {
+            uint32_t hi = _mm_movemask_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>( s + i ) ) );
+            if ( hi ) mark_window( s, out, i, hi, 1, next, n, masks, refold );
+        }
+        mark_rest( s, out, i > next ? i : next, n, masks, refold );
+        return refold;
+    }
+
+    __attribute__((target("avx2")))
+    bool mark_utf8_avx2( const char* in, char* out, size_t n, uint64_t* masks ) {
+        const unsigned char* s = reinterpret_cast<const unsigned char*>( in );
+        bool refold = false;
+        size_t i = 0, next = 0;
+        for( ; i + 32 <= n; i += 32 ) {
+            uint32_t hi = _mm256_movemask_epi8( _mm256_loadu_si256( reinterpret_cast<const __m256i*>( s + i ) ) );
+            if ( hi ) mark_window( s, out, i, hi, 1, next, n, masks, refold );
+        }
+        mark_rest( s, out, i > next ? i : next, n, masks, refold );
+        return refold;
+    }
+}
+
+bool is_word_char( uint32_t cp ) {
+    if ( cp < CACHED ) return ucache.word( cp );
+    return lookup_word( cp );
+}
+
+uint32_t fold_char( uint32_t cp ) {
+    return cp < CACHED ? ucache.fold( cp ) : lookup_fold( cp );
+}
+
+void utf8_fold( const char* p, size_t len, std::string& out ) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>( p );
+    out.clear();
+    for( size_t i=0; i<len; ) {
+        uint32_t cp;
+        size_t n = decode( s + i, len - i, cp );
+        if ( n == 0 ) {
+            out += char( s[i++] );
+            continue;
+        }
+        uint32_t f = fold_char( cp );
+        size_t flen = encoded_length( f );
+        out.resize( out.size() + flen );
+        encode( f, flen, &out[out.size() - flen] );
+        i += n;
+    }
+}
+
+bool parse_tokenizer_engine( const char* name, tokenizer_engine& engine ) {
+    static const struct { const char* name; tokenizer_engine engine; } names[] = {
+        { "regex",  tokenizer_engine::regex },
+        { "scalar", tokenizer_engine::scalar },
+        { "sse2",   tokenizer_engine::sse2 },
+        { "avx2",   tokenizer_engine::avx2 },
+        { "auto",   tokenizer_engine::automatic } };
+
+    for( const auto& it : names ) {
+        if ( strcmp( name, it.name ) == 0 ) {
+            engine = it.engine;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* tokenizer_engine_name( tokenizer_engine engine ) {
+    switch( engine ) {
+    case tokenizer_engine::regex:     return "regex";
+    case tokenizer_engine::scalar:    return "scalar";
+    case tokenizer_engine::sse2:      return "sse2";
+    case tokenizer_engine::avx2:      return "avx2";
+    case tokenizer_engine::automatic: return "auto";
+    }
+    return "unknown";
+}
+
+tokenizer_engine resolve_tokenizer_engine( tokenizer_engine engine ) {
+    __builtin_cpu_init();
+    if ( engine == tokenizer_engine::automatic || engine == tokenizer_engine::avx2 ) {
+        if ( __builtin_cpu_supports( "avx2" ) ) return tokenizer_engine::avx2;
+        engine = tokenizer_engine::sse2;
+    }
+    if ( engine == tokenizer_engine::sse2 && !__builtin_cpu_supports( "sse2" ) ) {
+        return tokenizer_engine::scalar;
+    }
+    return engine;
+}
+
+utf8_mark_func get_utf8_marker( tokenizer_engine engine ) {
+    switch( resolve_tokenizer_engine( engine ) ) {
+    case tokenizer_engine::avx2: return mark_utf8_avx2;
+    case tokenizer_engine::sse2: return mark_utf8_sse2;
+    default:                     return mark_utf8_scalar;
+    }
+}
+
+classify_func get_classifier( tokenizer_engine engine ) {
+    switch( resolve_tokenizer_engine( engine ) ) {
+    case tokenizer_engine::avx2: return classify_avx2;
+    case tokenizer_engine::sse2: return classify_sse2;
+    default:                     return classify_scalar;
+    }
+}
+
+}
@@ -0,0 +1,267 @@
+//
+// A streaming word tokenizer
+// Bytes are classified as alphanumeric or not, and lowercased, in a single pass.
+// The classification step has SSE2 and AVX2 versions which are picked at runtime,
+// with a table-driven scalar version as the fallback.
+//
+// A word is a maximal run of [0-9A-Za-z], which is what "[[:alnum:]]+" matches in
+// the "C" locale, so the output is identical to the regex based tokenizer.
+//
+// In UTF-8 mode a word is a run of Unicode letters, combining marks and digits, and
+// is case folded.  The ASCII classification is done as before, and then only the
+// stretches of input with a high bit set are decoded, so plain ASCII text goes nearly
+// as fast as it does without.  Characters are folded in place where that doesn't
+// change their length, which is all but a few rare ones; words in a block with one
+// of those are folded again as they're emitted.
+//
+// With a word_filter, the words it leaves out (stopwords.h) are dropped here, after
+// folding, so that whatever is counting them never sees them.
+//
+#ifndef __TOKENIZER_H__
+#define __TOKENIZER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "stopwords.h"
+
+namespace kjp {
+
+    enum class tokenizer_engine { regex, scalar, sse2, avx2, automatic };
+
+    // Parse/print engine names as used on the command line
+    bool parse_tokenizer_engine( const char* name, tokenizer_engine& engine );
+    const char* tokenizer_engine_name( tokenizer_engine engine );
+
+    // Resolve "automatic" (or an engine the CPU can't run) to the best supported engine
+    tokenizer_engine resolve_tokenizer_engine( tokenizer_engine engine );
+
+    // True for the bytes words are made of; a chunk boundary must not split a run of
+    // these.  Every byte of a multi-byte UTF-8 character counts, word character or
+    // not, so that a boundary can't split a character either.
+    inline bool is_word_byte( unsigned char c ) {
+        return ( c >= '0' && c <= '9' ) || ( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'z' ) || c >= 0x80;
+    }
+
+    // Lowercase the n bytes at in into out, and set bit i of masks[i/64] when in[i]
+    // is an ASCII word byte.  masks must have room for (n+63)/64 entries.
+    typedef void (*classify_func)( const char* in, char* out, size_t n, uint64_t* masks );
+    classify_func get_classifier( tokenizer_engine engine );
+
+    // Then, for UTF-8, set the bits of every byte of the multi-byte word characters,
+    // and fold them in out.  Returns true if some need folding to a different length.
+    typedef bool (*utf8_mark_func)( const char* in, char* out, size_t n, uint64_t* masks );
+    utf8_mark_func get_utf8_marker( tokenizer_engine engine );
+
+    // Whether code point cp is a letter, mark or digit, and its simple case folding
+    bool is_word_char( uint32_t cp );
+    uint32_t fold_char( uint32_t cp );
+
+    // Case fold the UTF-8 text [p, p+len) into out.  Malformed bytes are copied as is.
+    void utf8_fold( const char* p, size_t len, std::string& out );
+
+    // How many bytes at the end of [p, p+n) are a character that continues past it
+    inline size_t utf8_incomplete_tail( const char* p, size_t n ) {
+        for( size_t i=1; i<=3 && i<=n; ++i ) {
+            unsigned char c = p[n-i];
+            if ( ( c & 0xc0 ) == 0x80 ) continue;
+            size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            return c < 0xf8 && need > i ? i : 0;
+        }
+        return 0;
+    }
+
+    class tokenizer {
+        static constexpr size_t BLOCK = 4096;        // Bytes classified per step
+
+        classify_func classify;
+        utf8_mark_func mark_utf8;                    // Null unless in UTF-8 mode
+        const word_filter* filter;                   // Null to keep every word
+        std::string carry;                           // Word spanning a block boundary
+        std::string folded;
+        bool refold;                                 // Words need utf8_fold()ing again
+        char partial[4];                             // A character split between inputs
+        size_t npartial;
+        char lowered[BLOCK];
+        uint64_t masks[BLOCK / 64];
+
+        // Index of the first word byte at or after pos, or len if there is none
+        size_t next_word( size_t pos, size_t len ) const {
+            size_t w = pos / 64;
+            uint64_t bits = masks[w] & ( ~0ULL << ( pos % 64 ) );
+            while( bits == 0 ) {
+                if ( ++w * 64 >= len ) return len;
+                bits = masks[w];
+            }
+            size_t r = w * 64 + __builtin_ctzll( bits );
+            return r < len ? r : len;
+        }
+
+        // Index of the first non-word byte at or after pos, or len if there is none
+        size_t next_gap( size_t pos, size_t len ) const {
+            size_t w = pos / 64;
+            uint64_t bits = ~masks[w] & ( ~0ULL << ( pos % 64 ) );
+            while( bits == 0 ) {
+                if ( ++w * 64 >= len ) return len;
+                bits = ~masks[w];
+            }
+            size_t r = w * 64 + __builtin_ctzll( bits );
+            return r < len ? r : len;
+        }
+
+        template <typename F>
+        void scan_block( size_t len, F& emit ) {
+            size_t pos = 0;
+
+            // Finish off a word left over from the previous block
+            if ( !carry.empty() ) {
+                pos = next_gap( 0, len );
+                carry.append( lowered, pos );
+                if ( pos == len ) return;
+                emit( carry.data(), carry.size() );
+                carry.clear();
+            }
+
+            while( pos < len ) {
+                size_t start = next_word( pos, len );
+                if ( start == len ) return;
+                size_t end = next_gap( start, len );
+                if ( end == len ) {
+                    // Might continue in the next block
+                    carry.assign( lowered + start, end - start );
+                    return;
+                }
+                emit( lowered + start, end - start );
+                pos = end;
+            }
+        }
+
+        template <typename F>
+        void scan_blocks( const char* p, size_t n, F& emit ) {
+            while( n > 0 ) {
+                size_t len = n < BLOCK ? n : BLOCK;
+                // Blocks end between characters, so each can be decoded on its own
+                if ( mark_utf8 && len < n ) len -= utf8_incomplete_tail( p, len );
+                classify( p, lowered, len, masks );
+                if ( mark_utf8 ) {
+                    // A word carried over from a block that needed it still does
+                    refold = mark_utf8( p, lowered, len, masks ) || ( refold && !carry.empty() );
+                }
+                scan_block( len, emit );
+                p += len;
+                n -= len;
+            }
+        }
+
+        // Pass words on, folding the ones that weren't folded in place
+        template <typename F>
+        struct folding_emit {
+            tokenizer& tok;
+            F& emit;
+            void operator()( const char* w, size_t len ) {
+                unsigned char high = 0;
+                if ( tok.refold ) {
+                    for( size_t i=0; i<len; ++i ) high |= static_cast<unsigned char>( w[i] );
+                }
+                if ( high < 0x80 ) {
+                    emit( w, len );
+                } else {
+                    utf8_fold( w, len, tok.folded );
+                    emit( tok.folded.data(), tok.folded.size() );
+                }
+            }
+        };
+
+        template <typename F>
+        struct filtering_emit {
+            const word_filter& filter;
+            F& emit;
+            void operator()( const char* w, size_t len ) {
+                if ( filter.keeps( w, len ) ) emit( w, len );
+            }
+        };
+
+        template <typename F>
+        void scan_words( const char* p, size_t n, F& emit ) {
+            if ( !mark_utf8 ) {
+                scan_blocks( p, n, emit );
+                return;
+            }
+
+            folding_emit<F> fe{ *this, emit };
+            if ( npartial > 0 ) {
+                // Finish the character the last input ended in the middle of
+                unsigned char c = partial[0];
+                size_t need = ( c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2 ) - npartial;
+                size_t take = need < n ? need : n;
+                for( size_t i=0; i<take; ++i ) partial[npartial++] = p[i];
+                p += take;
+                n -= take;
+                if ( take < need ) return;
+                scan_blocks( partial, npartial, fe );
+                npartial = 0;
+            }
+            size_t tail = utf8_incomplete_tail( p, n );
+            scan_blocks( p, n - tail, fe );
+            memcpy( partial, p + n - tail, tail );
+            npartial = tail;
+        }
+
+        template <typename F>
+        void finish_words( F& emit ) {
+            npartial = 0;       // A truncated character; not part of any word
+            if ( carry.empty() ) {
+                refold = false;
+                return;
+            }
+            if ( mark_utf8 ) {
+                folding_emit<F>{ *this, emit }( carry.data(), carry.size() );
+            } else {
+                emit( carry.data(), carry.size() );
+            }
+            carry.clear();
+            refold = false;
+        }
+
+    public:
+        // wf, if given, must outlive the tokenizer
+        explicit tokenizer( tokenizer_engine engine = tokenizer_engine::automatic, bool utf8 = false,
+                            const word_filter* wf = nullptr ) :
+            classify( get_classifier( engine ) ), mark_utf8( utf8 ? get_utf8_marker( engine ) : nullptr ),
+            filter( wf && !wf->empty() ? wf : nullptr ), refold(false), npartial(0) {}
+
+        bool is_utf8() const { return mark_utf8 != nullptr; }
+
+        // Whether the filter leaves [w, w+len) in, for words found some other way
+        bool keeps( const char* w, size_t len ) const { return !filter || filter->keeps( w, len ); }
+
+        // Tokenize n bytes starting at p.  emit( const char* word, size_t len ) is called
+        // for each lowercased word; the pointer is only valid during the call.
+        // A word running up to the end of the input is held back until the next call
+        // to scan() or finish(), so input may be fed in arbitrary pieces.
+        template <typename F>
+        void scan( const char* p, size_t n, F emit ) {
+            if ( filter ) {
+                filtering_emit<F> fe{ *filter, emit };
+                scan_words( p, n, fe );
+            } else {
+                scan_words( p, n, emit );
+            }
+        }
+
+        // Emit the pending word, if any.  Call this at the end of each input.
+        template <typename F>
+        void finish( F emit ) {
+            if ( filter ) {
+                filtering_emit<F> fe{ *filter, emit };
+                finish_words( fe );
+            } else {
+                finish_words( emit );
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#
+# Generate unicode_tables.h, the character classes and case folding for the UTF-8
+# tokenizer, from the Unicode database that comes with Python.
+#
+#   tools/genunicode.py > unicode_tables.h
+#
+import sys
+import unicodedata
+
+def is_word( cp ):
+    # Letters, marks (so that combining accents stay inside their word) and digits
+    cat = unicodedata.category( chr( cp ) )
+    return cat[0] in 'LM' or cat == 'Nd'
+
+def fold( cp ):
+    # Simple case folding: one character to one character.  Where the full folding
+    # is longer (German sharp s to "ss", say), fall back to the lowercase mapping.
+    c = chr( cp )
+    f = c.casefold()
+    if len( f ) != 1:
+        f = c.lower()
+    return ord( f ) if len( f ) == 1 else cp
+
+def word_ranges():
+    out = []
+    start = None
+    for cp in range( 0x80, 0x110001 ):
+        w = cp <= 0x10ffff and not 0xd800 <= cp < 0xe000 and is_word( cp )
+        if w and start is None:
+            start = cp
+        elif not w and start is not None:
+            out.append( ( start, cp - 1 ) )
+            start = None
+    return out
+
+def fold_runs():
+    # Runs of characters that fold by the same delta, either every character (stride
+    # 1) or every other one (stride 2, for the alternating upper/lower blocks)
+    runs = []
+    for cp in range( 0x80, 0x110000 ):
+        f = fold( cp )
+        if f == cp:
+            continue
+        d = f - cp
+        if runs:
+            first, last, delta, stride = runs[-1]
+            gap = cp - last
+            if delta == d and gap in ( 1, 2 ) and stride in ( 0, gap ):
+                runs[-1] = [ first, cp, delta, gap ]
+                continue
+        runs.append( [ cp, cp, d, 0 ] )
+    return [ ( a, b, d, s or 1 ) for a, b, d, s in runs ]
+
+def main():
+    w = word_ranges()
+    f = fold_runs()
+    o = sys.stdout
+    o.write( '//\n' )
+    o.write( '// Unicode %s character classes and simple case folding for the tokenizer\n' % unicodedata.unidata_version )
+    o.write( '// Generated by tools/genunicode.py; do not edit.\n' )
+    o.write( '//\n' )
+    o.write( '#ifndef __UNICODE_TABLES_H__\n#define __UNICODE_TABLES_H__\n\n' )
+    o.write( '#include <cstdint>\n\n' )
+    o.write( 'namespace kjp {\nnamespace unicode {\n\n' )
+    o.write( '    struct range { uint32_t first, last; };\n' )
+    o.write( '    struct fold_run { uint32_t first, last; int32_t delta; uint32_t stride; };\n\n' )
+    o.write( '    // Code points from U+0080 up that are word characters\n' )
+    o.write( '    constexpr range word_ranges[] = {\n' )
+    for i in range( 0, len( w ), 4 ):
+        o.write( '        ' + ' '.join( '{ 0x%05x, 0x%05x },' % r for r in w[i:i+4] ) + '\n' )
+    o.write( '    };\n\n' )
+    o.write( '    // first, first+stride, ... last fold to themselves plus delta\n' )
+    o.write( '    constexpr fold_run fold_runs[] = {\n' )
+    for i in range( 0, len( f ), 2 ):
+        o.write( '        ' + ' '.join( '{ 0x%05x, 0x%05x, %6d, %d },' % r for r in f[i:i+2] ) + '\n' )
+    o.write( '    };\n\n' )
+    o.write( '}\n}\n\n#endif\n' )
+
+main()
@@ -0,0 +1,135 @@
+//
+// Partitioned top-K extraction for the counting tables
+// The slot array is cut into one slice per thread; each thread keeps the best entries
+// of its slice in its own bounded heap, and the sorted heaps are then merged pairwise,
+// again in parallel.  With no bound every entry is kept, which makes it a parallel sort.
+//
+// Entries are (key, count) pairs, ordered most frequent first with ties broken by key.
+//
+// The slices run on threads started for the purpose, unless the calling thread has a
+// parallel_runner, such as an indexer's worker pool, to hand them to instead.
+//
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+namespace kjp {
+
+    template <typename E>
+    struct count_order {
+        bool operator()( const E& a, const E& b ) const {
+            return ( a.second > b.second ) || ( a.second == b.second && a.first < b.first );
+        }
+    };
+
+    // Keeps the limit best entries offered to it, or all of them if limit is 0
+    template <typename E>
+    class topk_heap {
+        std::vector<E> heap;        // The worst entry kept is at the front
+        size_t limit;
+        count_order<E> better;
+
+    public:
+        explicit topk_heap( size_t lim=0 ) : limit(lim) {}
+
+        bool full() const { return limit != 0 && heap.size() >= limit; }
+
+        // A cheap test before building an entry: would nothing with count c get in?
+        bool rejects( int c ) const { return full() && c < heap.front().second; }
+
+        void offer( E&& e ) {
+            if ( limit == 0 ) {
+                heap.push_back( std::move( e ) );
+                return;
+            }
+            if ( full() ) {
+                if ( !better( e, heap.front() ) ) return;
+                std::pop_heap( heap.begin(), heap.end(), better );
+                heap.pop_back();
+            }
+            heap.push_back( std::move( e ) );
+            std::push_heap( heap.begin(), heap.end(), better );
+        }
+
+        // Sorted best first; the heap is left empty
+        std::vector<E> take() {
+            std::sort( heap.begin(), heap.end(), better );
+            std::vector<E> out;
+            out.swap( heap );
+            return out;
+        }
+    };
+
+    // Somewhere to run calls in parallel.  run( n, f ) calls f( 0 ) .. f( n-1 ), each
+    // once, on the calling thread and whichever others it has, and returns when all of
+    // them have.  It may be called from one of its own threads.
+    struct parallel_runner {
+        virtual void run( int n, const std::function<void( int )>& f ) = 0;
+        virtual ~parallel_runner() {}
+    };
+
+    namespace detail {
+        // The calling thread's runner, if it has one
+        inline thread_local parallel_runner* runner = nullptr;
+
+        // Run f( 0 ) .. f( n-1 ) in parallel, the caller taking part: on the caller's
+        // runner, or else with f( 0 ) on the caller and the rest a thread each
+        template <typename F>
+        void run_parallel( int n, F f ) {
+            if ( runner && n > 1 ) {
+                runner->run( n, std::ref( f ) );
+                return;
+            }
+            std::vector<std::thread> ts;
+            for( int i=1; i<n; ++i ) ts.emplace_back( f, i );
+            f( 0 );
+            for( auto& t : ts ) t.join();
+        }
+    }
+
+    #ifdef TOPK_MIN_SLICE
+    constexpr size_t TOPK_SLICE=TOPK_MIN_SLICE;
+    #else
+    constexpr size_t TOPK_SLICE=1 << 16;    // Slots per thread below which we don't bother
+    #endif
+
+    // The count best entries (all if count is 0) of a table with n slots, using up to
+    // nthreads threads.  scan( lo, hi, heap ) must offer every entry in slots [lo, hi).
+    template <typename E, typename Scan>
+    std::vector<E> parallel_top( size_t n, size_t count, int nthreads, Scan scan ) {
+        count_order<E> better;
+        int slices = std::max( 1, std::min<int>( nthreads, ( n + TOPK_SLICE - 1 ) / TOPK_SLICE ) );
+
+        std::vector<std::vector<E>> runs( slices );
+        detail::run_parallel( slices, [&]( int s ) {
+            topk_heap<E> heap( count );
+            scan( n * s / slices, n * ( s + 1 ) / slices, heap );
+            runs[s] = heap.take();
+        } );
+
+        while( runs.size() > 1 ) {
+            std::vector<std::vector<E>> merged( ( runs.size() + 1 ) / 2 );
+            detail::run_parallel( runs.size() / 2, [&]( int i ) {
+                std::vector<E>& a = runs[2*i];
+                std::vector<E>& b = runs[2*i+1];
+                std::vector<E>& out = merged[i];
+                out.reserve( a.size() + b.size() );
+                std::merge( std::make_move_iterator( a.begin() ), std::make_move_iterator( a.end() ),
+                            std::make_move_iterator( b.begin() ), std::make_move_iterator( b.end() ),
+                            std::back_inserter( out ), better );
+                if ( count != 0 && out.size() > count ) out.erase( out.begin() + count, out.end() );
+            } );
+            if ( runs.size() % 2 ) merged.back().swap( runs.back() );
+            runs.swap( merged );
+        }
+        return std::move( runs[0] );
+    }
+}
+
+#endif
@@ -0,0 +1,134 @@
+//
+// Directory traversal helpers
+//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+
+#include "walker.h"
+
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace kjp {
+
+namespace {
+    // Layout of the records returned by getdents64
+    struct linux_dirent64 {
+        ino64_t        d_ino;
+        off64_t        d_off;
+        unsigned short d_reclen;
+        unsigned char  d_type;
+        char           d_name[];
+    };
+
+    #ifdef WALKER_DIRBUF_SIZE
+    constexpr size_t DIRBUF_SIZE=WALKER_DIRBUF_SIZE;
+    #else
+    constexpr size_t DIRBUF_SIZE=64*1024;       // Bytes of entries fetched per syscall
+    #endif
+}
+
+void extension_filter::add( const std::string& list ) {
+    size_t start = 0;
+    while( start <= list.size() ) {
+        size_t end = list.find( ',', start );
+        if ( end == std::string::npos ) end = list.size();
+        std::string e = list.substr( start, end - start );
+        if ( e == "*" ) {
+            any = true;
+        } else if ( !e.empty() ) {
+            if ( e[0] != '.' ) e.insert( 0, "." );
+            exts.push_back( e );
+        }
+        start = end + 1;
+    }
+}
+
+bool extension_filter::match( const char* name, size_t len ) const {
+    if ( any ) return true;
+    for( const auto& e : exts ) {
+        if ( len >= e.size() && strncasecmp( name + len - e.size(), e.c_str(), e.size() ) == 0 ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string extension_filter::to_string() const {
+    std::string s = any ? "*" : "";
+    for( const auto& e : exts ) {
+        if ( !s.empty() ) s += ",";
+        s += e;
+    }
+    return s;
+}
+
+std::atomic<int> directory::nopen( 0 );
+
+directory::~directory() {
+    close( fd );
+    nopen.fetch_sub( 1 );
+}
+
+std::shared_ptr<directory> open_directory( const std::string& path, size_t name,
+                                           const std::shared_ptr<directory>& parent ) {
+    int fd = parent ? openat( parent->handle(), path.c_str() + name, O_RDONLY | O_DIRECTORY | O_CLOEXEC )
+                    : open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( fd < 0 ) return nullptr;
+    return std::make_shared<directory>( fd );
+}
+
+bool list_directory( const directory& dir, std::vector<char>& buf,
+                     const std::function<void( const char*, size_t, dirent_kind )>& found ) {
+    int fd = dir.handle();
+    if ( buf.size() < DIRBUF_SIZE ) buf.resize( DIRBUF_SIZE );
+
+    while( true ) {
+        long n = syscall( SYS_getdents64, fd, buf.data(), buf.size() );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            return false;
+        }
+        if ( n == 0 ) break;
+
+        for( long off = 0; off < n; ) {
+            const linux_dirent64* d = reinterpret_cast<const linux_dirent64*>( buf.data() + off );
+            off += d->d_reclen;
+
+            const char* name = d->d_name;
+            if ( name[0] == '.' && ( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) ) ) continue;
+
+            unsigned char type = d->d_type;
+            if ( type == DT_LNK || type == DT_UNKNOWN ) {
+                // Not every filesystem fills in d_type; and a link could go anywhere
+                struct stat st;
+                if ( fstatat( fd, name, &st, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW ) < 0 ) continue;
+                if ( S_ISREG( st.st_mode ) ) {
+                    type = DT_REG;
+                } else if ( S_ISDIR( st.st_mode ) && d->d_type == DT_UNKNOWN ) {
+                    type = DT_DIR;
+                } else {
+                    continue;
+                }
+            }
+
+            if ( type == DT_REG ) {
+                found( name, strlen( name ), dirent_kind::file );
+            } else if ( type == DT_DIR ) {
+                found( name, strlen( name ), dirent_kind::directory );
+            }
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,76 @@
+//
+// Directory traversal helpers
+// Directories are read with getdents64, using d_type to tell files from directories
+// so that, on most filesystems, no stat() is needed per entry.  Subdirectories are
+// opened with openat() from their parent, so that on a network filesystem the path
+// leading to them isn't looked up component by component again for each one.
+//
+#ifndef __WALKER_H__
+#define __WALKER_H__
+
+#include <cstddef>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace kjp {
+
+    // Case-insensitive filename suffix filter, e.g. ".txt,.log"
+    class extension_filter {
+        std::vector<std::string> exts;
+        bool any;                               // "*" matches every file
+
+    public:
+        extension_filter() : any(false) {}
+
+        // Add a comma separated list of extensions
+        void add( const std::string& list );
+        bool empty() const { return exts.empty() && !any; }
+        bool match( const char* name, size_t len ) const;
+        bool match( const std::string& name ) const { return match( name.data(), name.size() ); }
+        std::string to_string() const;
+    };
+
+    enum class dirent_kind { file, directory };
+
+    // An open directory, kept by the tasks for its subdirectories until they have
+    // opened their own, and closed by the last of them to let go
+    class directory {
+        int fd;
+
+    public:
+        // Past this many open at once, subdirectories are opened by their whole path
+        #ifdef WALKER_MAX_OPEN
+        static constexpr int MAX_OPEN=WALKER_MAX_OPEN;
+        #else
+        static constexpr int MAX_OPEN=256;
+        #endif
+        static std::atomic<int> nopen;
+
+        explicit directory( int f ) : fd(f) { nopen.fetch_add( 1 ); }
+        ~directory();
+        directory( const directory& ) = delete;
+        directory& operator=( const directory& ) = delete;
+
+        int handle() const { return fd; }
+
+        // Whether to hand this one to the subdirectories, or let them open their own path
+        bool shareable() const { return nopen.load( std::memory_order_relaxed ) < MAX_OPEN; }
+    };
+
+    // Open path, the last component of which starts at path[name], from parent if there
+    // is one, and otherwise by the whole path.  Returns null with errno set if it can't.
+    std::shared_ptr<directory> open_directory( const std::string& path, size_t name,
+                                               const std::shared_ptr<directory>& parent );
+
+    // Call found( name, len, kind ) for each regular file and subdirectory of dir
+    // (not "." and "..").  Symlinks to files are followed; symlinks to directories are
+    // not, so the walk can't loop.  buf is scratch space, reused between calls.
+    // Returns false with errno set if dir can't be read.
+    bool list_directory( const directory& dir, std::vector<char>& buf,
+                         const std::function<void( const char*, size_t, dirent_kind )>& found );
+}
+
+#endif
@@ -0,0 +1,56 @@
+//
+// A common interface to the word counting tables, so that main can choose one at runtime
+//
+
+#ifndef __WORD_COUNTER_H__
+#define __WORD_COUNTER_H__
+
+#include <string>
+#include <string_view>
+#include <utility> // For std::pair
+#include <vector>
+
+class wordcounter {
+public:
+    typedef std::pair<std::string,int> element;
+
+    struct resize_stats {
+        long resizes;       // Number of times the table grew
+        long pauses;        // Operations that were held up by a resize
+        long total_ns;      // Time those operations spent on it
+        long max_ns;        // The longest single pause
+    };
+
+    virtual ~wordcounter() {}
+
+    // Keys are looked up by view, so counting a word already in the table allocates nothing
+    int insert( std::string_view key ) { return insert_n( key, 1 ); }
+    virtual int insert_n( std::string_view key, int delta ) = 0;
+    virtual int contains( std::string_view key ) const = 0;
+    // The count most frequent words, or all of them if count is 0
+    virtual std::vector<element> extract_top( int count, int nthreads=1 ) = 0;
+    virtual resize_stats get_resize_stats() const = 0;
+};
+
+// Wraps one of the concrete tables (stripedhashcounter<std::string>, flathashcounter,
+// spacesavingcounter)
+template <typename T>
+class wordcounter_adapter : public wordcounter {
+public:
+    T table;
+
+    template <typename... Args>
+    wordcounter_adapter( Args&&... args ) : table( std::forward<Args>( args )... ) {}
+
+    int insert_n( std::string_view key, int delta ) override { return table.insert_n( key, delta ); }
+    int contains( std::string_view key ) const override { return table.contains( key ); }
+    std::vector<element> extract_top( int count, int nthreads ) override {
+        return table.extract_top( count, nthreads );
+    }
+    resize_stats get_resize_stats() const override {
+        auto rs = table.get_resize_stats();
+        return resize_stats{ rs.resizes, rs.pauses, rs.total_ns, rs.max_ns };
+    }
+};
+
+#endif
@@ -0,0 +1,277 @@
+//
+// A work-stealing task scheduler
+// Each worker owns a Chase-Lev deque: it pushes and pops tasks at the bottom without
+// any locking, while idle workers steal from the top of a randomly chosen victim.
+// Tasks submitted from outside the pool go through a bounded injection ring, so a
+// producer that gets too far ahead of the workers (the nftw walk, the prefetcher) is
+// made to wait; workers take from it in batches.
+// Idle workers sleep on a condition variable and are woken one at a time.
+//
+// The deque follows Le, Pop, Cohen and Zappa Nardelli,
+//    "Correct and Efficient Work-Stealing for Weak Memory Models" in PPoPP '13
+//
+#ifndef __WSQUEUE_H__
+#define __WSQUEUE_H__
+
+#if __cplusplus < 201103L
+#error "This program requires C++11 support"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bdqueue.h"
+
+namespace kjp {
+
+    // A single-owner, multi-thief deque of trivially copyable values (here: pointers)
+    template <typename T>
+    class chaselev_deque {
+        struct ring {
+            int64_t cap;
+            std::unique_ptr<std::atomic<T>[]> buf;
+
+            ring( int64_t c ) : cap(c), buf( new std::atomic<T>[c] ) {}
+            T get( int64_t i ) const { return buf[i & ( cap - 1 )].load( std::memory_order_relaxed ); }
+            void put( int64_t i, T x ) { buf[i & ( cap - 1 )].store( x, std::memory_order_relaxed ); }
+        };
+
+        std::atomic<int64_t> top, bottom;
+        std::atomic<ring*> array;
+        // Outgrown rings; thieves may still be reading them, so they live as long as we do
+        std::vector<std::unique_ptr<ring>> rings;
+
+        ring* grow( ring* a, int64_t b, int64_t t ) {
+            ring* n = new ring( a->cap * 2 );
+            for( int64_t i=t; i<b; ++i ) n->put( i, a->get( i ) );
+            rings.emplace_back( n );
+            return n;
+        }
+
+    public:
+        explicit chaselev_deque( int64_t cap=256 ) : top(0), bottom(0) {
+            rings.emplace_back( new ring( cap ) );
+            array.store( rings.back().get(), std::memory_order_relaxed );
+        }
+
+        // Owner only
+        void push( T x ) {
+            int64_t b = bottom.load( std::memory_order_relaxed );
+            int64_t t = top.load( std::memory_order_acquire );
+            ring* a = array.load( std::memory_order_relaxed );
+            if ( b - t > a->cap - 1 ) {
+                a = grow( a, b, t );
+                array.store( a, std::memory_order_release );
+            }
+            a->put( b, x );
+            std::atomic_thread_fence( std::memory_order_release );
+            bottom.store( b + 1, std::memory_order_relaxed );
+        }
+
+        // Owner only.  Returns false if the deque is empty.
+        bool pop( T& out ) {
+            int64_t b = bottom.load( std::memory_order_relaxed ) - 1;
+            ring* a = array.load( std::memory_order_relaxed );
+            bottom.store( b, std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            int64_t t = top.load( std::memory_order_relaxed );
+
+            if ( t > b ) {
+                bottom.store( b + 1, std::memory_order_relaxed );
+                return false;
+            }
+            out = a->get( b );
+            if ( t == b ) {
+                // Last one; race the thieves for it
+                bool won = top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                                                        std::memory_order_relaxed );
+                bottom.store( b + 1, std::memory_order_relaxed );
+                return won;
+            }
+            return true;
+        }
+
+        // Anyone.  Returns false if the deque was empty or we lost a race.
+        bool steal( T& out ) {
+            int64_t t = top.load( std::memory_order_acquire );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            int64_t b = bottom.load( std::memory_order_acquire );
+            if ( t >= b ) return false;
+
+            ring* a = array.load( std::memory_order_acquire );
+            T x = a->get( t );
+            if ( !top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed ) ) {
+                return false;
+            }
+            out = x;
+            return true;
+        }
+
+        // Approximate; only used as a hint
+        bool empty() const {
+            return bottom.load( std::memory_order_relaxed ) <= top.load( std::memory_order_relaxed );
+        }
+    };
+
+    // A pool of nworkers deques.  Worker i calls next( i, t ) for each task to run and
+    // done() once it has finished it; submit() may be called from anywhere.
+    template <typename T>
+    class workstealing_pool {
+        #ifdef WSQUEUE_INJECT_CAPACITY
+        static constexpr size_t INJECT_CAPACITY=WSQUEUE_INJECT_CAPACITY;
+        #else
+        static constexpr size_t INJECT_CAPACITY=4096;   // Outside tasks queued before submit() waits
+        #endif
+
+        #ifdef WSQUEUE_INJECT_BATCH
+        static constexpr size_t INJECT_BATCH=WSQUEUE_INJECT_BATCH;
+        #else
+        static constexpr size_t INJECT_BATCH=16;        // Outside tasks a worker takes at once
+        #endif
+
+        struct worker_state {
+            chaselev_deque<T*> dq;
+            uint64_t rng;
+            char pad[64];       // Keep neighbouring workers' deques off each other's lines
+        };
+
+        std::vector<std::unique_ptr<worker_state>> workers;
+
+        boundedQueue<T*> injected;          // Tasks from outside the pool
+        std::atomic<long> ninjected;        // For the sleep check; injected's size is only a hint
+
+        std::mutex sleepmtx;
+        std::condition_variable sleepcv;
+        std::atomic<int> nsleeping;
+        std::atomic<bool> stopping;
+
+        std::mutex donemtx;
+        std::condition_variable donecv;
+        std::atomic<long> pending;          // Submitted but not yet done()
+
+        // Run the first of a batch, and keep the rest on our own deque for later (or
+        // for thieves)
+        bool take_injected( int me, T*& t ) {
+            if ( ninjected.load( std::memory_order_acquire ) == 0 ) return false;
+            T* batch[INJECT_BATCH];
+            size_t n = injected.deq_batch( batch, INJECT_BATCH );
+            if ( n == 0 ) return false;
+            ninjected.fetch_sub( n );
+            for( size_t i=n-1; i>0; --i ) workers[me]->dq.push( batch[i] );
+            if ( n > 1 ) wake_one();
+            t = batch[0];
+            return true;
+        }
+
+        bool try_steal( int me, T*& t ) {
+            int n = workers.size();
+            uint64_t& r = workers[me]->rng;
+            for( int attempt=0; attempt<n; ++attempt ) {
+                // xorshift64
+                r ^= r << 13;
+                r ^= r >> 7;
+                r ^= r << 17;
+                int victim = r % n;
+                if ( victim != me && workers[victim]->dq.steal( t ) ) return true;
+            }
+            return false;
+        }
+
+        bool work_visible() const {
+            if ( ninjected.load() > 0 ) return true;
+            for( const auto& w : workers ) {
+                if ( !w->dq.empty() ) return true;
+            }
+            return false;
+        }
+
+        void wake_one() {
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            if ( nsleeping.load() > 0 ) {
+                std::lock_guard<std::mutex> lg( sleepmtx );
+                sleepcv.notify_one();
+            }
+        }
+
+    public:
+        explicit workstealing_pool( int nworkers ) :
+            injected( INJECT_CAPACITY ), ninjected(0), nsleeping(0), stopping(false), pending(0) {
+            for( int i=0; i<nworkers; ++i ) {
+                workers.emplace_back( new worker_state );
+                workers.back()->rng = 0x9e3779b97f4a7c15ULL * ( i + 1 );
+            }
+        }
+
+        int size() const { return workers.size(); }
+
+        // Queue t.  from is the index of the calling worker, or -1 from outside the pool,
+        // in which case this waits while the injection ring is full.  Workers must pass
+        // their own index, or they could end up waiting on themselves.
+        void submit( T* t, int from=-1 ) {
+            pending.fetch_add( 1 );
+            if ( from >= 0 ) {
+                workers[from]->dq.push( t );
+            } else {
+                injected.enq( t );
+                ninjected.fetch_add( 1 );
+            }
+            wake_one();
+        }
+
+        // Get the next task for worker me, sleeping if there is none.
+        // Returns false once the pool has been shut down.
+        bool next( int me, T*& t ) {
+            while( true ) {
+                if ( workers[me]->dq.pop( t ) ) return true;
+                if ( try_steal( me, t ) ) return true;
+                if ( take_injected( me, t ) ) return true;
+
+                std::unique_lock<std::mutex> lg( sleepmtx );
+                nsleeping.fetch_add( 1 );
+                // Re-check after announcing ourselves, so a submit can't slip by unnoticed.
+                // The fence pairs with wake_one()'s: the deques' relaxed loads below can't
+                // be done before the increment is visible to the submitter.
+                std::atomic_thread_fence( std::memory_order_seq_cst );
+                while( !stopping.load() && !work_visible() ) {
+                    sleepcv.wait( lg );
+                }
+                nsleeping.fetch_sub( 1 );
+                if ( stopping.load() ) return false;
+            }
+        }
+
+        // Count work in progress outside the pool, which wait() waits for just like a
+        // task; balance with done() once it has submitted whatever it leads to
+        void hold() {
+            pending.fetch_add( 1 );
+        }
+
+        // Mark one task finished
+        void done() {
+            if ( pending.fetch_sub( 1 ) == 1 ) {
+                std::lock_guard<std::mutex> lg( donemtx );
+                donecv.notify_all();
+            }
+        }
+
+        // Block until every submitted task is done (including any they submitted)
+        void wait() {
+            std::unique_lock<std::mutex> lg( donemtx );
+            donecv.wait( lg, [this]() { return pending.load() == 0; } );
+        }
+
+        // Make every worker's next() return false
+        void shutdown() {
+            std::lock_guard<std::mutex> lg( sleepmtx );
+            stopping = true;
+            sleepcv.notify_all();
+        }
+    };
+}
+
+#endif